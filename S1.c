@@ -1,9 +1,16 @@
 /* S1.c */
 #include "utils.h"
 #include <asm-generic/socket.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
+#include <time.h>
 
-// Hardcode the S2, S3, S4 IP/port or get them from argv
+// Hardcode the S2, S3, S4 IP/port or get them from S1_TOPOLOGY
 #define S1_PORT 5001
 #define S2_HOST "127.0.0.1"
 #define S2_PORT 6002
@@ -14,25 +21,347 @@
 #define CHUNK 4096
 
 #define S1_FOLDER "S1" // local storage for .c
+// staging files of multipart .c uploads, renamed into S1_FOLDER on commit
+#define S1_STAGE S1_FOLDER ".uploads"
+
+// reactor mode (--epoll) settings: reader threads (--threads) and the
+// most handlers that ever run requests at once (--max-handlers)
+#define REACTOR_THREADS 8
+#define MAX_HANDLERS 64
+
+// connection pool defaults (--pool-size, --pool-idle)
+#define POOL_SIZE 8
+#define POOL_IDLE_SEC 30
+#define POOL_MAX 256
+
+// per-backend deadline for the LIST replies of dispfnames
+#define LIST_TIMEOUT_MS 2000
+// largest LIST reply we accept from a storage server: a full page of the
+// longest names
+#define LIST_REPLY_MAX (LIST_PAGE_MAX * 256)
+
+// the catalog of every node's files, see catalog_open(). Records per DUMP
+// page, small enough for a page of long paths to stay a few MB, and how
+// often nodes that were down at startup are tried again
+#define CATALOG_FILE "S1.catalog"
+#define DUMP_PAGE 2048
+#define CATALOG_RETRY_SEC 5
+
+// the storage servers of every file type, see load_topology(). Copies of
+// a file at most, and storage servers in all: each one is a catalog node of
+// its own next to S1_FOLDER. Servers get RING_POINTS points on the hash
+// ring of their type
+#define S1_TOPOLOGY "S1.topology"
+#define MAX_REPLICAS 4
+#define MAX_BACKENDS (CATALOG_NODES - 1)
+#define RING_POINTS 64
+// a new latency sample counts for 1/EWMA_WEIGHT of the average
+#define EWMA_WEIGHT 8
+// moving files to the servers they hash to once servers were added, see
+// rebalance(): MB/s per server it copies to (--rebalance-rate), how often a
+// pass that left files behind is tried again, and the file that says a
+// pass is due (it survives a restart until the pass is through). A file
+// the synced catalog does not know was removed while its server was down
+// and goes, once it is older than REBALANCE_ORPHAN_SEC (a newer one may
+// be a STORE whose answer is still on its way)
+#define REBALANCE_RATE_MB 8
+#define REBALANCE_RETRY_SEC 30
+#define REBALANCE_FILE "S1.rebalance"
+#define REBALANCE_ORPHAN_SEC 60
+// how long S1 waits for a storage server to accept a connection
+// (--connect-timeout) and to start answering a request, or for more of the
+// answer (--reply-timeout). A server that failed BREAKER_FAILS times in a
+// row, to connect or to answer, is not asked at all until a probe, every
+// BREAKER_PROBE_MS, gets an answer to a LIST from it again. Then the next
+// failure opens the breaker again at once, until an exchange ends cleanly
+#define CONNECT_TIMEOUT_MS 1000
+#define REPLY_TIMEOUT_MS 10000
+#define BREAKER_FAILS 3
+#define BREAKER_PROBE_MS 1000
 
 int connect_to(const char *host, int port);
 
+// storage servers S1 talks to. Each keeps a pool of warm connections:
+// handle_client() on the other side serves any number of commands on one
+// socket, so there is no reason to pay a handshake (and leave a TIME_WAIT
+// behind) for every request. Without a topology file there are just S2, S3
+// and S4 (and the --replica servers)
+enum { BE_S2, BE_S3, BE_S4 };
+
+struct backend {
+  const char *name;
+  const char *host;
+  int port;
+  pthread_mutex_t lock;
+  int nidle;
+  int idle[POOL_MAX];
+  time_t since[POOL_MAX]; // when the connection went idle
+};
+
+struct backend backends[MAX_BACKENDS] = {
+    {"S2", S2_HOST, S2_PORT, PTHREAD_MUTEX_INITIALIZER, 0, {0}, {0}},
+    {"S3", S3_HOST, S3_PORT, PTHREAD_MUTEX_INITIALIZER, 0, {0}, {0}},
+    {"S4", S4_HOST, S4_PORT, PTHREAD_MUTEX_INITIALIZER, 0, {0}, {0}},
+};
+int nbackends = 3;
+
+// a point of a server on a hash ring
+struct ring_point {
+  uint32_t hash;
+  int be;
+};
+
+// the servers a file type is spread over. A path hashes to a point on the
+// ring, the first copies servers from there on (clockwise) own it: a
+// STORE goes to all of them, a read to whichever is least busy. Multipart
+// uploads only go to the first owner and are copied to the others once
+// committed. Adding a server only moves the paths next to its points
+struct tier {
+  const char *ext;
+  int n;
+  int copies;
+  int be[MAX_BACKENDS];
+  int nring;
+  struct ring_point *ring;
+};
+
+struct tier tiers[] = {{".pdf", 1, 1, {BE_S2}, 0, NULL},
+                       {".txt", 1, 1, {BE_S3}, 0, NULL},
+                       {".zip", 1, 1, {BE_S4}, 0, NULL},
+                       {NULL, 0, 0, {0}, 0, NULL}};
+
+// how busy a storage server is: requests under way and a moving average of
+// how long it takes to start answering one. Shared memory, so the client
+// processes of fork mode see each other's requests
+struct be_load {
+  long inflight;
+  long ewma_us;
+};
+struct be_load *loads;
+// a circuit breaker per storage server: exchanges that failed in a row, and
+// whether it is open (every request to the server fails at once, only
+// breaker_thread() tries it). Shared memory like loads
+struct breaker {
+  int fails;
+  int open;
+};
+struct breaker *breakers;
+int pool_size = POOL_SIZE;
+int pool_idle = POOL_IDLE_SEC;
+// how long dispfnames waits for the storage servers (--list-timeout)
+int list_timeout = LIST_TIMEOUT_MS;
+// bandwidth of a rebalancing pass in MB/s (--rebalance-rate), 0 for none
+int rebalance_rate = REBALANCE_RATE_MB;
+// --connect-timeout and --reply-timeout in ms, 0 waits as long as it takes
+int connect_timeout = CONNECT_TIMEOUT_MS;
+int reply_timeout = REPLY_TIMEOUT_MS;
+
+int backend_connect(int be);
+int backend_background(int be);
+void breaker_fail(int be);
+int backend_get(int be);
+void *breaker_thread(void *arg);
+void backend_put(int be, int fd);
+int backend_request(struct conn *bc, int fd, int opcode, const char *arg);
+int backend_send(struct conn *bc, int fd, int opcode, const struct reqbuf *rb);
+int backend_send_data(struct conn *bc, int fd, int opcode,
+                      const struct reqbuf *rb, long len);
+struct tier *tier_for(const char *ext);
+int load_topology(const char *path);
+int add_replica(const char *spec);
+void tier_ring(struct tier *t);
+int tier_owners(const struct tier *t, const char *path, int *be);
+int tier_synced(const struct tier *t);
+int read_order(const struct tier *t, const char *path, int *order);
+void load_order(int *be, int n);
+void load_begin(int be);
+void load_end(int be);
+void load_sample(int be, const struct timespec *t0);
+int store_fanout(const int *bes, int n, const char *dest, struct conn *src,
+                 long size);
+void replicate(const int *bes, int n, int be, const char *path);
+
+// last archive of S1_FOLDER for downltar .c, rebuilt when it changed
+struct tar_cache *tarcache;
+
+// every file on every node: node 0 is S1_FOLDER, storage server be is node
+// BE_NODE(be). A file on several replicas is listed once, with the node
+// that stored it last. downlf and dispfnames answer from it for synced
+// nodes
+struct catalog *catalog;
+#define NODE_LOCAL 0
+#define BE_NODE(be) ((be) + 1)
+#define NODE_BE(node) ((node) - 1)
+
+// command strings of clients that predate protocol v2
+static const struct legacy_cmd legacy_cmds[] = {
+    {"uploadf", OP_UPLOADF, 2},   {"downlf", OP_DOWNLF, 1},
+    {"removef", OP_REMOVEF, 1},   {"downltar", OP_DOWNLTAR, 1},
+    {"dispfnames", OP_DISPFNAMES, 1}, {NULL, 0, 0}};
+
 void prcclient(int connfd);
-void uploadf(int connfd, char *filename, char *dest);
-void downlf(int connfd, char *path);
-void removef(int connfd, char *path);
-void downltar(int connfd, char *filetype);
-void dispfnames(int connfd, char *path);
+int run_request(struct conn *c, struct request *r);
+void run_reactor(int listenfd, int nthreads, int maxhandlers);
+int uploadf(struct conn *c, const char *filename, const char *dest);
+int store_local(struct conn *c, const char *baseName, const char *dest,
+                long fsize);
+int upload_session(struct conn *c, const struct request *r, const char *name,
+                   const char *dest);
+void downlf(struct conn *c, const char *path, int ranged, long off, long len);
+void removef(const char *path);
+int downltar(struct conn *c, const char *filetype);
+void dispfnames(struct conn *c, const char *path, long page,
+                const char *cursor);
+int sync_catalog(void);
+void catalog_nodes(void);
+void *catalog_thread(void *arg);
+int rebalance(void);
+void *rebalance_thread(void *arg);
 
 const char *get_file_extension(const char *filename) {
   const char *dot = strrchr(filename, '.');
   return dot ? dot : "";
 }
 
-int main() {
-  mkdir(S1_FOLDER, 0777);
+int main(int argc, char **argv) {
+  // default is one forked process per client, --epoll switches to the
+  // reactor, --threads N reads requests with N threads and runs them on up
+  // to N handlers (more while those are stuck, never more than
+  // --max-handlers N; requests past that wait in the queue).
+  // --pool-size N keeps up to N idle connections per storage server
+  // (0 turns pooling off), --pool-idle SEC drops them after SEC idle seconds.
+  // --list-timeout MS is how long dispfnames waits for a storage server.
+  // --topology FILE reads the storage servers from FILE instead of
+  // S1_TOPOLOGY. --replica .pdf=HOST:PORT adds a .pdf server and a copy of
+  // every .pdf file (repeatable, for every type but .c).
+  // --rebuild-catalog throws the catalog away and asks every node again.
+  // --rebalance-rate MB caps the moves after servers were added at MB/s
+  // (0 turns them off), --rebalance makes a pass even if none is due.
+  // --connect-timeout MS and --reply-timeout MS bound the waits for a
+  // storage server. --io-timeout SEC, --min-rate KB and --idle-timeout SEC
+  // are the transfer deadlines of utils.h
+  int use_epoll = 0;
+  int force_rebalance = 0;
+  int nthreads = REACTOR_THREADS;
+  int maxhandlers = MAX_HANDLERS;
+  const char *topology = NULL;
+  const char *replicas[MAX_BACKENDS];
+  int nreplicas = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--epoll") == 0) {
+      use_epoll = 1;
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      nthreads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-handlers") == 0 && i + 1 < argc) {
+      maxhandlers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--pool-size") == 0 && i + 1 < argc) {
+      pool_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--pool-idle") == 0 && i + 1 < argc) {
+      pool_idle = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--list-timeout") == 0 && i + 1 < argc) {
+      list_timeout = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--topology") == 0 && i + 1 < argc) {
+      topology = argv[++i];
+    } else if (strcmp(argv[i], "--replica") == 0 && i + 1 < argc &&
+               nreplicas < MAX_BACKENDS) {
+      replicas[nreplicas++] = argv[++i];
+    } else if (strcmp(argv[i], "--rebuild-catalog") == 0) {
+      unlink(CATALOG_FILE);
+      unlink(CATALOG_FILE ".log");
+    } else if (strcmp(argv[i], "--rebalance-rate") == 0 && i + 1 < argc) {
+      rebalance_rate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--rebalance") == 0) {
+      force_rebalance = 1;
+    } else if (strcmp(argv[i], "--connect-timeout") == 0 && i + 1 < argc) {
+      connect_timeout = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--reply-timeout") == 0 && i + 1 < argc) {
+      reply_timeout = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--io-timeout") == 0 && i + 1 < argc) {
+      io_timeout = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--min-rate") == 0 && i + 1 < argc) {
+      io_min_rate = atol(argv[++i]) * 1024;
+    } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+      idle_timeout = atoi(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "usage: %s [--epoll] [--threads N] [--max-handlers N] "
+              "[--pool-size N] "
+              "[--pool-idle SEC] [--list-timeout MS] "
+              "[--topology FILE] [--replica EXT=HOST:PORT] "
+              "[--rebuild-catalog] [--rebalance-rate MB] [--rebalance] "
+              "[--connect-timeout MS] [--reply-timeout MS] "
+              "[--io-timeout SEC] [--min-rate KB] [--idle-timeout SEC]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (nthreads < 1)
+    nthreads = 1;
+  if (maxhandlers < nthreads)
+    maxhandlers = nthreads;
+  if (pool_size < 0)
+    pool_size = 0;
+  if (pool_size > POOL_MAX)
+    pool_size = POOL_MAX;
+  if (!topology && access(S1_TOPOLOGY, F_OK) == 0)
+    topology = S1_TOPOLOGY;
+  if (topology && load_topology(topology) < 0)
+    exit(1);
+  for (int i = 0; i < nreplicas; i++) {
+    if (add_replica(replicas[i]) < 0) {
+      fprintf(stderr, "%s: bad or one too many --replica %s\n", argv[0],
+              replicas[i]);
+      exit(1);
+    }
+  }
+  for (struct tier *t = tiers; t->ext; t++)
+    tier_ring(t);
 
-  int socketfd, con_sd;
+  mkdir(S1_FOLDER, 0777);
+  // shared memory, so create it before any fork
+  tarcache = tar_cache_create(S1_FOLDER);
+  loads = (struct be_load *)mmap(NULL, sizeof(*loads) * MAX_BACKENDS,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  breakers = (struct breaker *)mmap(NULL, sizeof(*breakers) * MAX_BACKENDS,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (loads == MAP_FAILED || breakers == MAP_FAILED) {
+    perror("[S1] mmap");
+    exit(1);
+  }
+  for (struct tier *t = tiers; t->ext; t++)
+    if (t->n > 1)
+      printf("[S1] %s files on %d servers, %d %s of each\n", t->ext, t->n,
+             t->copies < t->n ? t->copies : t->n,
+             t->copies > 1 ? "copies" : "copy");
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  catalog_nodes();
+  catalog = catalog_open(CATALOG_FILE);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (catalog)
+    printf("[S1] Catalog: %ld files and folders, loaded in %.2f s\n",
+           catalog_count(catalog),
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+  else
+    printf("[S1] No catalog, every request goes to the nodes\n");
+  // nodes the catalog has never seen are dumped now; those that are down
+  // are tried again in the background until they answer
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, breaker_thread, NULL) == 0)
+    pthread_detach(tid);
+  if (catalog && sync_catalog() > 0 &&
+      pthread_create(&tid, NULL, catalog_thread, NULL) == 0)
+    pthread_detach(tid);
+  // files of servers that were added move over in the background while
+  // the clients are served
+  if (rebalance_rate > 0 &&
+      (force_rebalance || access(REBALANCE_FILE, F_OK) == 0) &&
+      pthread_create(&tid, NULL, rebalance_thread, NULL) == 0)
+    pthread_detach(tid);
+
+  int socketfd;
   struct sockaddr_in servAdd;
   memset(&servAdd, 0, sizeof(servAdd));
   socketfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -41,6 +370,8 @@ int main() {
     perror("Socket error");
     exit(1);
   }
+  int opt = 1;
+  setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
   servAdd.sin_family = AF_INET;
   servAdd.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -51,13 +382,21 @@ int main() {
     exit(1);
   }
 
-  if (listen(socketfd, 6) < 0) {
+  if (listen(socketfd, SOMAXCONN) < 0) {
     perror("Listen error");
     exit(1);
   }
 
   printf("S1 listening on port %d...\n", S1_PORT);
 
+  if (use_epoll) {
+    printf("[S1] epoll reactor with %d threads\n", nthreads);
+    run_reactor(socketfd, nthreads, maxhandlers);
+    return 0;
+  }
+
+  // children that are done go away without a wait()
+  signal(SIGCHLD, SIG_IGN);
   while (1) {
     struct sockaddr_in clientaddr;
     socklen_t clen = sizeof(clientaddr);
@@ -68,6 +407,7 @@ int main() {
     }
     if (fork() == 0) {
       close(socketfd);
+      sock_deadlines(connfd);
       prcclient(connfd);
       close(connfd);
       exit(0);
@@ -80,313 +420,854 @@ int main() {
 
 // infinite loop reading commands from client and runs functions accordingly
 void prcclient(int connfd) {
+  struct request req;
+  struct conn c;
+  // break out of loop if client disconnected or if socket error occurs
+  while (recv_request(connfd, &c, &req, legacy_cmds) == 0) {
+    if (run_request(&c, &req) < 0)
+      break;
+  }
+}
+
+// one stream of a multiplexed connection, closed once the client ends it
+static void serve_stream(int fd) {
+  prcclient(fd);
+  close(fd);
+}
+
+// run one parsed request, v2 or legacy. Shared by the fork model and the
+// reactor, so it has to be thread safe.
+// Returns -1 if the connection should be closed
+int run_request(struct conn *c, struct request *r) {
+  const char *arg0 = request_str(r, 0);
+  const char *arg1 = request_str(r, 1);
+
+  switch (r->f.opcode) {
+  case OP_HELLO:
+    // multiplexing: once agreed on, the connection belongs to the mux
+    // engine until the client goes away, and every stream is served like a
+    // connection of its own. HELLO_LZ only tells the client we understand
+    // compressed data frames, it flags each request it wants them for
+    if (r->f.flags & HELLO_MUX) {
+      if (send_frame(c->fd, OP_HELLO, HELLO_MUX | (r->f.flags & HELLO_LZ),
+                     c->reqid, 0) < 0)
+        return -1;
+      mux_serve(c->fd, serve_stream);
+      return -1;
+    }
+    return send_frame(c->fd, OP_HELLO, r->f.flags & HELLO_LZ, c->reqid, 0);
+  case OP_UPLOADF:
+    // the file data follows the request, so a bad request cannot be skipped
+    if (!arg0 || !arg1)
+      return -1;
+    return uploadf(c, arg0, arg1);
+  case OP_UPLOAD_OPEN:
+  case OP_UPLOAD_PART:
+  case OP_UPLOAD_COMMIT:
+    // a part's data follows the request, so a bad request cannot be skipped
+    if (!arg0 || !arg1)
+      return -1;
+    return upload_session(c, r, arg0, arg1);
+  case OP_DOWNLF:
+    if (arg0) {
+      // optional byte range: offset and length after the path
+      uint64_t off = 0, len = 0;
+      int ranged = request_u64(r, 1, &off) == 0;
+      if (ranged)
+        request_u64(r, 2, &len);
+      if (off > LONG_MAX)
+        off = LONG_MAX;
+      if (len > LONG_MAX)
+        len = 0;
+      downlf(c, arg0, ranged, (long)off, (long)len);
+    }
+    break;
+  case OP_REMOVEF:
+    if (arg0)
+      removef(arg0);
+    break;
+  case OP_DOWNLTAR:
+    if (arg0)
+      return downltar(c, arg0);
+    break;
+  case OP_DISPFNAMES:
+    if (arg0) {
+      // optional page size and the cursor a previous page ended with
+      uint64_t page = 0;
+      request_u64(r, 1, &page);
+      if (page > LIST_PAGE_MAX)
+        page = LIST_PAGE_MAX;
+      dispfnames(c, arg0, (long)page, request_str(r, 2));
+    }
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// epoll reactor (--epoll)
+//
+// Every client socket is non-blocking and registered edge-triggered +
+// oneshot on one shared epoll instance. A fixed set of threads waits on it.
+// While a client is idle the only thing it costs is a struct rconn; the
+// connection walks through RC_HDR -> RC_BODY as the request header (4 bytes
+// for a legacy string, FRAME_HDR_LEN for v2) and its payload arrive in
+// pieces. The reactor threads only do that framing: a fully buffered
+// request goes to a handler thread, which switches the socket to blocking,
+// runs the regular request handler and then re-arms the socket, so a client
+// that is slow to read its download holds a handler but never the reactor.
+// Up to nthreads handlers are started as needed. If the queue does not move
+// for RUNNER_TICK_MS because all of them are stuck with slow clients,
+// runner_monitor() starts one more for every request waiting, so those
+// cannot hold up the rest, but never more than maxhandlers in all: past
+// that requests wait in the queue until a handler is free again (the
+// transfer deadlines of utils.h see to it that one gets free). Handlers are kept around for RUNNER_IDLE_SEC
+// once they are out of work. Oneshot guarantees only one thread touches a
+// connection at a time. A connection that waits for its next request (or
+// the rest of it) for longer than idle_timeout is shut down by
+// reactor_reaper(), the event that raises closes it.
+
+enum { RC_HDR, RC_BODY };
+
+#define RUNNER_IDLE_SEC 10
+#define RUNNER_TICK_MS 50
+
+struct rconn {
+  int fd;
+  int state;
+  uint32_t need; // bytes expected for the current frame part
+  uint32_t got;  // bytes received so far
+  unsigned char hdr[FRAME_HDR_LEN];
+  struct request *req;
+  struct rconn *next; // in the run queue
+};
+
+// buffered requests waiting for a handler thread
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct rconn *head, *tail;
+  int queued;
+  int idle;     // handlers free to take a request
+  int runners;  // handlers alive
+  int max;      // handlers started without waiting for the monitor
+  int cap;      // handlers there ever are at once
+  int full;     // the monitor found all cap of them stuck
+  long taken;   // requests taken off the queue so far
+} runq = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL,
+          0, 0, 0, 0, 0, 0, 0};
+
+static int reactor_epfd = -1;
+static int reactor_listenfd = -1;
+
+// by fd: since when the connection waits for a request, 0 while one runs.
+// reactor_lock keeps the reaper from shutting down an fd that was just
+// closed and handed out again
+static time_t *reactor_idle;
+static long reactor_maxfd, reactor_top;
+static pthread_mutex_t reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void reactor_waiting(int fd, int on) {
+  if (fd < reactor_maxfd)
+    __atomic_store_n(&reactor_idle[fd], on ? time(NULL) : 0,
+                     __ATOMIC_RELAXED);
+}
+
+static void reactor_arm(int fd, void *ptr, int op) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+  ev.data.ptr = ptr;
+  if (epoll_ctl(reactor_epfd, op, fd, &ev) < 0)
+    perror("[S1] epoll_ctl");
+}
+
+static void rconn_close(struct rconn *c) {
+  // closing the fd also removes it from the epoll set
+  pthread_mutex_lock(&reactor_lock);
+  reactor_waiting(c->fd, 0);
+  close(c->fd);
+  pthread_mutex_unlock(&reactor_lock);
+  free(c->req);
+  free(c);
+}
+
+// the header is complete: set up the request and how much payload follows
+static int rconn_start(struct rconn *c) {
+  struct request *r = (struct request *)malloc(sizeof(*r));
+  if (!r)
+    return -1;
+  c->req = r;
+  memset(&r->f, 0, sizeof(r->f));
+  if (c->need == FRAME_HDR_LEN) {
+    if (frame_decode(c->hdr, &r->f) < 0)
+      return -1;
+  } else {
+    uint32_t len;
+    memcpy(&len, c->hdr, 4);
+    r->f.len = ntohl(len);
+  }
+  if (r->f.len > REQ_MAX_LEN)
+    return -1;
+  c->state = RC_BODY;
+  c->need = r->f.len;
+  c->got = 0;
+  return 0;
+}
+
+// pull as much of the next request as the socket has. We never read past
+// the end of the request because the handler reads its own data (e.g.
+// upload size + data) straight from the socket.
+// Returns 1 when a full request is buffered, 0 when the socket ran dry and
+// -1 on EOF/error
+static int rconn_read(struct rconn *c) {
+  while (1) {
+    if (c->state == RC_BODY && c->got == c->need)
+      return 1;
+    ssize_t n;
+    if (c->state == RC_HDR) {
+      n = recv(c->fd, c->hdr + c->got, c->need - c->got, 0);
+    } else {
+      n = recv(c->fd, c->req->buf + c->got, c->need - c->got, 0);
+    }
+    if (n == 0)
+      return -1;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    c->got += n;
+
+    if (c->state == RC_HDR && c->got == c->need) {
+      uint32_t magic;
+      memcpy(&magic, c->hdr, 4);
+      if (c->need == 4 && ntohl(magic) == PROTO_MAGIC) {
+        // v2 frame, the rest of the header is still to come
+        c->need = FRAME_HDR_LEN;
+        continue;
+      }
+      if (rconn_start(c) < 0)
+        return -1;
+    }
+  }
+}
+
+static void reactor_accept(void) {
   while (1) {
-    char *cmdline = recv_string(connfd);
-    if (!cmdline) {
-      // break out of loop if client disconnected or if socket error occurs
+    int fd = accept4(reactor_listenfd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("[S1] accept");
       break;
     }
-    // parse command
-    char *tok = strtok(cmdline, " ");
-    if (!tok) {
-      free(cmdline);
+    struct rconn *c = (struct rconn *)calloc(1, sizeof(*c));
+    if (!c) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->state = RC_HDR;
+    c->need = 4;
+    sock_deadlines(fd);
+    pthread_mutex_lock(&reactor_lock);
+    if (fd >= reactor_top)
+      reactor_top = fd + 1;
+    reactor_waiting(fd, 1);
+    pthread_mutex_unlock(&reactor_lock);
+    reactor_arm(fd, c, EPOLL_CTL_ADD);
+  }
+  reactor_arm(reactor_listenfd, NULL, EPOLL_CTL_MOD);
+}
+
+// run a buffered request with a blocking socket just like a forked child
+// would, on a handler thread. Returns 1 if the thread left the handlers
+static int rconn_run(struct rconn *c) {
+  io_begin();
+  set_nonblocking(c->fd, 0);
+  struct conn conn;
+  conn.fd = c->fd;
+  int rc = request_finish(&conn, c->req, legacy_cmds);
+  int left = 0;
+  if (rc == 0 && c->req->f.opcode == OP_HELLO &&
+      (c->req->f.flags & HELLO_MUX)) {
+    // a multiplexed connection keeps its thread for as long as it lives,
+    // so that thread is no handler anymore
+    pthread_mutex_lock(&runq.lock);
+    runq.runners--;
+    pthread_mutex_unlock(&runq.lock);
+    left = 1;
+  }
+  if (rc == 0)
+    rc = run_request(&conn, c->req);
+  free(c->req);
+  c->req = NULL;
+  c->state = RC_HDR;
+  c->need = 4;
+  c->got = 0;
+  // a multiplexed connection comes back from run_request only once the
+  // client is gone
+  if (rc < 0) {
+    rconn_close(c);
+    return left;
+  }
+  set_nonblocking(c->fd, 1);
+  reactor_waiting(c->fd, 1);
+  // MOD re-checks readiness, so a command the client already pipelined
+  // behind this one raises a fresh event
+  reactor_arm(c->fd, c, EPOLL_CTL_MOD);
+  return left;
+}
+
+static void *runner_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&runq.lock);
+  while (1) {
+    // counted as idle (by runq_push for a new thread) until it takes a
+    // request
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += RUNNER_IDLE_SEC;
+    int rc = 0;
+    while (!runq.head && rc != ETIMEDOUT)
+      rc = pthread_cond_timedwait(&runq.cond, &runq.lock, &ts);
+    runq.idle--;
+    if (!runq.head)
       break;
+    struct rconn *c = runq.head;
+    runq.head = c->next;
+    if (!runq.head)
+      runq.tail = NULL;
+    runq.queued--;
+    runq.taken++;
+    pthread_mutex_unlock(&runq.lock);
+    if (rconn_run(c))
+      return NULL;
+    pthread_mutex_lock(&runq.lock);
+    runq.idle++;
+  }
+  runq.runners--;
+  pthread_mutex_unlock(&runq.lock);
+  return NULL;
+}
+
+// start a handler that counts as free right away, with runq.lock held
+static int runner_start(void) {
+  pthread_t t;
+  if (pthread_create(&t, NULL, runner_thread, NULL) != 0)
+    return -1;
+  pthread_detach(t);
+  runq.idle++;
+  runq.runners++;
+  return 0;
+}
+
+// requests that wait a whole tick while no handler takes any means all of
+// them are stuck: start one for each, up to runq.cap handlers
+static void *runner_monitor(void *arg) {
+  (void)arg;
+  long last = -1;
+  for (;;) {
+    usleep(RUNNER_TICK_MS * 1000);
+    pthread_mutex_lock(&runq.lock);
+    if (runq.head && runq.taken == last) {
+      while (runq.queued > runq.idle && runq.runners < runq.cap &&
+             runner_start() == 0)
+        ;
+      if (runq.queued > runq.idle && !runq.full)
+        printf("[S1] all %d handlers are busy, requests wait\n",
+               runq.runners);
+      runq.full = runq.queued > runq.idle;
+      pthread_cond_broadcast(&runq.cond);
+    } else if (!runq.head) {
+      runq.full = 0;
     }
+    last = runq.taken;
+    pthread_mutex_unlock(&runq.lock);
+  }
+  return NULL;
+}
 
-    if (strcmp(tok, "uploadf") == 0) {
-      char *filename = strtok(NULL, " ");
-      char *dest = strtok(NULL, " ");
-      if (filename && dest) {
-        uploadf(connfd, filename, dest);
-      }
-    } else if (strcmp(tok, "downlf") == 0) {
-      char *path = strtok(NULL, " ");
-      if (path) {
-        downlf(connfd, path);
-      }
-    } else if (strcmp(tok, "removef") == 0) {
-      char *path = strtok(NULL, " ");
-      if (path) {
-        removef(connfd, path);
-      }
-    } else if (strcmp(tok, "downltar") == 0) {
-      char *ft = strtok(NULL, " ");
-      if (ft) {
-        downltar(connfd, ft);
-      }
-    } else if (strcmp(tok, "dispfnames") == 0) {
-      char *p = strtok(NULL, " ");
-      if (p) {
-        dispfnames(connfd, p);
+// hand a buffered request to the handlers, and start one more if there
+// are more requests waiting than handlers free to take them and fewer than
+// runq.max alive. Handlers that were woken or started but did not get to
+// the queue yet count as free, or a burst would start a thread per
+// request. -1 if there is no handler and none can be started
+static int runq_push(struct rconn *c) {
+  pthread_mutex_lock(&runq.lock);
+  if (runq.queued >= runq.idle &&
+      (runq.runners < runq.max || runq.runners == 0) &&
+      runner_start() < 0) {
+    pthread_mutex_unlock(&runq.lock);
+    return -1;
+  }
+  c->next = NULL;
+  if (runq.tail)
+    runq.tail->next = c;
+  else
+    runq.head = c;
+  runq.tail = c;
+  runq.queued++;
+  pthread_cond_signal(&runq.cond);
+  pthread_mutex_unlock(&runq.lock);
+  return 0;
+}
+
+static void reactor_event(struct rconn *c) {
+  int r = rconn_read(c);
+  if (r < 0) {
+    rconn_close(c);
+    return;
+  }
+  if (r == 0) {
+    reactor_arm(c->fd, c, EPOLL_CTL_MOD);
+    return;
+  }
+  reactor_waiting(c->fd, 0);
+  if (runq_push(c) < 0) {
+    perror("[S1] pthread_create");
+    rconn_close(c);
+  }
+}
+
+static void *reactor_thread(void *arg) {
+  (void)arg;
+  while (1) {
+    struct epoll_event ev;
+    int n = epoll_wait(reactor_epfd, &ev, 1, -1);
+    if (n < 0) {
+      if (errno != EINTR)
+        perror("[S1] epoll_wait");
+      continue;
+    }
+    if (n == 0)
+      continue;
+    if (ev.data.ptr == NULL)
+      reactor_accept();
+    else
+      reactor_event((struct rconn *)ev.data.ptr);
+  }
+  return NULL;
+}
+
+// shut down the connections that waited longer than idle_timeout, once a
+// second
+static void *reactor_reaper(void *arg) {
+  (void)arg;
+  for (;;) {
+    sleep(1);
+    time_t now = time(NULL);
+    pthread_mutex_lock(&reactor_lock);
+    for (long fd = 0; fd < reactor_top; fd++) {
+      time_t t = __atomic_load_n(&reactor_idle[fd], __ATOMIC_RELAXED);
+      if (t && now - t > idle_timeout) {
+        reactor_idle[fd] = 0;
+        shutdown(fd, SHUT_RDWR);
       }
     }
+    pthread_mutex_unlock(&reactor_lock);
+  }
+  return NULL;
+}
 
-    free(cmdline);
+void run_reactor(int listenfd, int nthreads, int maxhandlers) {
+  // a client hanging up mid-transfer must not kill the whole server
+  signal(SIGPIPE, SIG_IGN);
+
+  reactor_listenfd = listenfd;
+  set_nonblocking(listenfd, 1);
+  reactor_maxfd = sysconf(_SC_OPEN_MAX);
+  reactor_idle = (time_t *)calloc(reactor_maxfd, sizeof(time_t));
+  reactor_epfd = epoll_create1(0);
+  if (reactor_epfd < 0 || !reactor_idle) {
+    perror("[S1] epoll_create1");
+    exit(1);
+  }
+  reactor_arm(listenfd, NULL, EPOLL_CTL_ADD);
+  runq.max = nthreads;
+  runq.cap = maxhandlers;
+  pthread_t t;
+  if (pthread_create(&t, NULL, runner_monitor, NULL) != 0) {
+    perror("[S1] pthread_create");
+    exit(1);
+  }
+  pthread_detach(t);
+  if (idle_timeout > 0 &&
+      pthread_create(&t, NULL, reactor_reaper, NULL) == 0)
+    pthread_detach(t);
+
+  for (int i = 1; i < nthreads; i++) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, reactor_thread, NULL) != 0) {
+      perror("[S1] pthread_create");
+      exit(1);
+    }
+    pthread_detach(t);
   }
+  reactor_thread(NULL);
+}
+
+// the path a file goes to on a storage server: dest, or the file's name in
+// dest if that is a folder. It has to be the whole path, it picks the
+// servers
+static void remote_path(const char *baseName, const char *dest,
+                        char *path) {
+  size_t dlen = strlen(dest);
+  snprintf(path, 1024, "%s%s", dest,
+           dlen == 0 || dest[dlen - 1] == '/' ? baseName : "");
+}
+
+// read and throw away len bytes from the client. The data still needs to be
+// read from the socket to keep it usable for the next command
+static void discard_bytes(struct conn *c, long len) {
+  conn_recv_data(c, -1, 0, len);
 }
 
 // upload file to server
-void uploadf(int connfd, char *filename, char *dest) {
-  // read the file size from client in string format
-  char *sz_s = recv_string(connfd);
-  if (!sz_s)
-    return;
-  long fsize = atol(sz_s);
-  free(sz_s);
+// Returns -1 if the client connection is out of sync and has to be closed
+int uploadf(struct conn *c, const char *filename, const char *dest) {
+  // read the file size from client
+  long fsize;
+  if (conn_recv_size(c, &fsize, NULL) < 0)
+    return -1;
 
-  // read and discard data incase of incorrect file size
-  // data still needs to be read from socket to keep it open for
-  // any upcomming connections
   if (fsize <= 0) {
-    char discard[1024];
-    long remain = fsize;
-    while (remain > 0) {
-      long chunk = (remain > 1024) ? 1024 : remain;
-      if (recv_all(connfd, discard, chunk) < 0)
-        break;
-      remain -= chunk;
-    }
     printf("[S1] do_uploadf: zero/invalid file size.\n");
-    return;
+    return 0;
   }
 
-  // Save the incoming data into a temporary file: "<basename>.tmp"
-  // basename being the filename
-  // this is done so absolute paths can be used and it would not create
-  // the directories mentioned in the file path
-  // e.g. if local user file is "/home/rohan/.../hello.c", parse out
-  // "hello.c"
+  // only the basename of the local file matters, e.g. if local user file
+  // is "/home/rohan/.../hello.c", parse out "hello.c"
   // done  by finding last instance of / character, and taking everything after
   // that
-  char *slashPos = strrchr(filename, '/');
+  const char *slashPos = strrchr(filename, '/');
   const char *baseName = (slashPos) ? slashPos + 1 : filename;
 
-  char tmp_path[256];
-  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", baseName);
+  // Decide which file extension gets stored where before any data arrives
+  // c gets stored in S1
+  // pdf gets stored in S2
+  // txt gets stored in S3
+  // zip gets stored in S4
+  // (or on the servers of the type the path hashes to)
+  const char *ext = get_file_extension(baseName);
+  if (strcmp(ext, ".c") == 0)
+    return store_local(c, baseName, dest, fsize);
+  struct tier *t = tier_for(ext);
+  if (!t) {
+    printf("[S1] Unrecognized extension: %s. Discarding.\n", ext);
+    discard_bytes(c, fsize);
+    return 0;
+  }
 
-  FILE *fp = fopen(tmp_path, "wb");
-  // if there is an error creating the file, then read and discard data from
-  // socket
-  if (!fp) {
-    perror("[S1] fopen tmp");
-    char discard[1024];
-    long remain = fsize;
-    while (remain > 0) {
-      long chunk = (remain > 1024) ? 1024 : remain;
-      if (recv_all(connfd, discard, chunk) < 0)
-        break;
-      remain -= chunk;
+  // cut-through: the data goes to every owner of the path as it arrives
+  // instead of being spooled to S1's disk first
+  char path[1024];
+  int owners[MAX_REPLICAS];
+  remote_path(baseName, dest, path);
+  int n = tier_owners(t, path, owners);
+  int stored = store_fanout(owners, n, path, c, fsize);
+  if (stored < 0)
+    return -1;
+  if (stored > 0)
+    printf("[S1] %s forwarded to %d of %d servers\n", ext, stored, n);
+  return 0;
+}
+
+// where an uploaded .c file goes under S1/, creating its folders
+static void local_path(const char *baseName, const char *dest,
+                       char *localpath) {
+  // If user typed something like "/hello.c" for `dest`, to store it
+  // as "S1/hello.c". If user typed "/some/folder/", store it as
+  // "S1/some/folder/<basename>"
+
+  // => We'll handle the "auto-append" logic: if `dest` ends with '/' or is
+  // just '/', append baseName
+  memset(localpath, 0, 1024);
+
+  // "S1/" prefix
+  snprintf(localpath, 1024, "S1/%s", dest);
+  // localpath might be "S1//hello.c" or "S1//some/folder/"
+
+  // fix double slash
+  // if localpath ends with '/', append the baseName
+  size_t dlen = strlen(localpath);
+  if (dlen == 0) {
+    // edge case
+    strcpy(localpath, "S1/hello.c");
+  } else {
+    if (localpath[dlen - 1] == '/') {
+      strncat(localpath, baseName, 1024 - dlen - 1);
     }
+  }
+
+  // e.g. if dest="/hello.c", then localpath="S1//hello.c"
+
+  // separate directory vs. filename
+  char folder[1024];
+  strcpy(folder, localpath);
+  char *lastSlash = strrchr(folder, '/');
+  if (lastSlash) {
+    *lastSlash = '\0'; // now folder is just the directory portion
+    // helper function to create directories within servers
+    create_dirs_if_needed(folder);
+  }
+}
+
+// put a .c file that was just stored under S1/ into the catalog. crc is
+// worked out from the file unless the caller has it
+static void catalog_local(const char *localpath, const uint32_t *crc) {
+  int fd = open(localpath, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0)
+      close(fd);
     return;
   }
+  struct file_meta m = {st.st_size, st.st_mtime, 0, NODE_LOCAL};
+  if (crc)
+    m.crc = *crc;
+  else if (file_crc(fd, &m.crc) < 0)
+    m.crc = 0;
+  close(fd);
+  catalog_put(catalog, localpath + strlen(S1_FOLDER), &m);
+}
 
-  // Actually receive the file data this time
-  long remain = fsize;
+// store an uploaded .c file under S1/
+int store_local(struct conn *c, const char *baseName, const char *dest,
+                long fsize) {
+  // Save the incoming data into a temporary file: "<basename>.tmpXXXXXX" and
+  // rename it once it is complete. This is done so absolute paths can be used
+  // and it would not create the directories mentioned in the file path. Each
+  // upload gets a name of its own, two of the same file may run at once
+  char tmp_path[256];
+  int fd = open_temp(baseName, tmp_path, sizeof(tmp_path));
+  // if there is an error creating the file, then read and discard data from
+  // socket
+  if (fd < 0) {
+    perror("[S1] open tmp");
+    discard_bytes(c, fsize);
+    return 0;
+  }
 
-  // Recieve it in chunks of 4KB just to decrease number of IO operations, like
-  // in clients program
-  char buf[CHUNK];
-  while (remain > 0) {
-    long toread = (remain > CHUNK) ? CHUNK : remain;
-    if (recv_all(connfd, buf, toread) < 0) {
+  // Actually receive the file data this time, unpacking it if it comes
+  // compressed. On a write error the rest is still read off the socket
+  int rc = conn_recv_data(c, fd, 0, fsize);
+  close(fd);
+  if (rc < 0) {
+    if (rc == -1)
       printf("[S1] Error receiving file data.\n");
-      break;
-    }
+    else
+      perror("[S1] write");
+    remove(tmp_path);
+    return rc == -1 ? -1 : 0;
+  }
 
-    // size_t is unsigned int, so better to use it in case of overflow
-    size_t written = fwrite(buf, 1, toread, fp);
-    // break if write error
-    if (written != (size_t)toread) {
-      perror("[S1] fwrite");
-      break;
-    }
-    remain -= toread;
+  char localpath[1024];
+  local_path(baseName, dest, localpath);
+
+  // rename from tmp to final local path
+  if (rename(tmp_path, localpath) != 0) {
+    perror("[S1] rename failed");
+    printf("From: %s\nTo: %s\n", tmp_path, localpath);
+    remove(tmp_path); // fallback
+  } else {
+    tar_cache_bump(tarcache);
+    catalog_local(localpath, NULL);
+    printf("[S1] Stored .c => %s\n", localpath);
+  }
+  return 0;
+}
+
+// multipart uploads (uploadf -n, see stage_open()): .c sessions are staged
+// here, everything else goes to the storage server the file name picks,
+// as for uploadf. Every answer is a size, 0 meaning it failed.
+// Returns -1 if the client connection is out of sync and has to be closed
+int upload_session(struct conn *c, const struct request *r, const char *name,
+                   const char *dest) {
+  // OPEN: size. PART: id, offset + the data. COMMIT: id
+  uint64_t a = 0, b = 0;
+  request_u64(r, 2, &a);
+  request_u64(r, 3, &b);
+  int opcode = r->f.opcode;
+  long len = 0;
+  if (opcode == OP_UPLOAD_PART && conn_recv_size(c, &len, NULL) < 0)
+    return -1;
+  // parts land at their offsets as they are, they are never compressed
+  if (c->packed) {
+    discard_bytes(c, len);
+    return conn_send_value(c, 0);
   }
-  fclose(fp);
 
-  // Decide which file extension gets stored where
-  // c gets stored in S1
-  // pdf gets stored in S2
-  // txt gets stored in S3
-  // zip gets stored in S4
+  const char *slashPos = strrchr(name, '/');
+  const char *baseName = (slashPos) ? slashPos + 1 : name;
   const char *ext = get_file_extension(baseName);
+  long res = -1;
+  struct tier *t = NULL;
   if (strcmp(ext, ".c") == 0) {
-    // If user typed something like "/hello.c" for `dest`, to store it
-    // as "S1/hello.c". If user typed "/some/folder/", store it as
-    // "S1/some/folder/<basename>"
-
-    // => We'll handle the "auto-append" logic: if `dest` ends with '/' or is
-    // just '/', append baseName
-    char localpath[1024];
-    memset(localpath, 0, sizeof(localpath));
-
-    // "S1/" prefix
-    snprintf(localpath, sizeof(localpath), "S1/%s", dest);
-    // localpath might be "S1//hello.c" or "S1//some/folder/"
-
-    // fix double slash
-    // if localpath ends with '/', append the baseName
-    size_t dlen = strlen(localpath);
-    if (dlen == 0) {
-      // edge case
-      strcpy(localpath, "S1/hello.c");
+    if (opcode == OP_UPLOAD_OPEN) {
+      res = stage_open(S1_STAGE, (long)a);
+    } else if (opcode == OP_UPLOAD_PART) {
+      int rc = stage_part(S1_STAGE, (long)a, c->fd, (long)b, len);
+      if (rc == -2)
+        return -1;
+      res = rc == 0 ? len : 0;
     } else {
-      if (localpath[dlen - 1] == '/') {
-        strcat(localpath, baseName);
+      char localpath[1024];
+      local_path(baseName, dest, localpath);
+      uint32_t crc = 0;
+      res = stage_commit(S1_STAGE, (long)a, localpath, NULL, &crc);
+      if (res >= 0) {
+        tar_cache_bump(tarcache);
+        catalog_local(localpath, &crc);
+        printf("[S1] Stored .c => %s\n", localpath);
       }
     }
+    return conn_send_value(c, res > 0 ? res : 0);
+  } else if (!(t = tier_for(ext))) {
+    printf("[S1] Unrecognized extension: %s. Discarding.\n", ext);
+    discard_bytes(c, len);
+    return conn_send_value(c, 0);
+  }
+  // the session lives on the first owner of the path, the others get the
+  // finished file
+  char path[1024];
+  int owners[MAX_REPLICAS];
+  remote_path(baseName, dest, path);
+  int nowners = tier_owners(t, path, owners);
+  int be = owners[0];
+
+  // the same request to the storage server, without the file name
+  int op = opcode == OP_UPLOAD_OPEN   ? OP_OPEN
+           : opcode == OP_UPLOAD_PART ? OP_PART
+                                      : OP_COMMIT;
+  struct conn bc;
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  int rc = reqbuf_str(&rb, path) | reqbuf_u64(&rb, a);
+  if (op == OP_PART)
+    rc |= reqbuf_u64(&rb, b);
+  int fd = backend_get(be);
+  if (fd < 0 || rc < 0 ||
+      (op == OP_PART ? backend_send_data(&bc, fd, op, &rb, len)
+                     : backend_send(&bc, fd, op, &rb)) < 0) {
+    printf("[S1] forward to %s failed\n", backends[be].name);
+    if (fd >= 0 && rc == 0)
+      breaker_fail(be);
+    if (fd >= 0)
+      close(fd);
+    discard_bytes(c, len);
+    return conn_send_value(c, 0);
+  }
+  if (op == OP_PART && relay(c->fd, fd, len) < 0) {
+    close(fd);
+    printf("[S1] forward to %s failed\n", backends[be].name);
+    return -1;
+  }
+  // COMMIT is answered with the catalog record of the stored file (none if
+  // it failed), the rest with a size
+  int ok;
+  char key[1024] = "";
+  if (op == OP_COMMIT) {
+    size_t alen;
+    struct file_meta m = {0, 0, 0, 0};
+    char *ack = conn_recv_blob(&bc, &alen);
+    ok = ack && catalog_recv(catalog, BE_NODE(be), ack, alen, &m, key,
+                             sizeof(key)) >= 0;
+    res = ok ? m.size : 0;
+    free(ack);
+  } else {
+    ok = conn_recv_size(&bc, &res, NULL) == 0;
+  }
+  if (!ok) {
+    close(fd);
+    breaker_fail(be);
+    res = 0;
+  } else {
+    backend_put(be, fd);
+  }
+  if (op == OP_COMMIT && res > 0 && nowners > 1 && key[0])
+    replicate(owners + 1, nowners - 1, be, key);
+  return conn_send_value(c, res);
+}
 
-    // e.g. if dest="/hello.c", then localpath="S1//hello.c"
-
-    // separate directory vs. filename
-    char folder[1024];
-    strcpy(folder, localpath);
-    char *lastSlash = strrchr(folder, '/');
-    if (lastSlash) {
-      *lastSlash = '\0'; // now folder is just the directory portion
-      // helper function to create directories within servers
-      create_dirs_if_needed(folder);
-    }
-
-    // rename from tmp to final local path
-    if (rename(tmp_path, localpath) != 0) {
-      perror("[S1] rename failed");
-      printf("From: %s\nTo: %s\n", tmp_path, localpath);
-      remove(tmp_path); // fallback
-    } else {
-      printf("[S1] Stored .c => %s\n", localpath);
-    }
+// ask storage server be for path (or the range of it) and pass the answer
+// on to the client. Returns -1 if the server failed or does not have the
+// file before anything was sent, so the caller can try another replica
+static int downlf_from(struct conn *c, int be, const char *path, int ranged,
+                       long off, long len) {
+  int remoteSock = backend_get(be);
+  // exit if there's a socket error
+  if (remoteSock < 0)
+    return -1;
 
-  } else if (strcmp(ext, ".pdf") == 0) {
-    // Connect to S2, forward
-    int s2fd = connect_to(S2_HOST, S2_PORT);
-    if (s2fd < 0) {
-      printf("[S1] Cannot connect S2\n");
-      remove(tmp_path);
-      return;
-    }
+  // telling other servers that file is being downloaded so it needs to get
+  // the data, the server answers with the size (file size and range
+  // length for a range)
+  struct conn bc;
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  long sz, n;
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  load_begin(be);
+  int rc = reqbuf_str(&rb, path);
+  if (rc == 0 && ranged)
+    rc = reqbuf_u64(&rb, off) | reqbuf_u64(&rb, len);
+  if (rc < 0 || backend_send(&bc, remoteSock, OP_GET, &rb) < 0 ||
+      conn_recv_range(&bc, &sz, &n) < 0) {
+    // exit if we dont get size
+    load_end(be);
+    close(remoteSock);
+    if (rc == 0)
+      breaker_fail(be);
+    return -1;
+  }
+  load_sample(be, &t0);
+  if (sz == 0) {
+    // not there, or empty, which serves the client the same
+    load_end(be);
+    backend_put(be, remoteSock);
+    return -1;
+  }
 
-    // telling s2 that file is being uploaded so it needs to store the data
-    send_string(s2fd, "STORE");
-    // S2 expects path + size + data
-    // We'll pass the same 'dest' (like "/folder1"), S2 will interpret
-    // it as "/folder1"
-    send_string(s2fd, dest);
-
-    // find actual size of the tmp file on disk
-    struct stat stt;
-    stat(tmp_path, &stt);
-    long real_size = stt.st_size;
-    char stmp[64];
-    sprintf(stmp, "%ld", real_size);
-    // send file size to S2
-    send_string(s2fd, stmp);
-
-    // send file to S2
-    FILE *fpp = fopen(tmp_path, "rb");
-    if (fpp) {
-      while (!feof(fpp)) {
-        size_t r = fread(buf, 1, CHUNK, fpp);
-        if (r > 0) {
-          if (send_all(s2fd, buf, r) < 0) {
-            printf("[S1] forward to S2 failed\n");
-            break;
-          }
-        }
-      }
-      fclose(fpp);
-    }
-    close(s2fd);
-    // remove local tmp
-    remove(tmp_path);
-    printf("[S1] .pdf forwarded to S2\n");
-  } else if (strcmp(ext, ".txt") == 0) {
-    // Connect to S3, do same thing
-    int s3fd = connect_to(S3_HOST, S3_PORT);
-    if (s3fd < 0) {
-      printf("[S1] Cannot connect S3\n");
-      remove(tmp_path);
-      return;
-    }
-    send_string(s3fd, "STORE");
-    send_string(s3fd, dest);
-    struct stat stt;
-    stat(tmp_path, &stt);
-    long real_size = stt.st_size;
-    char stmp[64];
-    sprintf(stmp, "%ld", real_size);
-    send_string(s3fd, stmp);
-
-    FILE *fpp = fopen(tmp_path, "rb");
-    if (fpp) {
-      while (!feof(fpp)) {
-        size_t r = fread(buf, 1, CHUNK, fpp);
-        if (r > 0) {
-          if (send_all(s3fd, buf, r) < 0) {
-            printf("[S1] forward to S3 failed\n");
-            break;
-          }
-        }
-      }
-      fclose(fpp);
-    }
-    close(s3fd);
-    remove(tmp_path);
-    printf("[S1] .txt forwarded to S3\n");
-  } else if (strcmp(ext, ".zip") == 0) {
-    // Connect to S4, do same thing
-    int s4fd = connect_to(S4_HOST, S4_PORT);
-    if (s4fd < 0) {
-      printf("[S1] Cannot connect S4\n");
-      remove(tmp_path);
-      return;
-    }
-    send_string(s4fd, "STORE");
-    send_string(s4fd, dest);
-    struct stat stt;
-    stat(tmp_path, &stt);
-    long real_size = stt.st_size;
-    char stmp[64];
-    sprintf(stmp, "%ld", real_size);
-    send_string(s4fd, stmp);
-
-    FILE *fpp = fopen(tmp_path, "rb");
-    if (fpp) {
-      while (!feof(fpp)) {
-        size_t r = fread(buf, 1, CHUNK, fpp);
-        if (r > 0) {
-          if (send_all(s4fd, buf, r) < 0) {
-            printf("[S1] forward to S4 failed\n");
-            break;
-          }
-        }
-      }
-      fclose(fpp);
-    }
-    close(s4fd);
-    remove(tmp_path);
-    printf("[S1] .zip forwarded to S4\n");
+  // forward size to client, then pass file data from server to client
+  // inside the kernel (or compressed)
+  if (conn_send_data(c, ranged ? sz : -1, remoteSock, -1, n) < 0) {
+    printf("[S1] downlf relay error\n");
+    close(remoteSock);
   } else {
-    // Unknown extension => or discard?
-    printf("[S1] Unrecognized extension: %s. Removing tmp.\n", ext);
-    remove(tmp_path);
+    backend_put(be, remoteSock);
   }
+  load_end(be);
+  return 0;
 }
 
-// 2) downlf
-void downlf(int connfd, char *path) {
+// 2) downlf, the whole file or the byte range [off, off + len) of it when
+// ranged (len 0 means up to the end)
+void downlf(struct conn *c, const char *path, int ranged, long off, long len) {
   const char *ext = get_file_extension(path);
-  int remoteSock = -1;
-  int localFlag = 0;
-
-  if (strcmp(ext, ".c") == 0) {
-    localFlag = 1;
-  } else if (strcmp(ext, ".pdf") == 0) {
-    remoteSock = connect_to(S2_HOST, S2_PORT);
-  } else if (strcmp(ext, ".txt") == 0) {
-    remoteSock = connect_to(S3_HOST, S3_PORT);
-  } else if (strcmp(ext, ".zip") == 0) {
-    remoteSock = connect_to(S4_HOST, S4_PORT);
+  int localFlag = strcmp(ext, ".c") == 0;
+  struct tier *t = localFlag ? NULL : tier_for(ext);
+  // zip archives are compressed already, do not even try
+  if (strcmp(ext, ".zip") == 0)
+    c->lz = 0;
+
+  // a file the catalog of a synced node does not know is not there. It may
+  // be on any server of its type, so for those it takes all of them
+  struct file_meta m;
+  int synced = localFlag ? catalog_synced(catalog, NODE_LOCAL)
+                         : t && tier_synced(t);
+  if (synced &&
+      (catalog_get(catalog, path, &m) < 0 || m.size < 0 ||
+       (localFlag && m.node != NODE_LOCAL))) {
+    conn_send_size(c, 0);
+    return;
   }
 
   if (localFlag) {
@@ -395,81 +1276,43 @@ void downlf(int connfd, char *path) {
     char localpath[1024];
     snprintf(localpath, sizeof(localpath), "S1/%s", path);
 
-    FILE *fp = fopen(localpath, "rb");
-    if (!fp) {
-      // send "0" for file size, which means file doesn't exist, or there was an
+    int fd = open(localpath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+      // send 0 for file size, which means file doesn't exist, or there was an
       // error opening the file
-      send_string(connfd, "0");
-      return;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    long sz = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    char stmp[64];
-    sprintf(stmp, "%ld", sz);
-    // send file size
-    send_string(connfd, stmp);
-
-    char buf[CHUNK];
-    // send file in chunks
-    while (!feof(fp)) {
-      size_t r = fread(buf, 1, CHUNK, fp);
-      if (r > 0) {
-        if (send_all(connfd, buf, r) < 0) {
-          printf("[S1] downlf send error\n");
-          break;
-        }
-      }
-    }
-    fclose(fp);
-
-  } else {
-    // forward to S2, S3, S4
-
-    // exit if there's a socket error
-    if (remoteSock < 0) {
-      send_string(connfd, "0");
+      if (fd >= 0)
+        close(fd);
+      conn_send_size(c, 0);
       return;
     }
+    long sz = st.st_size;
+
+    // send file size, or for a range the file size and the range length,
+    // then the file straight from the page cache (or compressed)
+    long n = sz;
+    if (ranged)
+      n = range_len(sz, off, len);
+    else
+      off = 0;
+    if (conn_send_data(c, ranged ? sz : -1, fd, off, n) < 0)
+      printf("[S1] downlf send error\n");
+    close(fd);
+    return;
+  }
 
-    // telling other servers that file is being downloaded so it needs to get
-    // the data
-    send_string(remoteSock, "GET");
-    send_string(remoteSock, path);
-
-    // server sends size
-    char *sizestr = recv_string(remoteSock);
-
-    // exit if we dont get size
-    if (!sizestr) {
-      close(remoteSock);
-      send_string(connfd, "0");
+  // forward to the least busy server that has the file, the next one if it
+  // does not answer
+  int order[MAX_BACKENDS];
+  int n = t ? read_order(t, path, order) : 0;
+  for (int i = 0; i < n; i++)
+    if (downlf_from(c, order[i], path, ranged, off, len) == 0)
       return;
-    }
-
-    // forward size to client
-    send_string(connfd, sizestr);
-    long sz = atol(sizestr);
-    free(sizestr);
-
-    // read file data from server, then send to client
-    char buf[CHUNK];
-    while (sz > 0) {
-      long toread = (sz > CHUNK) ? CHUNK : sz;
-      if (recv_all(remoteSock, buf, toread) < 0)
-        break;
-      if (send_all(connfd, buf, toread) < 0)
-        break;
-      sz -= toread;
-    }
-    close(remoteSock);
-  }
+  conn_send_size(c, 0);
 }
 
 // 3) removef
-void removef(int connfd, char *path) {
+void removef(const char *path) {
   // if .c => remove local. else connect to S2/S3/S4
   const char *ext = get_file_extension(path);
   if (strcmp(ext, ".c") == 0) {
@@ -479,294 +1322,393 @@ void removef(int connfd, char *path) {
     } else {
       snprintf(localpath, sizeof(localpath), "S1/%s", path);
     }
-    remove(localpath);
-  } else if (strcmp(ext, ".pdf") == 0) {
-    int s2fd = connect_to(S2_HOST, S2_PORT);
-    if (s2fd >= 0) {
-      send_string(s2fd, "REMOVE");
-      send_string(s2fd, path);
-      close(s2fd);
-    }
-  } else if (strcmp(ext, ".txt") == 0) {
-    int s3fd = connect_to(S3_HOST, S3_PORT);
-    if (s3fd >= 0) {
-      send_string(s3fd, "REMOVE");
-      send_string(s3fd, path);
-      close(s3fd);
-    }
-  } else if (strcmp(ext, ".zip") == 0) {
-    int s4fd = connect_to(S4_HOST, S4_PORT);
-    if (s4fd >= 0) {
-      send_string(s4fd, "REMOVE");
-      send_string(s4fd, path);
-      close(s4fd);
-    }
-  } else {
+    if (remove(localpath) == 0)
+      catalog_del(catalog, localpath + strlen(S1_FOLDER));
+    tar_cache_bump(tarcache);
+    return;
+  }
+  struct tier *t = tier_for(ext);
+  if (!t) {
     printf("Unsupported file format!\n");
     return;
   }
+  // from every server that may have it. Each answers with whether there
+  // was a file to remove, the catalog forgets it once any of them did
+  int order[MAX_BACKENDS];
+  int n = read_order(t, path, order);
+  int gone = 0;
+  for (int i = 0; i < n; i++) {
+    int be = order[i];
+    int fd = backend_get(be);
+    if (fd < 0) {
+      printf("[S1] Cannot connect %s, %s stays there\n", backends[be].name,
+             path);
+      continue;
+    }
+    struct conn bc;
+    long removed;
+    if (backend_request(&bc, fd, OP_REMOVE, path) < 0 ||
+        conn_recv_size(&bc, &removed, NULL) < 0) {
+      close(fd);
+      breaker_fail(be);
+      continue;
+    }
+    backend_put(be, fd);
+    gone |= removed != 0;
+  }
+  if (gone)
+    catalog_del(catalog, path);
 }
 
 // downltar
-void downltar(int connfd, char *filetype) {
-  char buf[CHUNK];
+// downltar of a type spread over several servers: the archives of all of
+// them, merged into one chunked archive. A server that is down is left out
+static int downltar_merge(struct conn *c, const struct tier *t) {
+  struct tar_part parts[MAX_BACKENDS];
+  int bes[MAX_BACKENDS];
+  int n = 0;
+  for (int i = 0; i < t->n; i++) {
+    int be = t->be[i];
+    int fd = backend_get(be);
+    struct conn bc;
+    long sz;
+    int chunked;
+    if (fd < 0 || backend_request(&bc, fd, OP_TAR, NULL) < 0 ||
+        conn_recv_size(&bc, &sz, &chunked) < 0) {
+      printf("[S1] downltar: %s left out\n", backends[be].name);
+      if (fd >= 0)
+        close(fd);
+      continue;
+    }
+    load_begin(be);
+    parts[n].fd = fd;
+    parts[n].chunked = chunked;
+    parts[n].left = chunked ? 0 : sz;
+    parts[n].done = 0;
+    bes[n++] = be;
+  }
+  if (n == 0) {
+    conn_send_size(c, 0);
+    return 0;
+  }
+  int rc = conn_send_chunked(c) < 0 ? -1 : tar_merge(parts, n, c->fd);
+  for (int i = 0; i < n; i++) {
+    if (parts[i].done)
+      backend_put(bes[i], parts[i].fd);
+    else
+      close(parts[i].fd);
+    load_end(bes[i]);
+  }
+  if (rc < 0)
+    printf("[S1] downltar send error\n");
+  return rc;
+}
+
+int downltar(struct conn *c, const char *filetype) {
   if (strcmp(filetype, ".c") == 0) {
-    // remove tar file if it already exists
-    system("rm -f cfiles.tar");
-    // create new tar file of S1 folder, since it only contains .c files
-    system("tar -cf cfiles.tar S1");
-    // send cfiles.tar
-    FILE *fp = fopen("cfiles.tar", "rb");
-    if (!fp) {
-      send_string(connfd, "0");
-      return;
+    // archive the S1 folder, since it only contains .c files. Served from
+    // the cached archive unless a .c file was stored or removed since
+    if (tar_cache_serve(tarcache, c) < 0) {
+      printf("[S1] downltar .c send error\n");
+      return -1;
     }
+    return 0;
+  }
 
-    fseek(fp, 0, SEEK_END);
-    long sz = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+  // send instruction to S2/S3 for creating tar, get the file and send it
+  // back to client. If every server of the type has every file the least
+  // busy one that answers does it, otherwise all of them do and their
+  // archives are merged
+  struct tier *t = NULL;
+  if (strcmp(filetype, ".pdf") == 0 || strcmp(filetype, ".txt") == 0)
+    t = tier_for(filetype);
+  if (t && t->copies < t->n)
+    return downltar_merge(c, t);
+  int order[MAX_BACKENDS];
+  int n = t ? t->n : 0;
+  if (t) {
+    memcpy(order, t->be, n * sizeof(*order));
+    load_order(order, n);
+  }
+  int be = -1, fd = -1;
+  struct conn bc;
+  long sz;
+  int chunked;
+  for (int i = 0; i < n && fd < 0; i++) {
+    be = order[i];
+    if ((fd = backend_get(be)) < 0)
+      continue;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    load_begin(be);
+    if (backend_request(&bc, fd, OP_TAR, NULL) < 0 ||
+        conn_recv_size(&bc, &sz, &chunked) < 0) {
+      load_end(be);
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    load_sample(be, &t0);
+  }
+  if (fd < 0) {
+    // send 0 indicating unsupported file type or no server
+    conn_send_size(c, 0);
+    return 0;
+  }
+  // forward size to client, then the archive either as chunks or as a
+  // fixed number of bytes (compressed if the client asked for it)
+  int rc;
+  if (chunked)
+    rc = conn_send_chunked(c) < 0 ? -1 : relay_chunked(fd, c->fd);
+  else
+    rc = conn_send_data(c, -1, fd, -1, sz);
+  load_end(be);
+
+  if (rc < 0) {
+    printf("[S1] downltar relay error\n");
+    close(fd);
+    return -1;
+  }
+  backend_put(be, fd);
+  return 0;
+}
 
-    char stmp[64];
-    sprintf(stmp, "%ld", sz);
-    send_string(connfd, stmp);
+// 5) dispfnames
 
-    while (!feof(fp)) {
-      size_t r = fread(buf, 1, CHUNK, fp);
-      if (r > 0) {
-        if (send_all(connfd, buf, r) < 0) {
-          printf("[S1] downltar .c send error\n");
-          break;
-        }
-      }
-    }
-    fclose(fp);
-  } else if (strcmp(filetype, ".pdf") == 0) {
-    // send instruction to S2 for creating tar, get the file and send it back to
-    // client
-    int s2fd = connect_to(S2_HOST, S2_PORT);
-    if (s2fd < 0) {
-      send_string(connfd, "0");
-      return;
-    }
-    send_string(s2fd, "TAR");
-    char *sizestr = recv_string(s2fd);
-    if (!sizestr) {
-      close(s2fd);
-      send_string(connfd, "0");
-      return;
+// state of one LIST request that is in flight to a storage server
+struct list_req {
+  struct conn bc;
+  int done;
+  unsigned char hdr[FRAME_HDR_LEN];
+  uint32_t len; // reply length once the header is in
+  uint32_t got;
+  char *body;
+};
+
+// read whatever part of the reply has arrived. Returns 1 once the reply is
+// complete, 0 if more is needed and -1 on error
+static int list_req_read(struct list_req *r) {
+  while (1) {
+    ssize_t n;
+    if (!r->body) {
+      n = recv(r->bc.fd, r->hdr + r->got, FRAME_HDR_LEN - r->got, 0);
+    } else {
+      if (r->got == r->len)
+        return 1;
+      n = recv(r->bc.fd, r->body + r->got, r->len - r->got, 0);
     }
-    // forward size to client
-    send_string(connfd, sizestr);
-    long sz = atol(sizestr);
-    free(sizestr);
-
-    while (sz > 0) {
-      long toread = (sz > CHUNK) ? CHUNK : sz;
-      if (recv_all(s2fd, buf, toread) < 0)
-        break;
-      if (send_all(connfd, buf, toread) < 0)
-        break;
-      sz -= toread;
-    }
-    close(s2fd);
-  } else if (strcmp(filetype, ".txt") == 0) {
-    // send instruction to S3 for creating tar, get the file and send it back to
-    // client
-    int s3fd = connect_to(S3_HOST, S3_PORT);
-    if (s3fd < 0) {
-      send_string(connfd, "0");
-      return;
+    if (n == 0)
+      return -1;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
     }
-    send_string(s3fd, "TAR");
-    char *sizestr = recv_string(s3fd);
-    if (!sizestr) {
-      close(s3fd);
-      send_string(connfd, "0");
-      return;
+    r->got += n;
+    if (!r->body && r->got == FRAME_HDR_LEN) {
+      struct frame f;
+      if (frame_decode(r->hdr, &f) < 0 || f.opcode != OP_DATA ||
+          f.reqid != r->bc.reqid || f.len > LIST_REPLY_MAX)
+        return -1;
+      r->len = f.len;
+      r->got = 0;
+      r->body = (char *)calloc(r->len + 1, 1);
+      if (!r->body)
+        return -1;
     }
-    send_string(connfd, sizestr);
-    long sz = atol(sizestr);
-    free(sizestr);
+  }
+}
 
-    while (sz > 0) {
-      long toread = (sz > CHUNK) ? CHUNK : sz;
-      if (recv_all(s3fd, buf, toread) < 0)
-        break;
-      if (send_all(connfd, buf, toread) < 0)
-        break;
-      sz -= toread;
+// compare two names that end at a newline (or the string's end)
+static int line_cmp(const char *a, size_t al, const char *b, size_t bl) {
+  int c = memcmp(a, b, al < bl ? al : bl);
+  return c ? c : (al > bl) - (al < bl);
+}
+
+// one page of the listing of path: the first limit names behind after,
+// taken from the catalog for the nodes it has synced, and from the local
+// .c files and the pages S2/S3/S4 send for the others. Every source is
+// already sorted, so they are k-way merged into one sorted list; a folder
+// that exists on several servers is listed once. Returns the page (NULL if
+// out of memory), *more is set when it is full and another one may follow
+static char *list_page(const char *path, const char *after, long limit,
+                       size_t *len, int *more) {
+  // The LIST requests go out first, so the storage servers work on them
+  // while we list the local files. Replies are collected as they arrive;
+  // a server that does not answer within list_timeout ms is left out and
+  // the client gets whatever the others sent
+  struct list_req reqs[MAX_BACKENDS];
+  for (int be = 0; be < nbackends; be++) {
+    memset(&reqs[be], 0, sizeof(reqs[be]));
+    reqs[be].done = 1;
+    if (catalog_synced(catalog, BE_NODE(be)))
+      continue;
+    int fd = backend_get(be);
+    if (fd < 0)
+      continue;
+    struct reqbuf rb;
+    reqbuf_init(&rb);
+    if (reqbuf_str(&rb, path) < 0 || reqbuf_u64(&rb, limit) < 0 ||
+        reqbuf_str(&rb, after ? after : "") < 0 ||
+        backend_send(&reqs[be].bc, fd, OP_LIST, &rb) < 0) {
+      close(fd);
+      breaker_fail(be);
+      continue;
     }
-    close(s3fd);
-  } else {
-    // send 0 indicating unsupported file type
-    send_string(connfd, "0");
+    set_nonblocking(fd, 1);
+    reqs[be].done = 0;
   }
-}
 
-// 5) dispfnames
-void dispfnames(int connfd, char *path) {
-  // gather .c from local S1 folder, .pdf from S2, .txt from S3, .zip from S4
-  // then combine in alphabetical order.
-  // We'll do a simplistic approach: gather each list separately, then combine.
-  // local .c:
-  char localp[1024];
-  snprintf(localp, sizeof(localp), "S1/%s", path);
-
-  DIR *d = opendir(localp);
-  char result[8192];
-  memset(result, 0, sizeof(result));
-  // if directory exists
-  if (d) {
-    // gather .c
-    // dirent structs contain information about files in a directory
-    struct dirent *dd;
-    // store them in a temporary array to sort
-    // first dimension is for file count, second, is to store the filename
-    char lines[256][256];
-    int count = 0;
-    // loop through directory, get .c files and add them to lines array
-    while ((dd = readdir(d))) {
-      if (strstr(dd->d_name, ".c")) {
-        strncpy(lines[count], dd->d_name, 255);
-        lines[count][255] = 0;
-        count++;
-      } else {
+  // sorted pages: the catalog's, then the usual .c, .pdf, .txt, .zip
+  // order and the replicas, NULL for a source that is synced or did not
+  // answer. A file a replica has as well is dropped like a shared folder
+  enum { NSOURCES = MAX_BACKENDS + 2 };
+  char *pages[NSOURCES] = {NULL};
+  size_t l;
+  pages[0] = catalog_list(catalog, path, after, limit, &l);
+  if (!catalog_synced(catalog, NODE_LOCAL)) {
+    char localp[1024];
+    snprintf(localp, sizeof(localp), "S1/%s", path);
+    pages[1] = list_dir_page(localp, after, limit, ".c", &l);
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  long deadline = ts.tv_sec * 1000L + ts.tv_nsec / 1000000 + list_timeout;
+  while (1) {
+    struct pollfd pfds[MAX_BACKENDS];
+    int map[MAX_BACKENDS];
+    int n = 0;
+    for (int be = 0; be < nbackends; be++) {
+      if (reqs[be].done)
         continue;
-      }
+      pfds[n].fd = reqs[be].bc.fd;
+      pfds[n].events = POLLIN;
+      map[n++] = be;
     }
-    closedir(d);
-    // bubble sort lines
-    for (int i = 0; i < count; i++) {
-      for (int j = i + 1; j < count; j++) {
-        if (strcmp(lines[i], lines[j]) > 0) {
-          char temp[256];
-          strcpy(temp, lines[i]);
-          strcpy(lines[i], lines[j]);
-          strcpy(lines[j], temp);
-        }
+    if (n == 0)
+      break;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long left = deadline - (ts.tv_sec * 1000L + ts.tv_nsec / 1000000);
+    if (left <= 0 || poll(pfds, n, left) == 0) {
+      // deadline passed, the late replies are dropped with their
+      // connections
+      for (int i = 0; i < n; i++) {
+        printf("[S1] dispfnames: %s timed out\n", backends[map[i]].name);
+        breaker_fail(map[i]);
+        close(reqs[map[i]].bc.fd);
+        free(reqs[map[i]].body);
+        reqs[map[i]].done = 1;
       }
+      break;
     }
 
-    // append to result
-    for (int i = 0; i < count; i++) {
-      strcat(result, lines[i]);
-      strcat(result, "\n");
-    }
-  }
-
-  // gather from S2 => .pdf
-  int s2fd = connect_to(S2_HOST, S2_PORT);
-  if (s2fd >= 0) {
-    // LIST tells server that client has entered dispfnames and
-    // needs the list of files in a directory
-    send_string(s2fd, "LIST");
-    send_string(s2fd, path);
-    char *pdfs = recv_string(s2fd);
-    if (pdfs) {
-      // pdfs is new-line separated
-      // sort pdf files same way as c files
-      char lines[256][256];
-      int count = 0;
-      char *tok = strtok(pdfs, "\n");
-      while (tok) {
-        strncpy(lines[count], tok, 255);
-        lines[count][255] = 0;
-        count++;
-        tok = strtok(NULL, "\n");
-      }
-      // bubble sort
-      for (int i = 0; i < count; i++) {
-        for (int j = i + 1; j < count; j++) {
-          if (strcmp(lines[i], lines[j]) > 0) {
-            char tmp[256];
-            strcpy(tmp, lines[i]);
-            strcpy(lines[i], lines[j]);
-            strcpy(lines[j], tmp);
-          }
-        }
-      }
-      // append to result
-      for (int i = 0; i < count; i++) {
-        strcat(result, lines[i]);
-        strcat(result, "\n");
-      }
-      free(pdfs);
-    }
-    close(s2fd);
-  }
-
-  // gather .txt files from S3 in the same way
-  int s3fd = connect_to(S3_HOST, S3_PORT);
-  if (s3fd >= 0) {
-    send_string(s3fd, "LIST");
-    send_string(s3fd, path);
-    char *txts = recv_string(s3fd);
-    if (txts) {
-      char lines[256][256];
-      int count = 0;
-      char *tok = strtok(txts, "\n");
-      while (tok) {
-        strncpy(lines[count], tok, 255);
-        lines[count][255] = 0;
-        count++;
-        tok = strtok(NULL, "\n");
-      }
-      for (int i = 0; i < count; i++) {
-        for (int j = i + 1; j < count; j++) {
-          if (strcmp(lines[i], lines[j]) > 0) {
-            char tmp[256];
-            strcpy(tmp, lines[i]);
-            strcpy(lines[i], lines[j]);
-            strcpy(lines[j], tmp);
-          }
-        }
-      }
-      for (int i = 0; i < count; i++) {
-        strcat(result, lines[i]);
-        strcat(result, "\n");
-      }
-      free(txts);
-    }
-    close(s3fd);
-  }
-
-  // gather .zip files from S3 in the same way
-  int s4fd = connect_to(S4_HOST, S4_PORT);
-  if (s4fd >= 0) {
-    send_string(s4fd, "LIST");
-    send_string(s4fd, path);
-    char *zips = recv_string(s4fd);
-    if (zips) {
-      char lines[256][256];
-      int count = 0;
-      char *tok = strtok(zips, "\n");
-      while (tok) {
-        strncpy(lines[count], tok, 255);
-        lines[count][255] = 0;
-        count++;
-        tok = strtok(NULL, "\n");
-      }
-      for (int i = 0; i < count; i++) {
-        for (int j = i + 1; j < count; j++) {
-          if (strcmp(lines[i], lines[j]) > 0) {
-            char tmp[256];
-            strcpy(tmp, lines[i]);
-            strcpy(lines[i], lines[j]);
-            strcpy(lines[j], tmp);
-          }
-        }
+    for (int i = 0; i < n; i++) {
+      if (!pfds[i].revents)
+        continue;
+      int be = map[i];
+      struct list_req *r = &reqs[be];
+      int rc = list_req_read(r);
+      if (rc == 0)
+        continue;
+      r->done = 1;
+      if (rc < 0) {
+        breaker_fail(be);
+        close(r->bc.fd);
+        free(r->body);
+        continue;
       }
-      for (int i = 0; i < count; i++) {
-        strcat(result, lines[i]);
-        strcat(result, "\n");
+      set_nonblocking(r->bc.fd, 0);
+      backend_put(be, r->bc.fd);
+      pages[be + 2] = r->body;
+    }
+  }
+
+  // the merged page can be no longer than its sources together
+  size_t total = 1;
+  const char *cur[NSOURCES];
+  for (int i = 0; i < NSOURCES; i++) {
+    cur[i] = pages[i] ? pages[i] : "";
+    total += strlen(cur[i]);
+  }
+  char *out = (char *)malloc(total);
+  size_t used = 0;
+  long count = 0;
+  const char *last = NULL;
+  size_t lastlen = 0;
+  while (out && count < limit) {
+    int best = -1;
+    size_t blen = 0;
+    for (int i = 0; i < NSOURCES; i++) {
+      if (!*cur[i])
+        continue;
+      size_t cl = strcspn(cur[i], "\n");
+      if (best < 0 || line_cmp(cur[i], cl, cur[best], blen) < 0) {
+        best = i;
+        blen = cl;
       }
-      free(zips);
     }
-    close(s4fd);
+    if (best < 0)
+      break;
+    const char *name = cur[best];
+    cur[best] += blen + (cur[best][blen] == '\n');
+    if (blen == 0 || (last && line_cmp(name, blen, last, lastlen) == 0))
+      continue;
+    memcpy(out + used, name, blen);
+    out[used + blen] = '\n';
+    used += blen + 1;
+    last = name;
+    lastlen = blen;
+    count++;
+  }
+  if (out)
+    out[used] = '\0';
+  for (int i = 0; i < NSOURCES; i++)
+    free(pages[i]);
+  *len = used;
+  *more = count == limit;
+  return out;
+}
+
+void dispfnames(struct conn *c, const char *path, long page,
+                const char *cursor) {
+  // gather .c from local S1 folder, .pdf from S2, .txt from S3, .zip from S4
+  // in alphabetical order, a page at a time
+  int paged = page > 0;
+  if (!paged)
+    page = LIST_PAGE_MAX;
+  size_t len = 0;
+  int more = 0;
+  char *names = list_page(path, cursor, page, &len, &more);
+  if (!names) {
+    conn_send_blob(c, "", 0);
+    return;
+  }
+  if (!paged) {
+    conn_send_blob(c, names, len);
+    free(names);
+    return;
   }
 
-  // now send result to client
-  send_string(connfd, result);
+  // a page starts with the cursor for the next one: the last name of a full
+  // page, an empty line after the last page. One frame, so it leaves in one
+  // segment
+  const char *next = names + len;
+  if (more && len > 0) {
+    next--;
+    while (next > names && next[-1] != '\n')
+      next--;
+  }
+  size_t nlen = more && len > 0 ? names + len - 1 - next : 0;
+  char *reply = (char *)malloc(nlen + 1 + len);
+  if (reply) {
+    memcpy(reply, next, nlen);
+    reply[nlen] = '\n';
+    memcpy(reply + nlen + 1, names, len);
+  }
+  conn_send_blob(c, reply ? reply : "", reply ? nlen + 1 + len : 0);
+  free(reply);
+  free(names);
 }
 
 // whole process needed to connect to other servers, which is why it is
@@ -782,9 +1724,908 @@ int connect_to(const char *host, int port) {
   servAdd.sin_port = htons(port);
   inet_pton(AF_INET, host, &servAdd.sin_addr);
 
-  if (connect(fd, (struct sockaddr *)&servAdd, sizeof(servAdd)) < 0) {
+  // non-blocking, so a server that is down or unreachable costs at most
+  // connect_timeout ms instead of the kernel's SYN retries
+  set_nonblocking(fd, 1);
+  int rc = connect(fd, (struct sockaddr *)&servAdd, sizeof(servAdd));
+  if (rc < 0 && errno == EINPROGRESS) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int err = 0;
+    socklen_t elen = sizeof(err);
+    do
+      rc = poll(&pfd, 1, connect_timeout > 0 ? connect_timeout : -1);
+    while (rc < 0 && errno == EINTR);
+    if (rc == 0)
+      err = ETIMEDOUT;
+    else if (rc > 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0)
+      err = errno;
+    rc = rc > 0 && err == 0 ? 0 : -1;
+    if (err)
+      errno = err;
+  }
+  if (rc < 0) {
     close(fd);
     return -1;
   }
+  set_nonblocking(fd, 0);
+  return fd;
+}
+
+// hand out a connection to storage server be: a pooled one if a healthy one
+// is available, otherwise a fresh one. The caller gives it back with
+// backend_put() once the exchange finished cleanly, or just closes it
+int backend_get(int be) {
+  struct backend *b = &backends[be];
+  time_t now = time(NULL);
+  if (__atomic_load_n(&breakers[be].open, __ATOMIC_RELAXED)) {
+    errno = ECONNREFUSED;
+    return -1;
+  }
+  while (1) {
+    int fd = -1;
+    time_t since = 0;
+    pthread_mutex_lock(&b->lock);
+    if (b->nidle > 0) {
+      b->nidle--;
+      fd = b->idle[b->nidle];
+      since = b->since[b->nidle];
+    }
+    pthread_mutex_unlock(&b->lock);
+    if (fd < 0)
+      break;
+
+    // an idle connection must have nothing to read: readable means the
+    // server closed it (EOF) or something is out of sync
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (now - since > pool_idle || poll(&pfd, 1, 0) != 0) {
+      close(fd);
+      continue;
+    }
+    return fd;
+  }
+  return backend_connect(be);
+}
+
+// connect to storage server be and agree on protocol v2, -1 on error
+static int backend_dial(int be) {
+  struct backend *b = &backends[be];
+  int fd = connect_to(b->host, b->port);
+  if (fd >= 0) {
+    // keepalive probes notice a dead server while the connection idles
+    int one = 1;
+    int idle = pool_idle > 0 ? pool_idle : 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    // a read that gets nothing for reply_timeout ms fails, be it the
+    // first byte of an answer or the middle of it
+    sock_deadlines(fd);
+    struct timeval tv = {reply_timeout / 1000, reply_timeout % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // agree on protocol v2 before the connection is handed out
+    struct frame f;
+    uint32_t id = proto_next_id();
+    int rc = send_frame(fd, OP_HELLO, 0, id, 0);
+    if (rc == 0)
+      rc = recv_frame(fd, &f);
+    if (rc < 0 || f.opcode != OP_HELLO || f.reqid != id || f.len != 0) {
+      printf("[S1] %s %s\n", b->name,
+             rc < 0 ? "does not answer" : "does not speak protocol v2");
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+// a fresh v2 connection to storage server be, -1 on error or at once while
+// its breaker is open. Touches no pool state, so it is safe in S1's parent
+// process next to fork()
+int backend_connect(int be) {
+  struct breaker *k = &breakers[be];
+  if (__atomic_load_n(&k->open, __ATOMIC_RELAXED)) {
+    errno = ECONNREFUSED;
+    return -1;
+  }
+  int fd = backend_dial(be);
+  if (fd < 0)
+    breaker_fail(be);
+  return fd;
+}
+
+// count an exchange with be that failed: a connect, or a request that broke
+// off or was not answered in time. A connect that works does not start the
+// count over, a server may take connections and still not answer; only an
+// exchange that ends cleanly in backend_put() does
+void breaker_fail(int be) {
+  struct breaker *k = &breakers[be];
+  if (__atomic_add_fetch(&k->fails, 1, __ATOMIC_RELAXED) == BREAKER_FAILS) {
+    __atomic_store_n(&k->open, 1, __ATOMIC_RELAXED);
+    printf("[S1] %s failed %d times in a row, not asked until it answers "
+           "again\n",
+           backends[be].name, BREAKER_FAILS);
+  }
+}
+
+// a connection for background work (catalog sync, rebalancing), which
+// waits for answers as long as it takes: a DUMP page may have to work out
+// the checksums of large files first
+int backend_background(int be) {
+  int fd = backend_connect(be);
+  struct timeval tv = {0, 0};
+  if (fd >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+// a LIST of one name, 0 if be answers it. A connection and HELLO are not
+// enough: a server may take those and hang on every real request
+static int breaker_probe(int be) {
+  int fd = backend_dial(be);
+  if (fd < 0)
+    return -1;
+  struct conn bc;
+  struct reqbuf rb;
+  size_t len;
+  char *page = NULL;
+  reqbuf_init(&rb);
+  if (reqbuf_str(&rb, "/") == 0 && reqbuf_u64(&rb, 1) == 0 &&
+      reqbuf_str(&rb, "") == 0 && backend_send(&bc, fd, OP_LIST, &rb) == 0)
+    page = conn_recv_blob(&bc, &len);
+  close(fd);
+  free(page);
+  return page ? 0 : -1;
+}
+
+// probe the servers whose breaker is open every BREAKER_PROBE_MS. The first
+// probe that is answered half closes it: requests go to the server again,
+// but the count stays one short of BREAKER_FAILS, so a single failure opens
+// it again and only a clean exchange (backend_put()) starts the count over
+void *breaker_thread(void *arg) {
+  (void)arg;
+  for (;;) {
+    usleep(BREAKER_PROBE_MS * 1000);
+    for (int be = 0; be < nbackends; be++) {
+      struct breaker *k = &breakers[be];
+      if (!__atomic_load_n(&k->open, __ATOMIC_RELAXED))
+        continue;
+      if (breaker_probe(be) < 0)
+        continue;
+      __atomic_store_n(&k->fails, BREAKER_FAILS - 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&k->open, 0, __ATOMIC_RELAXED);
+      printf("[S1] %s answers again\n", backends[be].name);
+    }
+  }
+  return NULL;
+}
+
+// send a request to a storage server. bc is set up to read the reply
+int backend_send(struct conn *bc, int fd, int opcode,
+                 const struct reqbuf *rb) {
+  bc->fd = fd;
+  bc->v2 = 1;
+  bc->reqid = proto_next_id();
+  bc->lz = bc->packed = 0;
+  return send_request(fd, opcode, 0, bc->reqid, rb);
+}
+
+// a request followed by len bytes of data, which the caller relays next
+int backend_send_data(struct conn *bc, int fd, int opcode,
+                      const struct reqbuf *rb, long len) {
+  bc->fd = fd;
+  bc->v2 = 1;
+  bc->reqid = proto_next_id();
+  bc->lz = bc->packed = 0;
+  return send_request_data(fd, opcode, bc->reqid, rb, len);
+}
+
+// the same for the usual single optional string argument
+int backend_request(struct conn *bc, int fd, int opcode, const char *arg) {
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  if (arg && reqbuf_str(&rb, arg) < 0)
+    return -1;
+  return backend_send(bc, fd, opcode, &rb);
+}
+
+void backend_put(int be, int fd) {
+  struct backend *b = &backends[be];
+  __atomic_store_n(&breakers[be].fails, 0, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&b->lock);
+  if (b->nidle < pool_size) {
+    b->idle[b->nidle] = fd;
+    b->since[b->nidle] = time(NULL);
+    b->nidle++;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&b->lock);
+  if (fd >= 0)
+    close(fd);
+}
+
+// ---------------------------------------------------------------------------
+// tiers and replicas
+
+struct tier *tier_for(const char *ext) {
+  for (struct tier *t = tiers; t->ext; t++)
+    if (strcmp(t->ext, ext) == 0)
+      return t;
+  return NULL;
+}
+
+// one more server for the files of t, addr is HOST:PORT. -1 if addr is bad,
+// the name is taken or there is no room for it
+static int add_backend(struct tier *t, const char *name, const char *addr) {
+  const char *colon = strrchr(addr, ':');
+  int port = colon ? atoi(colon + 1) : 0;
+  if (!colon || colon == addr || port <= 0 || port > 65535 ||
+      t->n == MAX_BACKENDS || nbackends == MAX_BACKENDS)
+    return -1;
+  for (int be = 0; be < nbackends; be++)
+    if (strcmp(backends[be].name, name) == 0)
+      return -1;
+  struct backend *b = &backends[nbackends];
+  b->name = strdup(name);
+  b->host = strndup(addr, colon - addr);
+  b->port = port;
+  pthread_mutex_init(&b->lock, NULL);
+  t->be[t->n++] = nbackends++;
+  return 0;
+}
+
+// the storage servers, from a file of lines
+//   EXT NAME HOST:PORT     a server for files of type EXT (.pdf, .txt, .zip)
+//   copies EXT N           every file of type EXT on N servers (default 1)
+// and '#' comments. The name places the server on the hash ring, so it
+// must stay the same when the server moves. Servers are best added at the
+// end, the catalog only keeps what it knows about the others then.
+// Returns -1 (and says why) if the file is bad
+int load_topology(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  for (struct tier *t = tiers; t->ext; t++)
+    t->n = 0;
+  nbackends = 0;
+  char line[512];
+  int lineno = 0, rc = 0;
+  while (rc == 0 && fgets(line, sizeof(line), f)) {
+    lineno++;
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = '\0';
+    char a[64], b[64], c[256], extra[2];
+    int k = sscanf(line, "%63s %63s %255s %1s", a, b, c, extra);
+    struct tier *t;
+    if (k <= 0)
+      continue;
+    if (k == 3 && strcmp(a, "copies") == 0 && (t = tier_for(b))) {
+      t->copies = atoi(c);
+      if (t->copies >= 1 && t->copies <= MAX_REPLICAS)
+        continue;
+    } else if (k == 3 && (t = tier_for(a)) && add_backend(t, b, c) == 0) {
+      continue;
+    }
+    fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+    rc = -1;
+  }
+  fclose(f);
+  for (struct tier *t = tiers; rc == 0 && t->ext; t++) {
+    if (t->n == 0) {
+      fprintf(stderr, "%s: no server for %s\n", path, t->ext);
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+// --replica EXT=HOST:PORT: one more server for the files of type EXT,
+// named after the first one ("S2@127.0.0.1:7002"), and one more copy of
+// each of them. -1 if spec is bad or there is no room for it
+int add_replica(const char *spec) {
+  const char *eq = strchr(spec, '=');
+  if (!eq)
+    return -1;
+  char ext[16];
+  snprintf(ext, sizeof(ext), "%.*s", (int)(eq - spec), spec);
+  struct tier *t = tier_for(ext);
+  if (!t || t->copies == MAX_REPLICAS)
+    return -1;
+  char name[300];
+  snprintf(name, sizeof(name), "%s@%s", backends[t->be[0]].name, eq + 1);
+  if (add_backend(t, name, eq + 1) < 0)
+    return -1;
+  t->copies++;
+  return 0;
+}
+
+// where s lands on a ring: CRC-32C of the path without leading or doubled
+// slashes, so every spelling of it lands in the same place, put through
+// murmur3's finalizer to spread similar names apart
+static uint32_t ring_hash(const char *s) {
+  char buf[1024];
+  size_t n = 0;
+  for (char prev = '/'; *s && n < sizeof(buf); prev = *s++)
+    if (*s != '/' || prev != '/')
+      buf[n++] = *s;
+  uint32_t h = crc32c(0, buf, n);
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static int ring_cmp(const void *a, const void *b) {
+  const struct ring_point *x = (const struct ring_point *)a;
+  const struct ring_point *y = (const struct ring_point *)b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->be - y->be;
+}
+
+// RING_POINTS points per server, hashed from its name
+void tier_ring(struct tier *t) {
+  free(t->ring);
+  t->nring = 0;
+  t->ring = (struct ring_point *)malloc(sizeof(*t->ring) * t->n * RING_POINTS);
+  if (!t->ring)
+    return;
+  for (int i = 0; i < t->n; i++) {
+    for (int k = 0; k < RING_POINTS; k++) {
+      char point[300];
+      snprintf(point, sizeof(point), "%s#%d", backends[t->be[i]].name, k);
+      t->ring[t->nring].hash = ring_hash(point);
+      t->ring[t->nring++].be = t->be[i];
+    }
+  }
+  qsort(t->ring, t->nring, sizeof(*t->ring), ring_cmp);
+}
+
+// the servers path is stored on: the first copies different ones from its
+// point on the ring on. Returns how many, at least one
+int tier_owners(const struct tier *t, const char *path, int *be) {
+  int want = t->copies < t->n ? t->copies : t->n;
+  if (t->nring == 0) {
+    // no memory for a ring, everything stays on the first servers
+    memcpy(be, t->be, want * sizeof(*be));
+    return want;
+  }
+  uint32_t h = ring_hash(path);
+  int lo = 0, hi = t->nring;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (t->ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int n = 0;
+  for (int i = 0; n < want && i < t->nring; i++) {
+    int b = t->ring[(lo + i) % t->nring].be;
+    int j = 0;
+    while (j < n && be[j] != b)
+      j++;
+    if (j == n)
+      be[n++] = b;
+  }
+  return n;
+}
+
+// 1 if the catalog has synced every server of t
+int tier_synced(const struct tier *t) {
+  for (int i = 0; i < t->n; i++)
+    if (!catalog_synced(catalog, BE_NODE(t->be[i])))
+      return 0;
+  return 1;
+}
+
+static int has_be(const int *be, int n, int b) {
+  for (int i = 0; i < n; i++)
+    if (be[i] == b)
+      return 1;
+  return 0;
+}
+
+// the servers that may have path, to try one after the other: where the
+// catalog saw it last if that is not one of its owners (it was stored
+// before a server was added), then the owners, least busy first. Unless the
+// catalog has synced every server of t the others follow, in case it is
+// there. Returns how many
+int read_order(const struct tier *t, const char *path, int *order) {
+  struct file_meta m;
+  int n = 0;
+  int owners[MAX_REPLICAS];
+  int nowners = tier_owners(t, path, owners);
+  load_order(owners, nowners);
+  if (catalog_get(catalog, path, &m) == 0 && m.node != NODE_LOCAL &&
+      has_be(t->be, t->n, NODE_BE(m.node)) &&
+      !has_be(owners, nowners, NODE_BE(m.node)))
+    order[n++] = NODE_BE(m.node);
+  memcpy(order + n, owners, nowners * sizeof(*order));
+  n += nowners;
+  if (!tier_synced(t))
+    for (int i = 0; i < t->n; i++)
+      if (!has_be(order, n, t->be[i]))
+        order[n++] = t->be[i];
+  return n;
+}
+
+// the servers in be, least busy first: a request has to wait for those
+// under way, so the order is by (in flight + 1) * recent latency
+void load_order(int *be, int n) {
+  long score[MAX_BACKENDS];
+  for (int i = 0; i < n; i++) {
+    struct be_load *l = &loads[be[i]];
+    long s = (__atomic_load_n(&l->inflight, __ATOMIC_RELAXED) + 1) *
+             (__atomic_load_n(&l->ewma_us, __ATOMIC_RELAXED) + 1);
+    // insertion sort, there are a handful of them
+    int b = be[i];
+    int j = i;
+    for (; j > 0 && score[j - 1] > s; j--) {
+      score[j] = score[j - 1];
+      be[j] = be[j - 1];
+    }
+    score[j] = s;
+    be[j] = b;
+  }
+}
+
+void load_begin(int be) {
+  __atomic_add_fetch(&loads[be].inflight, 1, __ATOMIC_RELAXED);
+}
+
+void load_end(int be) {
+  __atomic_sub_fetch(&loads[be].inflight, 1, __ATOMIC_RELAXED);
+}
+
+// fold the time since t0, when a request went out to be, into its average.
+// Two samples at once may lose one of them, which an average can live with
+void load_sample(int be, const struct timespec *t0) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long us = (now.tv_sec - t0->tv_sec) * 1000000L +
+            (now.tv_nsec - t0->tv_nsec) / 1000;
+  long avg = __atomic_load_n(&loads[be].ewma_us, __ATOMIC_RELAXED);
+  avg += (us - avg) / EWMA_WEIGHT;
+  __atomic_store_n(&loads[be].ewma_us, avg, __ATOMIC_RELAXED);
+}
+
+// STORE size bytes from src as dest on the servers in bes, all of them fed
+// from the one stream as it arrives (unpacked if it comes compressed).
+// Their answers go into the catalog. A server that fails is left behind,
+// the data is read off src even if none is left. Returns how many servers
+// stored the file, -1 if src broke and is out of sync
+int store_fanout(const int *bes, int nbes, const char *dest, struct conn *src,
+                 long size) {
+  struct conn bcs[MAX_REPLICAS];
+  int fds[MAX_REPLICAS], dst[MAX_REPLICAS], ok[MAX_REPLICAS];
+  int n = 0;
+  // it expects path + size + data, the path is the 'dest' the user typed
+  // (with the file name if that was a folder)
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  int rc = reqbuf_str(&rb, dest);
+  for (int i = 0; rc == 0 && i < nbes; i++) {
+    int be = bes[i];
+    int fd = backend_get(be);
+    if (fd < 0) {
+      printf("[S1] Cannot connect %s\n", backends[be].name);
+      continue;
+    }
+    if (backend_send_data(&bcs[n], fd, OP_STORE, &rb, size) < 0) {
+      printf("[S1] forward to %s failed\n", backends[be].name);
+      close(fd);
+      breaker_fail(be);
+      continue;
+    }
+    load_begin(be);
+    fds[n] = dst[n] = fd;
+    ok[n++] = be;
+  }
+
+  rc = conn_recv_fanout(src, dst, n, size);
+  int stored = 0;
+  for (int i = 0; i < n; i++) {
+    const char *name = backends[ok[i]].name;
+    // the server answers with the catalog record of the file it stored
+    size_t alen;
+    char *ack = NULL;
+    // a failed upload from the client is not the servers' fault
+    if (rc == -1 || dst[i] < 0)
+      printf("[S1] forward to %s failed\n", name);
+    else if (!(ack = conn_recv_blob(&bcs[i], &alen)) ||
+             catalog_recv(catalog, BE_NODE(ok[i]), ack, alen, NULL, NULL,
+                          0) <= 0)
+      printf("[S1] %s did not confirm %s\n", name, dest);
+    else
+      stored++;
+    if (rc != -1 && !ack)
+      breaker_fail(ok[i]);
+    if (ack)
+      backend_put(ok[i], fds[i]);
+    else
+      close(fds[i]);
+    free(ack);
+    load_end(ok[i]);
+  }
+  // unless only the servers failed we do not know how much of the upload
+  // is still in flight, so src cannot be reused
+  return rc == -1 ? -1 : stored;
+}
+
+// copy path, which server be has just committed, to the n servers in bes.
+// It is read back from be and streamed to them
+void replicate(const int *bes, int nbes, int be, const char *path) {
+  int fd = backend_get(be);
+  if (fd < 0)
+    return;
+  struct conn bc;
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  long sz, n;
+  if (reqbuf_str(&rb, path) < 0 || backend_send(&bc, fd, OP_GET, &rb) < 0 ||
+      conn_recv_range(&bc, &sz, &n) < 0 || n <= 0) {
+    printf("[S1] %s cannot be read back from %s\n", path, backends[be].name);
+    close(fd);
+    return;
+  }
+  int stored = store_fanout(bes, nbes, path, &bc, n);
+  if (stored < 0) {
+    close(fd);
+    return;
+  }
+  backend_put(be, fd);
+  printf("[S1] %s copied to %d of %d servers\n", path, stored, nbes);
+}
+
+// ---------------------------------------------------------------------------
+// catalog sync
+
+// DUMP pages of S1_FOLDER, from an index built for the occasion
+static char *local_dump(void *arg, const char *after, size_t *len) {
+  return dir_index_dump((struct dir_index *)arg, after, DUMP_PAGE, len);
+}
+
+// DUMP pages of a storage server over the connection in arg
+static char *remote_dump(void *arg, const char *after, size_t *len) {
+  struct conn bc;
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  if (reqbuf_str(&rb, after) < 0 || reqbuf_u64(&rb, DUMP_PAGE) < 0 ||
+      backend_send(&bc, *(int *)arg, OP_DUMP, &rb) < 0)
+    return NULL;
+  return conn_recv_blob(&bc, len);
+}
+
+// bring the nodes the catalog has not synced yet into it. Returns how many
+// are still missing
+int sync_catalog(void) {
+  int missing = 0;
+  if (!catalog_synced(catalog, NODE_LOCAL)) {
+    struct dir_index *x = dir_index_create(S1_FOLDER);
+    if (x && catalog_sync(catalog, NODE_LOCAL, local_dump, x) == 0)
+      printf("[S1] Catalog: %s synced\n", S1_FOLDER);
+    else
+      missing++;
+    dir_index_free(x);
+  }
+  for (int be = 0; be < nbackends; be++) {
+    if (catalog_synced(catalog, BE_NODE(be)))
+      continue;
+    int fd = backend_background(be);
+    if (fd >= 0 && catalog_sync(catalog, BE_NODE(be), remote_dump, &fd) == 0)
+      printf("[S1] Catalog: %s synced\n", backends[be].name);
+    else
+      missing++;
+    if (fd >= 0)
+      close(fd);
+  }
+  return missing;
+}
+
+void *catalog_thread(void *arg) {
+  (void)arg;
+  do
+    sleep(CATALOG_RETRY_SEC);
+  while (sync_catalog() > 0);
+  return NULL;
+}
+
+// the catalog numbers the storage servers by their place in backends[], so
+// it stays good as long as servers are only added at the end. Anything
+// else (a server removed, moved or renamed) throws it away before it is
+// opened. The list it was built for is kept in CATALOG_FILE.nodes. Any
+// change at all may have files hash to other servers: a rebalancing pass
+// is due then
+void catalog_nodes(void) {
+  const char *path = CATALOG_FILE ".nodes";
+  FILE *f = fopen(path, "r");
+  int be = 0, same = 1;
+  char line[512], want[512];
+  while (f && same && fgets(line, sizeof(line), f)) {
+    if (be < nbackends)
+      snprintf(want, sizeof(want), "%s %s:%d\n", backends[be].name,
+               backends[be].host, backends[be].port);
+    same = be++ < nbackends && strcmp(line, want) == 0;
+  }
+  if (f)
+    fclose(f);
+  if (!same) {
+    printf("[S1] Storage servers changed, rebuilding the catalog\n");
+    unlink(CATALOG_FILE);
+    unlink(CATALOG_FILE ".log");
+  }
+  if ((!same || be != nbackends) && (f = fopen(REBALANCE_FILE, "w")))
+    fclose(f);
+  if (!(f = fopen(path, "w")))
+    return;
+  for (be = 0; be < nbackends; be++)
+    fprintf(f, "%s %s:%d\n", backends[be].name, backends[be].host,
+            backends[be].port);
+  fclose(f);
+}
+
+// ---------------------------------------------------------------------------
+// rebalancing
+//
+// A server added to a type takes over the paths next to its points on the
+// ring, which still sit where they were stored. rebalance() walks the DUMP
+// of every server of a type spread over several and copies each file to
+// those of its owners that miss it, a new server among them. What hashes
+// elsewhere is then moved: the catalog pointed at the owners, the file
+// removed from the old server. Until then the catalog keeps
+// sending reads to the old server (see read_order()), and a STORE only
+// shows up on the new one once it is complete, so nothing is ever served
+// half moved. It runs in S1's parent next to fork(), with connections of
+// its own, paced to rebalance_rate so the moves do not crowd out clients
+
+// a connection to server be for the pass, sending no faster than
+// rebalance_rate: the data is relayed as it comes, so pacing what S1 sends
+// holds back what it reads from the old server as well
+static int rb_connect(int be) {
+  int fd = backend_background(be);
+  // the kernel takes 64 bits, 32 would wrap at 4096 MB/s
+  uint64_t rate = (uint64_t)rebalance_rate << 20;
+  if (fd >= 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0)
+    perror("[S1] SO_MAX_PACING_RATE");
   return fd;
 }
+
+// the pass's connection to be in fds[be], opened on first use. -1 if be
+// is down
+static int rb_fd(int *fds, int be) {
+  if (fds[be] < 0)
+    fds[be] = rb_connect(be);
+  return fds[be];
+}
+
+// a connection that broke, or may be out of sync
+static void rb_drop(int *fds, int be) {
+  if (fds[be] >= 0)
+    close(fds[be]);
+  fds[be] = -1;
+}
+
+// the size of path on be: a GET of the (empty) range past its end. 0 if
+// it is not there, -1 if the server failed
+static long rb_size(int *fds, int be, const char *path) {
+  struct conn bc;
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  long sz, n;
+  if (rb_fd(fds, be) < 0 || reqbuf_str(&rb, path) < 0 ||
+      reqbuf_u64(&rb, LONG_MAX) < 0 || reqbuf_u64(&rb, 0) < 0 ||
+      backend_send(&bc, fds[be], OP_GET, &rb) < 0 ||
+      conn_recv_range(&bc, &sz, &n) < 0 || n != 0) {
+    rb_drop(fds, be);
+    return -1;
+  }
+  return sz;
+}
+
+// stream path from be to the nd servers in dst, which keep a version they
+// have already: a client may store it there any time. got[i] is what dst[i]
+// holds afterwards. 0 if all of them answered
+static int rb_copy(int *fds, int be, const int *dst, int nd,
+                   const char *path, struct file_meta *got) {
+  struct conn src, bcs[MAX_REPLICAS];
+  int out[MAX_REPLICAS];
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  long sz, n;
+  for (int i = 0; i < nd; i++)
+    if (rb_fd(fds, dst[i]) < 0)
+      return -1;
+  if (rb_fd(fds, be) < 0 || reqbuf_str(&rb, path) < 0 ||
+      backend_send(&src, fds[be], OP_GET, &rb) < 0 ||
+      conn_recv_range(&src, &sz, &n) < 0) {
+    rb_drop(fds, be);
+    return -1;
+  }
+  int rc = reqbuf_u64(&rb, 1);
+  for (int i = 0; i < nd; i++) {
+    out[i] = fds[dst[i]];
+    if (backend_send_data(&bcs[i], out[i], OP_STORE, &rb, n) < 0) {
+      rb_drop(fds, dst[i]);
+      out[i] = -1;
+      rc = -1;
+    }
+  }
+  if (conn_recv_fanout(&src, out, nd, n) == -1) {
+    rb_drop(fds, be);
+    rc = -1;
+  }
+  for (int i = 0; i < nd; i++) {
+    size_t alen;
+    char *ack = NULL;
+    if (out[i] < 0 || !(ack = conn_recv_blob(&bcs[i], &alen)) ||
+        catalog_recv(NULL, BE_NODE(dst[i]), ack, alen, &got[i], NULL, 0) <=
+            0) {
+      printf("[S1] %s did not take %s\n", backends[dst[i]].name, path);
+      rb_drop(fds, dst[i]);
+      rc = -1;
+    }
+    free(ack);
+  }
+  return rc;
+}
+
+// REMOVE path from be, -1 if the server failed
+static int rb_remove(int *fds, int be, const char *path) {
+  struct conn bc;
+  long removed;
+  if (rb_fd(fds, be) < 0 ||
+      backend_request(&bc, fds[be], OP_REMOVE, path) < 0 ||
+      conn_recv_size(&bc, &removed, NULL) < 0) {
+    rb_drop(fds, be);
+    return -1;
+  }
+  return 0;
+}
+
+// copy path, which be holds as m says, to its owners in t that miss it,
+// and move it off be unless be is an owner itself; a path removed meanwhile
+// just goes. Returns 1 once that is done, 0 if there was nothing to do and
+// -1 if it stays as it is for now (a server failed, or it is too new to
+// tell)
+static int rb_move(int *fds, const struct tier *t, int be, const char *path,
+                   const struct file_meta *m) {
+  int owners[MAX_REPLICAS], dst[MAX_REPLICAS];
+  int n = tier_owners(t, path, owners), nd = 0;
+  int owner = has_be(owners, n, be);
+  // a catalog entry on an owner with other content was stored there after
+  // the server was added: the owners have the newer version, the one on be
+  // is only in the way
+  struct file_meta was, cur, got[MAX_REPLICAS];
+  int known = catalog_get(catalog, path, &was) == 0;
+  // removef forgets path as soon as one replica is gone, copying one that
+  // was down at the time would bring the file back
+  if (!known && tier_synced(t)) {
+    if (time(NULL) - m->mtime < REBALANCE_ORPHAN_SEC)
+      return -1;
+    printf("[S1] Rebalancing: %s was removed, dropping it from %s\n", path,
+           backends[be].name);
+    return rb_remove(fds, be, path) < 0 ? -1 : 1;
+  }
+  int stale = known && was.size >= 0 && was.node != BE_NODE(be) &&
+              has_be(owners, n, NODE_BE(was.node)) &&
+              (was.crc && m->crc ? was.crc != m->crc : was.mtime > m->mtime);
+  for (int i = 0; i < n && !stale; i++) {
+    if (owners[i] == be)
+      continue;
+    long sz = rb_size(fds, owners[i], path);
+    if (sz < 0)
+      return -1;
+    // an empty file cannot be told from a missing one
+    if (sz != m->size || sz == 0)
+      dst[nd++] = owners[i];
+  }
+  if (nd > 0 && rb_copy(fds, be, dst, nd, path, got) < 0)
+    return -1;
+
+  // clients went on while it was copied, so look again. One that stored
+  // path kept its version on the owners, as the copy leaves what is there
+  // alone, and its answer is in the catalog already. One that removed it
+  // had the copy bring it back, it goes again
+  int newer = 0;
+  if (nd > 0 && known) {
+    if (catalog_get(catalog, path, &cur) < 0) {
+      for (int i = 0; i < nd; i++)
+        if (rb_remove(fds, dst[i], path) < 0)
+          return -1;
+      return rb_remove(fds, be, path) < 0 ? -1 : 1;
+    }
+    newer = cur.node != was.node || cur.size != was.size ||
+            cur.mtime != was.mtime || cur.crc != was.crc;
+  }
+  for (int i = 0; i < nd && !newer; i++)
+    catalog_put(catalog, path, &got[i]);
+  if (owner)
+    return nd > 0;
+
+  // reads go to the owners from now on, only then can be let go of it
+  if (catalog_get(catalog, path, &cur) == 0 && cur.node == BE_NODE(be)) {
+    cur.node = BE_NODE(owners[0]);
+    catalog_put(catalog, path, &cur);
+  }
+  return rb_remove(fds, be, path) < 0 ? -1 : 1;
+}
+
+// one pass over every server of the types spread over several: the files
+// it holds go to the owners that miss them and leave it if it is not one
+// of them, one after the other. Returns how many are left where they were
+// (a server was down or failed), 0 once every file is in place
+int rebalance(void) {
+  int fds[MAX_BACKENDS];
+  for (int be = 0; be < nbackends; be++)
+    fds[be] = -1;
+  long moved = 0, bytes = 0, left = 0;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (struct tier *t = tiers; t->ext; t++) {
+    for (int i = 0; t->n > 1 && i < t->n; i++) {
+      int be = t->be[i];
+      char after[PATH_MAX] = "";
+      for (;;) {
+        size_t len, off = 0;
+        char *page = rb_fd(fds, be) < 0 ? NULL
+                                         : remote_dump(&fds[be], after, &len);
+        if (!page || len == 0) {
+          if (!page) {
+            printf("[S1] Rebalancing: %s does not answer\n",
+                   backends[be].name);
+            rb_drop(fds, be);
+            left++;
+          }
+          free(page);
+          break;
+        }
+        char key[PATH_MAX], path[PATH_MAX + 1];
+        struct file_meta m;
+        int rc;
+        while ((rc = catalog_next(page, len, &off, key, sizeof(key), &m)) >=
+               0) {
+          strcpy(after, key);
+          if (rc == 0 || strcmp(get_file_extension(key), t->ext) != 0)
+            continue;
+          snprintf(path, sizeof(path), "/%s", key);
+          rc = rb_move(fds, t, be, path, &m);
+          if (rc > 0) {
+            moved++;
+            bytes += m.size;
+          } else if (rc < 0) {
+            left++;
+          }
+        }
+        free(page);
+        if (off != len) {
+          printf("[S1] Rebalancing: bad DUMP from %s\n", backends[be].name);
+          rb_drop(fds, be);
+          left++;
+          break;
+        }
+      }
+    }
+  }
+  for (int be = 0; be < nbackends; be++)
+    rb_drop(fds, be);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("[S1] Rebalancing: %ld files (%.1f MB) placed in %.1f s, %ld left\n",
+         moved, bytes / 1048576.0, secs, left);
+  return (int)left;
+}
+
+// pass after pass until every file is where it belongs
+void *rebalance_thread(void *arg) {
+  (void)arg;
+  while (rebalance() > 0)
+    sleep(REBALANCE_RETRY_SEC);
+  unlink(REBALANCE_FILE);
+  return NULL;
+}
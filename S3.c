@@ -1,6 +1,5 @@
 #include "utils.h"
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -15,15 +14,96 @@
 #define SERVER_PORT 6003
 #define BASE_FOLDER "S3"
 #define CHUNK 4096
+// staging files of multipart uploads, next to BASE_FOLDER so commit can
+// rename them into it
+#define STAGE_FOLDER BASE_FOLDER ".uploads"
+// chunk store of --dedup, see dedup_store()
+#define DEDUP_FOLDER BASE_FOLDER ".chunks"
 
 void handle_client(int connfd);
-void cmd_STORE(int connfd);
-void cmd_GET(int connfd);
-void cmd_REMOVE(int connfd);
-void cmd_TAR(int connfd);
-void cmd_LIST(int connfd);
+int handle_command(int connfd);
+int cmd_STORE(struct conn *c, const char *path, int keep);
+void cmd_GET(struct conn *c, const char *path, int ranged, long off,
+             long len);
+void cmd_REMOVE(struct conn *c, const char *path);
+long cmd_OPEN(const char *path, long size);
+int cmd_PART(struct conn *c, long id, long off);
+void cmd_COMMIT(struct conn *c, const char *path, long id);
+void cmd_TAR(struct conn *c);
+void cmd_LIST(struct conn *c, const char *path, const char *after,
+              long limit);
+int cmd_DUMP(struct conn *c, const char *after, long limit);
+
+// what older S1 builds send: the command name, then each argument as a
+// string of its own
+static const struct legacy_cmd legacy_cmds[] = {
+    {"STORE", OP_STORE, 1}, {"GET", OP_GET, 1},   {"REMOVE", OP_REMOVE, 1},
+    {"TAR", OP_TAR, 0},     {"LIST", OP_LIST, 1}, {NULL, 0, 0}};
+
+// last TAR archive, rebuilt when the folder changed
+struct tar_cache *tarcache;
+
+// chunk store new files go to, NULL when files are stored as they are
+const char *dedup;
+
+// every file under BASE_FOLDER, LIST is answered from it
+struct dir_index *dirindex;
+
+int main(int argc, char **argv) {
+  // default is one forked process per connection, --pool serves them from
+  // the work-stealing pool (--workers N, default one per core, --pin binds
+  // each worker to a core). --stdio keeps bulk transfers on the plain
+  // fread/fwrite loops even when io_uring is available. --dedup stores
+  // files as chunks in DEDUP_FOLDER, shared by identical content. --port N
+  // listens on N instead of SERVER_PORT, for a replica run from another
+  // folder. --io-timeout SEC, --min-rate KB and --idle-timeout SEC are the
+  // transfer deadlines of utils.h
+  int port = SERVER_PORT;
+  int use_pool = 0;
+  int use_stdio = 0;
+  int nworkers = 0;
+  int pin = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--pool") == 0) {
+      use_pool = 1;
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      nworkers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--pin") == 0) {
+      pin = 1;
+    } else if (strcmp(argv[i], "--stdio") == 0) {
+      use_stdio = 1;
+    } else if (strcmp(argv[i], "--dedup") == 0) {
+      dedup = DEDUP_FOLDER;
+    } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--io-timeout") == 0 && i + 1 < argc) {
+      io_timeout = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--min-rate") == 0 && i + 1 < argc) {
+      io_min_rate = atol(argv[++i]) * 1024;
+    } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+      idle_timeout = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--pool] [--workers N] [--pin] [--stdio] "
+                      "[--dedup] [--port N] [--io-timeout SEC] "
+                      "[--min-rate KB] [--idle-timeout SEC]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+
+  // files stored as manifests by any run take their chunks from here
+  chunk_store = DEDUP_FOLDER;
+
+  // shared memory, so create it before any fork
+  tarcache = tar_cache_create(BASE_FOLDER);
+  dirindex = dir_index_create(BASE_FOLDER);
+  printf("[S3] Indexed %ld files and folders under '%s'\n", dir_index_count(dirindex),
+         BASE_FOLDER);
+
+  if (!use_stdio)
+    uring_enabled = uring_probe();
+  printf("[S3] Transfer backend: %s\n", uring_enabled ? "io_uring" : "stdio");
 
-int main(void) {
   int sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0) {
     perror("[S3] socket");
@@ -35,7 +115,7 @@ int main(void) {
   struct sockaddr_in servaddr;
   memset(&servaddr, 0, sizeof(servaddr));
   servaddr.sin_family = AF_INET;
-  servaddr.sin_port = htons(SERVER_PORT);
+  servaddr.sin_port = htons(port);
   servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
   if (bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
@@ -43,14 +123,21 @@ int main(void) {
     exit(1);
   }
 
-  if (listen(sockfd, 10) < 0) {
+  if (listen(sockfd, SOMAXCONN) < 0) {
     perror("[S3] listen");
     exit(1);
   }
 
   printf("[S3] Listening on port %d, storing .txt files under '%s'...\n",
-         SERVER_PORT, BASE_FOLDER);
+         port, BASE_FOLDER);
 
+  if (use_pool) {
+    run_worker_pool(sockfd, nworkers, pin, handle_command);
+    return 0;
+  }
+
+  // children that are done go away without a wait()
+  signal(SIGCHLD, SIG_IGN);
   while (1) {
     struct sockaddr_in caddr;
     socklen_t clen = sizeof(caddr);
@@ -61,6 +148,7 @@ int main(void) {
     }
     if (fork() == 0) {
       close(sockfd);
+      sock_deadlines(connfd);
       handle_client(connfd);
       close(connfd);
       _exit(0);
@@ -75,68 +163,99 @@ int main(void) {
 // similar to prcclient() in the sense that it parses the command from the
 // server and decides what function to run
 void handle_client(int connfd) {
-  while (1) {
-    char *command = recv_string(connfd);
-    if (!command) {
-      break;
-    }
-
-    if (strcmp(command, "STORE") == 0) {
-      free(command);
-      cmd_STORE(connfd);
-    } else if (strcmp(command, "GET") == 0) {
-      free(command);
-      cmd_GET(connfd);
-    } else if (strcmp(command, "REMOVE") == 0) {
-      free(command);
-      cmd_REMOVE(connfd);
-    } else if (strcmp(command, "TAR") == 0) {
-      free(command);
-      cmd_TAR(connfd);
-    } else if (strcmp(command, "LIST") == 0) {
-      free(command);
-      cmd_LIST(connfd);
-    } else {
-      free(command);
-      break;
-    }
-  }
+  while (handle_command(connfd) == 0)
+    ;
 }
 
-void cmd_STORE(int connfd) {
-  // get path from S1
-  char *path = recv_string(connfd);
-  if (!path)
-    return;
+// GET with the optional offset and length fields of a byte range request
+static void get_range(struct conn *c, const struct request *r,
+                      const char *path) {
+  uint64_t off = 0, len = 0;
+  int ranged = request_u64(r, 1, &off) == 0;
+  if (ranged)
+    request_u64(r, 2, &len);
+  if (off > LONG_MAX)
+    off = LONG_MAX;
+  if (len > LONG_MAX)
+    len = 0;
+  cmd_GET(c, path, ranged, (long)off, (long)len);
+}
 
-  // get file size from S1
-  char *sizestr = recv_string(connfd);
-  if (!sizestr) {
-    free(path);
-    return;
+// read and run a single command. Used directly by the worker pool, which
+// parks the connection between commands
+int handle_command(int connfd) {
+  struct request req;
+  struct conn c;
+  if (recv_request(connfd, &c, &req, legacy_cmds) < 0) {
+    return -1;
   }
-  long fsize = atol(sizestr);
-  free(sizestr);
 
-  if (fsize <= 0) {
-    printf("[S3] cmd_STORE: file size <= 0. Discard.\n");
-    // discard data if incorrect file size
-    char discard[512];
-    while (fsize > 0) {
-      long chunk = (fsize > 512) ? 512 : fsize;
-      if (recv_all(connfd, discard, chunk) < 0)
-        break;
-      fsize -= chunk;
+  // every command but TAR works on a path
+  const char *path = request_str(&req, 0);
+  if (!path && req.f.opcode != OP_HELLO && req.f.opcode != OP_TAR)
+    return -1;
+
+  switch (req.f.opcode) {
+  case OP_HELLO:
+    return send_frame(connfd, OP_HELLO, 0, c.reqid, 0);
+  case OP_STORE: {
+    // S1 moving files between servers asks to keep one that is there
+    uint64_t keep = 0;
+    request_u64(&req, 1, &keep);
+    return cmd_STORE(&c, path, keep != 0);
+  }
+  case OP_GET:
+    get_range(&c, &req, path);
+    break;
+  case OP_REMOVE:
+    cmd_REMOVE(&c, path);
+    break;
+  case OP_OPEN:
+  case OP_PART:
+  case OP_COMMIT: {
+    // multipart upload: the id (or size for OPEN) and the offset follow
+    // the path
+    uint64_t a = 0, b = 0;
+    request_u64(&req, 1, &a);
+    request_u64(&req, 2, &b);
+    if (req.f.opcode == OP_PART)
+      return cmd_PART(&c, (long)a, (long)b);
+    if (req.f.opcode == OP_COMMIT) {
+      cmd_COMMIT(&c, path, (long)a);
+      break;
     }
-    free(path);
-    return;
+    long res = cmd_OPEN(path, (long)a);
+    return conn_send_value(&c, res > 0 ? res : 0);
+  }
+  case OP_TAR:
+    cmd_TAR(&c);
+    break;
+  case OP_LIST: {
+    // one page: at most limit names, those behind after
+    uint64_t limit = 0;
+    request_u64(&req, 1, &limit);
+    if (limit == 0 || limit > LIST_PAGE_MAX)
+      limit = LIST_PAGE_MAX;
+    cmd_LIST(&c, path, request_str(&req, 2), (long)limit);
+    break;
+  }
+  case OP_DUMP: {
+    // S1 filling its catalog, the path is where the last page ended
+    uint64_t limit = 0;
+    request_u64(&req, 1, &limit);
+    return cmd_DUMP(&c, path, (long)limit);
   }
+  default:
+    return -1;
+  }
+  return 0;
+}
 
-  char localpath[CHUNK];
-  memset(localpath, 0, sizeof(localpath));
+// where a file stored under path goes, creating its folders
+static void store_path(const char *path, char *localpath) {
+  memset(localpath, 0, CHUNK);
 
-  snprintf(localpath, sizeof(localpath), "%s/%s", BASE_FOLDER, path);
-  free(path);
+  snprintf(localpath, CHUNK, "%s/%s", BASE_FOLDER, path);
 
   // handle when no filename has been provided
   size_t len = strlen(localpath);
@@ -164,11 +283,58 @@ void cmd_STORE(int connfd) {
     // create folders specified by user if they don't exist
     create_dirs_if_needed(folder);
   }
+}
+
+// Returns -1 if the file data could not be read off the connection. A v2
+// STORE is answered with the catalog record of the stored file, see
+// dir_index_stored(); an empty one when nothing was stored
+int cmd_STORE(struct conn *c, const char *path, int keep) {
+  int connfd = c->fd;
+
+  // get file size from S1
+  long fsize;
+  if (conn_recv_size(c, &fsize, NULL) < 0)
+    return -1;
+
+  if (fsize <= 0) {
+    printf("[S3] cmd_STORE: file size <= 0. Discard.\n");
+    return dir_index_stored(dirindex, c, NULL, 0, 0);
+  }
+
+  char localpath[CHUNK];
+  store_path(path, localpath);
+
+  if (dedup) {
+    struct dedup_stats ds;
+    int rc = dedup_store(dedup, connfd, NULL, fsize, localpath, keep, &ds);
+    if (rc < 0) {
+      printf("[S3] Error storing %s in %s\n", localpath, dedup);
+      return dir_index_stored(dirindex, c, NULL, 0, 0);
+    }
+    if (rc > 0) {
+      printf("[S3] Kept %s, it is there already\n", localpath);
+      return dir_index_stored(dirindex, c, localpath, -1, 0);
+    }
+    dedup_report(dedup, &ds);
+    tar_cache_bump(tarcache);
+    printf("[S3] Stored .txt => %s\n", localpath);
+    return dir_index_stored(dirindex, c, localpath, fsize, ds.crc);
+  }
 
-  // Open final file for writing
-  FILE *fp = fopen(localpath, "wb");
+  // the data goes into a file of its own next to the final one, which is
+  // renamed over it once complete: a GET never sees half a file, even while
+  // S1 is moving files onto this server, and two STOREs of the same path
+  // do not write into one file. An old version stored as a manifest lets go
+  // of its chunks then
+  char tmppath[CHUNK + 16];
+  int tmpfd = open_temp(localpath, tmppath, sizeof(tmppath));
+  FILE *fp = tmpfd < 0 ? NULL : fdopen(tmpfd, "wb");
   if (!fp) {
     perror("[S3] fopen in STORE");
+    if (tmpfd >= 0) {
+      close(tmpfd);
+      unlink(tmppath);
+    }
     // discard data if couldnt open file
     char discard[512];
     while (fsize > 0) {
@@ -177,11 +343,35 @@ void cmd_STORE(int connfd) {
         break;
       fsize -= chunk;
     }
-    return;
+    return dir_index_stored(dirindex, c, NULL, 0, 0);
+  }
+
+  if (uring_ready()) {
+    // batched recv -> write through io_uring, nothing goes through the
+    // FILE buffer so writing to its fd directly is fine
+    uint32_t crc = 0;
+    int rc = uring_recv_to_file(connfd, fileno(fp), 0, fsize, &crc);
+    fclose(fp);
+    if (rc == 0)
+      rc = install_file(tmppath, localpath, keep);
+    if (rc != 0)
+      unlink(tmppath);
+    if (rc < 0) {
+      printf("[S3] Error receiving file data.\n");
+      return dir_index_stored(dirindex, c, NULL, 0, 0);
+    }
+    if (rc > 0) {
+      printf("[S3] Kept %s, it is there already\n", localpath);
+      return dir_index_stored(dirindex, c, localpath, -1, 0);
+    }
+    tar_cache_bump(tarcache);
+    printf("[S3] Stored .txt => %s\n", localpath);
+    return dir_index_stored(dirindex, c, localpath, -1, crc);
   }
 
   // get data from S1
   long remain = fsize;
+  uint32_t crc = 0;
   char buf[CHUNK];
   while (remain > 0) {
     long chunk = (remain > CHUNK) ? CHUNK : remain;
@@ -196,145 +386,149 @@ void cmd_STORE(int connfd) {
       perror("[S3] fwrite error");
       break;
     }
+    crc = crc32c(crc, buf, chunk);
     remain -= chunk;
   }
   fclose(fp);
+  int rc = remain > 0 ? -1 : install_file(tmppath, localpath, keep);
+  if (rc != 0)
+    unlink(tmppath);
+  if (rc < 0)
+    return dir_index_stored(dirindex, c, NULL, 0, 0);
+  if (rc > 0) {
+    printf("[S3] Kept %s, it is there already\n", localpath);
+    return dir_index_stored(dirindex, c, localpath, -1, 0);
+  }
+  tar_cache_bump(tarcache);
 
   printf("[S3] Stored .txt => %s\n", localpath);
+  return dir_index_stored(dirindex, c, localpath, -1, crc);
 }
 
-void cmd_GET(int connfd) {
-  char *path = recv_string(connfd);
-  if (!path)
-    return;
-
+void cmd_GET(struct conn *c, const char *path, int ranged, long off,
+             long len) {
   char localpath[CHUNK];
   snprintf(localpath, sizeof(localpath), "%s/%s", BASE_FOLDER, path);
 
-  free(path);
-
-  FILE *fp = fopen(localpath, "rb");
-  if (!fp) {
+  // open + fstat instead of fopen + fseek, a range read should cost no more
+  // than the syscalls it needs
+  int fd = open_stored(localpath);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
     // send 0 file size to S1 indicating there's an error opening the file,
     // or file doesn't exist
-    send_string(connfd, "0");
+    if (fd >= 0)
+      close(fd);
+    conn_send_size(c, 0);
     return;
   }
-  fseek(fp, 0, SEEK_END);
-  long sz = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-
-  char sizebuf[64];
-  snprintf(sizebuf, sizeof(sizebuf), "%ld", sz);
-  // send file size
-  send_string(connfd, sizebuf);
-
-  // send file
-  char buf[CHUNK];
-  while (!feof(fp)) {
-    size_t r = fread(buf, 1, CHUNK, fp);
-    if (r > 0) {
-      if (send_all(connfd, buf, r) < 0) {
-        printf("[S3] GET send error\n");
-        break;
-      }
-    }
+  // a file stored with --dedup is a manifest of its chunks
+  struct manifest *m = manifest_load(fd);
+  long sz = m ? manifest_size(m) : st.st_size;
+
+  // send file size, or for a range the file size and the range length
+  long n = sz;
+  if (ranged) {
+    n = range_len(sz, off, len);
+    conn_send_range(c, sz, n);
+  } else {
+    off = 0;
+    conn_send_size(c, sz);
   }
-  fclose(fp);
-}
 
-void cmd_REMOVE(int connfd) {
-  char *path = recv_string(connfd);
-  if (!path)
-    return;
+  // send file straight from the page cache
+  int rc = 0;
+  if (n > 0)
+    rc = m ? manifest_send(m, c->fd, off, n) : send_file(c->fd, fd, off, n);
+  if (rc < 0)
+    printf("[S3] GET send error\n");
+  manifest_free(m);
+  close(fd);
+}
 
+void cmd_REMOVE(struct conn *c, const char *path) {
   char localpath[CHUNK];
   snprintf(localpath, sizeof(localpath), "%s/%s", BASE_FOLDER, path);
 
-  free(path);
+  int removed = dedup_remove(localpath) == 0;
+  if (removed)
+    dir_index_del(dirindex, localpath);
+  tar_cache_bump(tarcache);
+  // S1 keeps its catalog by the answer, older builds do not expect one
+  if (c->v2)
+    conn_send_value(c, removed);
+}
 
-  remove(localpath);
+// multipart uploads: a staging file per session, see stage_open(). Each
+// answer to OPEN and PART is a size, 0 meaning it failed; COMMIT is
+// answered like a STORE
+long cmd_OPEN(const char *path, long size) {
+  long id = stage_open(STAGE_FOLDER, size);
+  if (id < 0)
+    printf("[S3] cannot open an upload of %ld bytes for %s\n", size, path);
+  return id;
 }
 
-void cmd_TAR(int connfd) {
-  // works same way as S1
-  system("rm -f s3txt.tar");
-  system("tar -cf s3txt.tar S3");
+// Returns -1 if the part could not be read off the connection
+int cmd_PART(struct conn *c, long id, long off) {
+  long len;
+  if (conn_recv_size(c, &len, NULL) < 0)
+    return -1;
+  int rc = stage_part(STAGE_FOLDER, id, c->fd, off, len);
+  if (rc == -2)
+    return -1;
+  if (rc < 0)
+    printf("[S3] upload %lx: bad part at %ld\n", (unsigned long)id, off);
+  return conn_send_value(c, rc == 0 ? len : 0);
+}
 
-  FILE *fp = fopen("s3txt.tar", "rb");
-  if (!fp) {
-    send_string(connfd, "0");
+void cmd_COMMIT(struct conn *c, const char *path, long id) {
+  char localpath[CHUNK];
+  store_path(path, localpath);
+  uint32_t crc = 0;
+  long sz = stage_commit(STAGE_FOLDER, id, localpath, dedup, &crc);
+  if (sz < 0) {
+    printf("[S3] upload %lx: commit failed\n", (unsigned long)id);
+    dir_index_stored(dirindex, c, NULL, 0, 0);
     return;
   }
-  fseek(fp, 0, SEEK_END);
-  long sz = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-
-  char sizebuf[64];
-  snprintf(sizebuf, sizeof(sizebuf), "%ld", sz);
-  send_string(connfd, sizebuf);
-
-  char buf[CHUNK];
-  while (!feof(fp)) {
-    size_t r = fread(buf, 1, CHUNK, fp);
-    if (r > 0) {
-      if (send_all(connfd, buf, r) < 0) {
-        printf("[S3] TAR send error\n");
-        break;
-      }
-    }
-  }
-  fclose(fp);
+  tar_cache_bump(tarcache);
+  printf("[S3] Stored .txt => %s\n", localpath);
+  dir_index_stored(dirindex, c, localpath, sz, crc);
 }
 
-void cmd_LIST(int connfd) {
-  // works same way as S1
-  char *path = recv_string(connfd);
-  if (!path)
-    return;
+void cmd_TAR(struct conn *c) {
+  // works same way as S1: served from the cached archive while nothing
+  // was stored or removed since it was built
+  if (tar_cache_serve(tarcache, c) < 0)
+    printf("[S3] TAR send error\n");
+}
 
+void cmd_LIST(struct conn *c, const char *path, const char *after,
+              long limit) {
   char localpath[CHUNK];
   snprintf(localpath, sizeof(localpath), "%s/%s", BASE_FOLDER, path);
 
-  free(path);
-
-  DIR *d = opendir(localpath);
-  if (!d) {
-    // no directory => send empty list
-    send_string(connfd, "");
-    return;
-  }
-  char lines[256][256];
-  int count = 0;
-  struct dirent *dd;
-  while ((dd = readdir(d))) {
-    if (dd->d_name[0] == '.')
-      continue;
-    strncpy(lines[count], dd->d_name, 255);
-    lines[count][255] = '\0';
-    count++;
-    if (count >= 256)
-      break;
-  }
-  closedir(d);
-
-  // bubble sort
-  for (int i = 0; i < count; i++) {
-    for (int j = i + 1; j < count; j++) {
-      if (strcmp(lines[i], lines[j]) > 0) {
-        char tmp[256];
-        strcpy(tmp, lines[i]);
-        strcpy(lines[i], lines[j]);
-        strcpy(lines[j], tmp);
-      }
-    }
-  }
+  // sorted names straight from the index, or if it ran full from the
+  // folder, same way as S1
+  size_t len;
+  char *names = dir_index_list(dirindex, localpath, after, limit, &len);
+  if (!names)
+    names = list_dir_page(localpath, after, limit, NULL, &len);
+  conn_send_blob(c, names ? names : "", names ? len : 0);
+  free(names);
+}
 
-  char result[8192];
-  result[0] = '\0';
-  for (int i = 0; i < count; i++) {
-    strcat(result, lines[i]);
-    strcat(result, "\n");
+// Returns -1 if the index cannot be dumped, which closes the connection:
+// an empty page would tell S1 it has seen every file
+int cmd_DUMP(struct conn *c, const char *after, long limit) {
+  size_t len;
+  char *recs = dir_index_dump(dirindex, after, limit, &len);
+  if (!recs) {
+    printf("[S3] DUMP: the index ran full, S1 has to ask for every file\n");
+    return -1;
   }
-  send_string(connfd, result);
+  int rc = conn_send_blob(c, recs, len);
+  free(recs);
+  return rc;
 }
@@ -0,0 +1,366 @@
+/* s1bench.c - load generator for S1
+ *
+ * Opens <idle> connections that just sit there plus <active> connections
+ * that keep downloading a file, then reports how fast S1 accepted and
+ * served the connections, the request rate and throughput of the active
+ * ones, and how much memory S1 (the process plus all of its forked
+ * children) is using.
+ *
+ * The file is BENCH_FILE with <bytes> of data (default 64 KB), uploaded
+ * first, so every download goes from S2 through S1 to the client. With
+ * <bytes> 0 the active clients "downlf" a .c file that does not exist
+ * instead: S1 answers that locally with a "0" size, so the numbers measure
+ * S1 and not S2/S3/S4.
+ *
+ * usage: s1bench <s1-pid> [idle] [active] [seconds] [bytes]
+ */
+#include "utils.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define S1_HOST "127.0.0.1"
+#define S1_PORT 5001
+#define PING_CMD "downlf /__s1bench_missing__.c"
+#define BENCH_NAME "__s1bench__.pdf"
+#define BENCH_FILE "/s1bench/" BENCH_NAME
+#define BENCH_BYTES (64 * 1024)
+
+// where an active connection is in the reply to its download: the 4 byte
+// length of the size string, the size string, then that many bytes of data
+struct reply {
+  int phase;
+  uint32_t need;
+  long left;
+  long size;
+  char text[32];
+};
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_s1(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  struct sockaddr_in servAdd;
+  memset(&servAdd, 0, sizeof(servAdd));
+  servAdd.sin_family = AF_INET;
+  servAdd.sin_port = htons(S1_PORT);
+  inet_pton(AF_INET, S1_HOST, &servAdd.sin_addr);
+  if (connect(fd, (struct sockaddr *)&servAdd, sizeof(servAdd)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// one round trip, used to make sure S1 really serves the connection (in the
+// fork model the handshake completes long before the child exists)
+static int ping(int fd) {
+  if (send_string(fd, PING_CMD) < 0)
+    return -1;
+  char *r = recv_string(fd);
+  if (!r)
+    return -1;
+  free(r);
+  return 0;
+}
+
+// the size S1 reports for path, -1 on error
+static long remote_size(int fd, const char *path) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "downlf %s", path);
+  if (send_string(fd, cmd) < 0)
+    return -1;
+  char *r = recv_string(fd);
+  if (!r)
+    return -1;
+  long size = atol(r);
+  free(r);
+  char buf[65536];
+  for (long left = size; left > 0;) {
+    size_t n = left < (long)sizeof(buf) ? (size_t)left : sizeof(buf);
+    if (recv_all(fd, buf, n) < 0)
+      return -1;
+    left -= n;
+  }
+  return size;
+}
+
+// upload BENCH_FILE with bytes of data and wait until S1 serves it
+static int bench_upload(long bytes) {
+  int fd = connect_s1();
+  if (fd < 0)
+    return -1;
+  struct conn c = {fd, 0, 0, 0, 0};
+  char *data = (char *)malloc(bytes);
+  int rc = -1;
+  if (data) {
+    for (long i = 0; i < bytes; i++)
+      data[i] = (char)(i * 131);
+    if (send_string(fd, "uploadf " BENCH_NAME " /s1bench/") == 0 &&
+        conn_send_size(&c, bytes) == 0 && send_all(fd, data, bytes) == 0) {
+      // there is no answer to an upload, ask until it shows up
+      for (int i = 0; i < 100 && rc < 0; i++) {
+        if (remote_size(fd, BENCH_FILE) == bytes)
+          rc = 0;
+        else
+          usleep(100000);
+      }
+    }
+  }
+  free(data);
+  close(fd);
+  return rc;
+}
+
+static void reply_reset(struct reply *r) {
+  r->phase = 0;
+  r->need = 4;
+  r->left = 0;
+}
+
+// take n bytes of reply data. Returns 1 once the reply is complete
+static int reply_feed(struct reply *r, const char *p, size_t n,
+                      size_t *used) {
+  size_t off = 0;
+  while (off < n) {
+    if (r->phase == 2) {
+      size_t take = (long)(n - off) < r->left ? n - off : (size_t)r->left;
+      r->left -= take;
+      off += take;
+    } else {
+      size_t take = n - off < r->need ? n - off : r->need;
+      size_t have = (r->phase == 0 ? 4 : (size_t)r->left) - r->need;
+      memcpy(r->text + have, p + off, take);
+      r->need -= take;
+      off += take;
+      if (r->need > 0)
+        continue;
+      if (r->phase == 0) {
+        uint32_t len;
+        memcpy(&len, r->text, 4);
+        len = ntohl(len);
+        if (len >= sizeof(r->text))
+          len = sizeof(r->text) - 1;
+        r->phase = 1;
+        r->need = len;
+        r->left = len;
+        memset(r->text, 0, sizeof(r->text));
+        if (len > 0)
+          continue;
+      }
+      r->phase = 2;
+      r->left = r->size = atol(r->text);
+    }
+    if (r->phase == 2 && r->left == 0) {
+      *used = off;
+      return 1;
+    }
+  }
+  *used = off;
+  return 0;
+}
+
+// read one "key:   123 kB" value out of a /proc file
+static long proc_kb(const char *file, const char *key) {
+  FILE *fp = fopen(file, "r");
+  if (!fp)
+    return 0;
+  char line[256];
+  long val = 0;
+  size_t klen = strlen(key);
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, key, klen) == 0) {
+      val = atol(line + klen);
+      break;
+    }
+  }
+  fclose(fp);
+  return val;
+}
+
+static int parent_of(int pid) {
+  char file[64];
+  snprintf(file, sizeof(file), "/proc/%d/stat", pid);
+  FILE *fp = fopen(file, "r");
+  if (!fp)
+    return -1;
+  char buf[512];
+  size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[n] = '\0';
+  // the comm field can contain spaces, ppid is the second field after ')'
+  char *p = strrchr(buf, ')');
+  if (!p)
+    return -1;
+  int ppid = -1;
+  char state;
+  sscanf(p + 1, " %c %d", &state, &ppid);
+  return ppid;
+}
+
+static int in_tree(int pid, int root) {
+  for (int depth = 0; pid > 1 && depth < 8; depth++) {
+    if (pid == root)
+      return 1;
+    pid = parent_of(pid);
+  }
+  return pid == root;
+}
+
+// sum VmRSS and Pss over the S1 process and all of its descendants
+static void s1_memory(int root, long *rss_kb, long *pss_kb, int *nproc) {
+  *rss_kb = *pss_kb = 0;
+  *nproc = 0;
+  DIR *d = opendir("/proc");
+  if (!d)
+    return;
+  struct dirent *dd;
+  while ((dd = readdir(d))) {
+    if (!isdigit((unsigned char)dd->d_name[0]))
+      continue;
+    int pid = atoi(dd->d_name);
+    if (!in_tree(pid, root))
+      continue;
+    char file[64];
+    snprintf(file, sizeof(file), "/proc/%d/status", pid);
+    *rss_kb += proc_kb(file, "VmRSS:");
+    snprintf(file, sizeof(file), "/proc/%d/smaps_rollup", pid);
+    *pss_kb += proc_kb(file, "Pss:");
+    (*nproc)++;
+  }
+  closedir(d);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "usage: %s <s1-pid> [idle] [active] [seconds] [bytes]\n",
+            argv[0]);
+    return 1;
+  }
+  int s1pid = atoi(argv[1]);
+  int nidle = argc > 2 ? atoi(argv[2]) : 10000;
+  int nactive = argc > 3 ? atoi(argv[3]) : 1000;
+  int seconds = argc > 4 ? atoi(argv[4]) : 10;
+  long bytes = argc > 5 ? atol(argv[5]) : BENCH_BYTES;
+  int total = nidle + nactive;
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "%s", bytes > 0 ? "downlf " BENCH_FILE : PING_CMD);
+  if (bytes > 0 && bench_upload(bytes) < 0) {
+    fprintf(stderr, "cannot upload %s, is S2 up?\n", BENCH_FILE);
+    return 1;
+  }
+
+  // we need a descriptor per connection
+  struct rlimit rl;
+  getrlimit(RLIMIT_NOFILE, &rl);
+  if (rl.rlim_cur < (rlim_t)total + 64) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  int *fds = (int *)calloc(total, sizeof(int));
+  double t0 = now_sec();
+  int opened = 0;
+  for (int i = 0; i < total; i++) {
+    fds[i] = connect_s1();
+    if (fds[i] < 0 || ping(fds[i]) < 0) {
+      fprintf(stderr, "connection %d failed: %s\n", i, strerror(errno));
+      if (fds[i] >= 0)
+        close(fds[i]);
+      break;
+    }
+    opened++;
+  }
+  double t1 = now_sec();
+  printf("connections:     %d opened in %.2fs (%.0f conn/s)\n", opened,
+         t1 - t0, opened / (t1 - t0));
+  if (opened < total) {
+    nactive = opened > nidle ? opened - nidle : 0;
+    nidle = opened - nactive;
+  }
+
+  long rss, pss;
+  int np;
+  s1_memory(s1pid, &rss, &pss, &np);
+  printf("idle memory:     %d processes, RSS %ld kB, PSS %ld kB\n", np, rss,
+         pss);
+
+  // closed loop on the active connections: every reply triggers the next
+  // request on the same connection
+  int ep = epoll_create1(0);
+  struct reply *got = (struct reply *)calloc(total, sizeof(struct reply));
+  for (int i = nidle; i < nidle + nactive; i++) {
+    set_nonblocking(fds[i], 1);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &ev);
+    reply_reset(&got[i]);
+    send_string(fds[i], cmd);
+  }
+
+  long requests = 0;
+  long received = 0;
+  long empty = 0; // the file did not come
+  static char tmp[65536];
+  double start = now_sec();
+  double end = start + seconds;
+  long peak_rss = 0, peak_pss = 0;
+  double next_sample = start + 1;
+  struct epoll_event evs[256];
+  while (nactive > 0 && now_sec() < end) {
+    int n = epoll_wait(ep, evs, 256, 100);
+    for (int k = 0; k < n; k++) {
+      int i = evs[k].data.u32;
+      ssize_t r = recv(fds[i], tmp, sizeof(tmp), 0);
+      if (r <= 0) {
+        if (r < 0 && errno == EAGAIN)
+          continue;
+        epoll_ctl(ep, EPOLL_CTL_DEL, fds[i], NULL);
+        continue;
+      }
+      received += r;
+      size_t off = 0, used;
+      while (off < (size_t)r &&
+             reply_feed(&got[i], tmp + off, r - off, &used)) {
+        off += used;
+        if (bytes > 0 && got[i].size != bytes)
+          empty++;
+        reply_reset(&got[i]);
+        requests++;
+        set_nonblocking(fds[i], 0);
+        send_string(fds[i], cmd);
+        set_nonblocking(fds[i], 1);
+      }
+    }
+    if (now_sec() >= next_sample) {
+      s1_memory(s1pid, &rss, &pss, &np);
+      if (rss > peak_rss)
+        peak_rss = rss;
+      if (pss > peak_pss)
+        peak_pss = pss;
+      next_sample += 1;
+    }
+  }
+  double elapsed = now_sec() - start;
+  if (nactive > 0) {
+    printf("active requests: %ld in %.2fs (%.0f req/s over %d clients)\n",
+           requests, elapsed, requests / elapsed, nactive);
+    printf("throughput:      %.1f MB/s", received / elapsed / 1e6);
+    printf(empty ? ", %ld downloads failed\n" : "\n", empty);
+    printf("peak memory:     RSS %ld kB, PSS %ld kB\n", peak_rss, peak_pss);
+  }
+
+  for (int i = 0; i < opened; i++)
+    close(fds[i]);
+  free(fds);
+  free(got);
+  return 0;
+}
@@ -1,18 +1,91 @@
+#define _GNU_SOURCE
+#include "utils.h"
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
 
+// ---------------------------------------------------------------------------
+// deadlines (see utils.h)
+
+int io_timeout = IO_TIMEOUT_SEC;
+long io_min_rate = IO_MIN_RATE;
+int idle_timeout = IDLE_TIMEOUT_SEC;
+
+// the request under way on this thread: seconds spent waiting on sockets
+// and bytes moved since io_begin()
+static __thread struct {
+  int on;
+  int slow;
+  double wait;
+  long bytes;
+} io_req;
+
+void sock_deadlines(int fd) {
+  struct timeval tv = {io_timeout > 0 ? io_timeout : 0, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void io_begin(void) {
+  io_req.on = 1;
+  io_req.slow = 0;
+  io_req.wait = 0;
+  io_req.bytes = 0;
+}
+
+static double io_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a socket call that started at t0 moved n bytes (n < 0: none). -1 with
+// errno ETIMEDOUT if that leaves the request below io_min_rate
+static int io_account(double t0, long n) {
+  if (!io_req.on)
+    return 0;
+  io_req.wait += io_now() - t0;
+  if (n > 0)
+    io_req.bytes += n;
+  if (io_timeout <= 0 || io_min_rate <= 0 || io_req.wait < io_timeout ||
+      io_req.bytes >= io_req.wait * io_min_rate)
+    return 0;
+  if (!io_req.slow)
+    printf("[io] %ld bytes in %.0f s, below %ld bytes/s, giving up\n",
+           io_req.bytes, io_req.wait, io_min_rate);
+  io_req.slow = 1;
+  errno = ETIMEDOUT;
+  return -1;
+}
+
 // Simple send/recv wrapper for fixed-length messages
 // Returns 0 on success, or -1 on error/EOF
 // send/recv are specifically designed for sockets, whereas read/write
@@ -23,8 +96,9 @@ int send_all(int sock, const void *buf, size_t len) {
   size_t total = 0;
   const char *p = (const char *)buf;
   while (total < len) {
+    double t0 = io_now();
     ssize_t sent = send(sock, p + total, len - total, 0);
-    if (sent <= 0) {
+    if (io_account(t0, sent) < 0 || sent <= 0) {
       perror("send error");
 
       return -1;
@@ -39,8 +113,9 @@ int recv_all(int sock, void *buf, size_t len) {
   size_t total = 0;
   char *p = (char *)buf;
   while (total < len) {
+    double t0 = io_now();
     ssize_t got = recv(sock, p + total, len - total, 0);
-    if (got <= 0) {
+    if (io_account(t0, got) < 0 || got <= 0) {
       perror("recv error");
 
       return -1;
@@ -85,7 +160,8 @@ void create_dirs_if_needed(const char *path) {
 
   // loop through provided path and tokenizes folder names through /
   char build[1024] = "";
-  char *p = strtok(temp, "/");
+  char *save = NULL;
+  char *p = strtok_r(temp, "/", &save);
 
   while (p != NULL) {
     strcat(build, p);
@@ -94,6 +170,4653 @@ void create_dirs_if_needed(const char *path) {
     // Try to create the directory; ignore if it already exists
     mkdir(build, 0777);
 
-    p = strtok(NULL, "/");
+    p = strtok_r(NULL, "/", &save);
+  }
+}
+
+// switch a descriptor between blocking and non-blocking mode
+int set_nonblocking(int fd, int on) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0)
+    return -1;
+  if (on)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+  return fcntl(fd, F_SETFL, flags);
+}
+
+// ---------------------------------------------------------------------------
+// protocol v2 (layout in utils.h)
+
+// largest OP_DATA reply conn_recv_blob() takes into memory
+#define BLOB_MAX (16 * 1024 * 1024)
+
+static void put_be16(unsigned char *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+  put_be16(p, v >> 16);
+  put_be16(p + 2, v);
+}
+
+static void put_be64(unsigned char *p, uint64_t v) {
+  put_be32(p, v >> 32);
+  put_be32(p + 4, v);
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+  return (uint32_t)get_be16(p) << 16 | get_be16(p + 2);
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+void frame_encode(unsigned char *hdr, const struct frame *f) {
+  put_be32(hdr, PROTO_MAGIC);
+  hdr[4] = f->version;
+  hdr[5] = f->opcode;
+  put_be16(hdr + 6, f->flags);
+  put_be32(hdr + 8, f->reqid);
+  put_be64(hdr + 12, f->len);
+}
+
+int frame_decode(const unsigned char *hdr, struct frame *f) {
+  if (get_be32(hdr) != PROTO_MAGIC || hdr[4] != PROTO_VERSION)
+    return -1;
+  f->version = hdr[4];
+  f->opcode = hdr[5];
+  f->flags = get_be16(hdr + 6);
+  f->reqid = get_be32(hdr + 8);
+  f->len = get_be64(hdr + 12);
+  return 0;
+}
+
+// send a header and its payload in one go, so a small message leaves as a
+// single segment instead of waiting behind Nagle. MSG_MORE in flags holds
+// it back for the bulk data the caller sends next
+static int send_hdr_data(int sock, const void *hdr, size_t hlen,
+                         const void *data, size_t dlen, int flags) {
+  struct iovec iov[2] = {{(void *)hdr, hlen}, {(void *)data, dlen}};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  while (iov[0].iov_len + iov[1].iov_len > 0) {
+    double t0 = io_now();
+    ssize_t n = sendmsg(sock, &msg, flags);
+    if (io_account(t0, n) < 0)
+      return -1;
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      perror("send error");
+      return -1;
+    }
+    for (int i = 0; i < 2 && n > 0; i++) {
+      size_t k = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+      iov[i].iov_base = (char *)iov[i].iov_base + k;
+      iov[i].iov_len -= k;
+      n -= k;
+    }
+  }
+  return 0;
+}
+
+int send_frame(int sock, int opcode, int flags, uint32_t reqid, uint64_t len) {
+  struct frame f = {PROTO_VERSION, (uint8_t)opcode, (uint16_t)flags, reqid,
+                    len};
+  unsigned char hdr[FRAME_HDR_LEN];
+  frame_encode(hdr, &f);
+  return send_all(sock, hdr, sizeof(hdr));
+}
+
+int recv_frame(int sock, struct frame *f) {
+  unsigned char hdr[FRAME_HDR_LEN];
+  if (recv_all(sock, hdr, sizeof(hdr)) < 0)
+    return -1;
+  return frame_decode(hdr, f);
+}
+
+// request ids only have to be unique per connection
+uint32_t proto_next_id(void) {
+  static uint32_t next;
+  return __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+}
+
+const char *request_str(const struct request *r, int i) {
+  if (i >= r->nargs || r->arglen[i] == 0 ||
+      r->arg[i][r->arglen[i] - 1] != '\0')
+    return NULL;
+  return r->arg[i];
+}
+
+int request_u64(const struct request *r, int i, uint64_t *v) {
+  if (i >= r->nargs || r->arglen[i] != 8)
+    return -1;
+  *v = get_be64((unsigned char *)r->arg[i]);
+  return 0;
+}
+
+// split a v2 payload into its fields, in place
+static int request_parse(struct request *r) {
+  size_t off = 0;
+  size_t len = r->f.len;
+  r->nargs = 0;
+  while (off < len) {
+    if (r->nargs == REQ_MAX_ARGS || len - off < 2)
+      return -1;
+    uint16_t n = get_be16((unsigned char *)r->buf + off);
+    off += 2;
+    if (n > len - off)
+      return -1;
+    r->arg[r->nargs] = r->buf + off;
+    r->arglen[r->nargs] = n;
+    r->nargs++;
+    off += n;
+  }
+  return 0;
+}
+
+// map a legacy command string onto an opcode and its arguments. Arguments
+// missing from the string are read as separate strings into the rest of buf
+static int request_legacy(int sock, struct request *r,
+                          const struct legacy_cmd *cmds) {
+  size_t used = r->f.len + 1;
+  r->buf[r->f.len] = '\0';
+  char *save = NULL;
+  char *name = strtok_r(r->buf, " ", &save);
+  if (!name)
+    return -1;
+  const struct legacy_cmd *cmd = cmds;
+  while (cmd->name && strcmp(cmd->name, name) != 0)
+    cmd++;
+  if (!cmd->name)
+    return -1;
+  r->f.opcode = cmd->opcode;
+  r->nargs = 0;
+  char *tok;
+  while (r->nargs < cmd->nargs && (tok = strtok_r(NULL, " ", &save))) {
+    r->arg[r->nargs] = tok;
+    r->arglen[r->nargs] = strlen(tok) + 1;
+    r->nargs++;
+  }
+  while (r->nargs < cmd->nargs) {
+    uint32_t n;
+    if (recv_all(sock, &n, 4) < 0)
+      return -1;
+    n = ntohl(n);
+    if (n >= sizeof(r->buf) - used)
+      return -1;
+    char *p = r->buf + used;
+    if (n > 0 && recv_all(sock, p, n) < 0)
+      return -1;
+    p[n] = '\0';
+    r->arg[r->nargs] = p;
+    r->arglen[r->nargs] = n + 1;
+    r->nargs++;
+    used += n + 1;
+  }
+  return 0;
+}
+
+int request_finish(struct conn *c, struct request *r,
+                   const struct legacy_cmd *cmds) {
+  c->v2 = r->f.version != 0;
+  c->reqid = r->f.reqid;
+  c->lz = c->v2 && (r->f.flags & FRAME_LZ);
+  c->packed = 0;
+  if (c->v2)
+    return request_parse(r);
+  return request_legacy(c->fd, r, cmds);
+}
+
+int recv_request(int sock, struct conn *c, struct request *r,
+                 const struct legacy_cmd *cmds) {
+  unsigned char hdr[FRAME_HDR_LEN];
+  struct pollfd pfd = {sock, POLLIN, 0};
+  int rc;
+  do
+    rc = poll(&pfd, 1, idle_timeout > 0 ? idle_timeout * 1000 : -1);
+  while (rc < 0 && errno == EINTR);
+  if (rc == 0)
+    return -1;
+  io_begin();
+  if (recv_all(sock, hdr, 4) < 0)
+    return -1;
+  memset(&r->f, 0, sizeof(r->f));
+  if (get_be32(hdr) == PROTO_MAGIC) {
+    if (recv_all(sock, hdr + 4, FRAME_HDR_LEN - 4) < 0 ||
+        frame_decode(hdr, &r->f) < 0)
+      return -1;
+  } else {
+    // legacy: the 4 bytes were the length of the command string
+    r->f.len = get_be32(hdr);
+  }
+  if (r->f.len > REQ_MAX_LEN)
+    return -1;
+  if (r->f.len > 0 && recv_all(sock, r->buf, r->f.len) < 0)
+    return -1;
+  c->fd = sock;
+  return request_finish(c, r, cmds);
+}
+
+void reqbuf_init(struct reqbuf *b) { b->len = 0; }
+
+int reqbuf_str(struct reqbuf *b, const char *s) {
+  size_t n = strlen(s) + 1;
+  if (n > 0xffff || b->len + 2 + n > sizeof(b->buf))
+    return -1;
+  put_be16((unsigned char *)b->buf + b->len, n);
+  memcpy(b->buf + b->len + 2, s, n);
+  b->len += 2 + n;
+  return 0;
+}
+
+int reqbuf_u64(struct reqbuf *b, uint64_t v) {
+  if (b->len + 2 + 8 > sizeof(b->buf))
+    return -1;
+  put_be16((unsigned char *)b->buf + b->len, 8);
+  put_be64((unsigned char *)b->buf + b->len + 2, v);
+  b->len += 2 + 8;
+  return 0;
+}
+
+int send_request(int sock, int opcode, int flags, uint32_t reqid,
+                 const struct reqbuf *b) {
+  struct frame f = {PROTO_VERSION, (uint8_t)opcode, (uint16_t)flags, reqid,
+                    b->len};
+  unsigned char hdr[FRAME_HDR_LEN];
+  frame_encode(hdr, &f);
+  return send_hdr_data(sock, hdr, sizeof(hdr), b->buf, b->len, 0);
+}
+
+int send_request_data(int sock, int opcode, uint32_t reqid,
+                      const struct reqbuf *b, uint64_t len) {
+  struct frame f = {PROTO_VERSION, (uint8_t)opcode, 0, reqid, b->len};
+  struct frame d = {PROTO_VERSION, OP_DATA, 0, reqid, len};
+  unsigned char hdr[FRAME_HDR_LEN];
+  char body[sizeof(b->buf) + FRAME_HDR_LEN];
+  frame_encode(hdr, &f);
+  memcpy(body, b->buf, b->len);
+  frame_encode((unsigned char *)body + b->len, &d);
+  return send_hdr_data(sock, hdr, sizeof(hdr), body, b->len + FRAME_HDR_LEN,
+                       len > 0 ? MSG_MORE : 0);
+}
+
+// size header of a reply, flags for the OP_DATA frame
+static int send_size_hdr(struct conn *c, int flags, long size) {
+  if (c->v2) {
+    // the data follows right away: without MSG_MORE a small file would sit
+    // behind Nagle until the header is acked
+    struct frame f = {PROTO_VERSION, OP_DATA, (uint16_t)flags, c->reqid, size};
+    unsigned char hdr[FRAME_HDR_LEN];
+    frame_encode(hdr, &f);
+    return send_hdr_data(c->fd, hdr, sizeof(hdr), NULL, 0,
+                         size > 0 ? MSG_MORE : 0);
+  }
+  char tmp[32];
+  snprintf(tmp, sizeof(tmp), "%ld", size);
+  return send_string(c->fd, tmp);
+}
+
+int conn_send_size(struct conn *c, long size) {
+  return send_size_hdr(c, 0, size);
+}
+
+int conn_send_value(struct conn *c, long v) {
+  if (c->v2)
+    return send_frame(c->fd, OP_DATA, 0, c->reqid, v);
+  return conn_send_size(c, v);
+}
+
+int conn_send_chunked(struct conn *c) {
+  if (c->v2)
+    return send_frame(c->fd, OP_DATA, FRAME_CHUNKED, c->reqid, 0);
+  return send_string(c->fd, TAR_CHUNKED);
+}
+
+int conn_send_blob(struct conn *c, const char *data, size_t len) {
+  unsigned char hdr[FRAME_HDR_LEN];
+  size_t hlen;
+  if (c->v2) {
+    struct frame f = {PROTO_VERSION, OP_DATA, 0, c->reqid, len};
+    frame_encode(hdr, &f);
+    hlen = FRAME_HDR_LEN;
+  } else {
+    put_be32(hdr, len);
+    hlen = 4;
+  }
+  return send_hdr_data(c->fd, hdr, hlen, data, len, 0);
+}
+
+int conn_recv_size(struct conn *c, long *size, int *chunked) {
+  if (chunked)
+    *chunked = 0;
+  c->packed = 0;
+  if (c->v2) {
+    struct frame f;
+    if (recv_frame(c->fd, &f) < 0 || f.opcode != OP_DATA ||
+        f.reqid != c->reqid || f.len > (uint64_t)LONG_MAX)
+      return -1;
+    c->packed = (f.flags & FRAME_LZ) != 0;
+    if (f.flags & FRAME_CHUNKED) {
+      if (!chunked)
+        return -1;
+      *chunked = 1;
+    }
+    *size = (long)f.len;
+    return 0;
+  }
+  char *s = recv_string(c->fd);
+  if (!s)
+    return -1;
+  if (chunked && strcmp(s, TAR_CHUNKED) == 0) {
+    *chunked = 1;
+    *size = 0;
+  } else {
+    *size = atol(s);
+  }
+  free(s);
+  return 0;
+}
+
+char *conn_recv_blob(struct conn *c, size_t *n) {
+  if (!c->v2) {
+    char *s = recv_string(c->fd);
+    if (s && n)
+      *n = strlen(s);
+    return s;
+  }
+  long len;
+  if (conn_recv_size(c, &len, NULL) < 0 || len > BLOB_MAX)
+    return NULL;
+  char *buf = (char *)calloc(len + 1, 1);
+  if (!buf)
+    return NULL;
+  if (len > 0 && recv_all(c->fd, buf, len) < 0) {
+    free(buf);
+    return NULL;
+  }
+  if (n)
+    *n = len;
+  return buf;
+}
+
+long range_len(long total, long off, long len) {
+  long n = off < total ? total - off : 0;
+  if (len > 0 && len < n)
+    n = len;
+  return n;
+}
+
+static int send_range_hdr(struct conn *c, int flags, long total, long n) {
+  // ranges only exist in v2, a legacy peer never asks for one
+  if (!c->v2)
+    return conn_send_size(c, n);
+  struct frame f = {PROTO_VERSION, OP_DATA, (uint16_t)(FRAME_RANGE | flags),
+                    c->reqid, 8 + n};
+  unsigned char hdr[FRAME_HDR_LEN];
+  unsigned char tot[8];
+  frame_encode(hdr, &f);
+  put_be64(tot, total);
+  return send_hdr_data(c->fd, hdr, sizeof(hdr), tot, sizeof(tot),
+                       n > 0 ? MSG_MORE : 0);
+}
+
+int conn_send_range(struct conn *c, long total, long n) {
+  return send_range_hdr(c, 0, total, n);
+}
+
+int conn_recv_range(struct conn *c, long *total, long *n) {
+  c->packed = 0;
+  if (!c->v2) {
+    if (conn_recv_size(c, n, NULL) < 0)
+      return -1;
+    *total = *n;
+    return 0;
+  }
+  struct frame f;
+  if (recv_frame(c->fd, &f) < 0 || f.opcode != OP_DATA ||
+      f.reqid != c->reqid || f.len > (uint64_t)LONG_MAX)
+    return -1;
+  c->packed = (f.flags & FRAME_LZ) != 0;
+  if (!(f.flags & FRAME_RANGE)) {
+    *total = *n = (long)f.len;
+    return 0;
+  }
+  unsigned char tot[8];
+  if (f.len < sizeof(tot) || recv_all(c->fd, tot, sizeof(tot)) < 0)
+    return -1;
+  uint64_t t = get_be64(tot);
+  if (t > (uint64_t)LONG_MAX)
+    return -1;
+  *total = (long)t;
+  *n = (long)(f.len - sizeof(tot));
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// compressed data frames
+//
+// A client whose HELLO_LZ was answered may flag its requests FRAME_LZ, which
+// lets the reply data go out compressed; its own uploads may be sent the
+// same way. Compressed data is an OP_DATA frame flagged FRAME_LZ whose
+// length is still the uncompressed size (8 + n for a range), followed by
+// blocks of at most LZ_BLOCK bytes: raw length(4) length on the wire(4),
+// then an LZ4 block, or the bytes as they are when both lengths are equal.
+// Whether it is worth it is decided on the first block, so a file that does
+// not compress keeps its zero-copy path and costs one trial compression
+
+#define LZ_HASH_LOG 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // LZ4 ends every block with literals
+#define LZ_MF_LIMIT 12     // and starts no match closer to the end
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+struct lz {
+  uint32_t table[1 << LZ_HASH_LOG];
+  unsigned char in[LZ_BLOCK];
+  unsigned char out[LZ_BOUND(LZ_BLOCK)];
+};
+
+static uint32_t lz_read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static unsigned char *lz_put_len(unsigned char *op, size_t len) {
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+// LZ4 block format. Returns the compressed size, 0 if it would not fit in
+// cap bytes
+static size_t lz_compress(struct lz *z, const unsigned char *src, size_t n,
+                          unsigned char *dst, size_t cap) {
+  const unsigned char *ip = src, *anchor = src, *end = src + n;
+  const unsigned char *mf_limit = src + (n > LZ_MF_LIMIT ? n - LZ_MF_LIMIT : 0);
+  const unsigned char *match_limit = end - LZ_LAST_LITERALS;
+  unsigned char *op = dst, *oend = dst + cap;
+  memset(z->table, 0, sizeof(z->table));
+  while (ip < mf_limit) {
+    uint32_t seq = lz_read32(ip);
+    uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_LOG);
+    const unsigned char *ref = src + z->table[h];
+    z->table[h] = (uint32_t)(ip - src);
+    if (ref >= ip || ip - ref > 0xffff || lz_read32(ref) != seq) {
+      // step faster through data that keeps not matching
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    const unsigned char *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+    while (m + 8 <= match_limit) {
+      uint64_t a, b;
+      memcpy(&a, m, 8);
+      memcpy(&b, r, 8);
+      if (a != b)
+        break; // the byte loop finds where
+      m += 8;
+      r += 8;
+    }
+    while (m < match_limit && *m == *r) {
+      m++;
+      r++;
+    }
+    size_t lit = ip - anchor, mlen = m - ip - LZ_MIN_MATCH;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+      return 0;
+    unsigned char *token = op++;
+    *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15)
+      op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    size_t off = ip - ref;
+    *op++ = (unsigned char)off;
+    *op++ = (unsigned char)(off >> 8);
+    *token |= (unsigned char)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15)
+      op = lz_put_len(op, mlen - 15);
+    anchor = ip = m;
+  }
+  size_t lit = end - anchor;
+  if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+    return 0;
+  *op++ = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+  if (lit >= 15)
+    op = lz_put_len(op, lit - 15);
+  memcpy(op, anchor, lit);
+  op += lit;
+  return op - dst;
+}
+
+// -1 if src is not a valid block for exactly cap bytes
+static long lz_decompress(const unsigned char *src, size_t n,
+                          unsigned char *dst, size_t cap) {
+  const unsigned char *ip = src, *iend = src + n;
+  unsigned char *op = dst, *oend = dst + cap;
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t lit = token >> 4;
+    if (lit == 15) {
+      unsigned b;
+      do {
+        if (ip == iend)
+          return -1;
+        lit += b = *ip++;
+      } while (b == 255);
+    }
+    if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+      return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend)
+      break; // the last sequence has no match
+    if (iend - ip < 2)
+      return -1;
+    size_t off = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    size_t mlen = token & 15;
+    if (mlen == 15) {
+      unsigned b;
+      do {
+        if (ip == iend)
+          return -1;
+        mlen += b = *ip++;
+      } while (b == 255);
+    }
+    mlen += LZ_MIN_MATCH;
+    if (off == 0 || off > (size_t)(op - dst) || mlen > (size_t)(oend - op))
+      return -1;
+    const unsigned char *ref = op - off;
+    if (off >= mlen) {
+      memcpy(op, ref, mlen);
+      op += mlen;
+    } else {
+      // overlapping copy repeats the last off bytes
+      while (mlen--)
+        *op++ = *ref++;
+    }
+  }
+  return op == oend ? op - dst : -1;
+}
+
+// next len bytes of a source: the file src at *off, or the socket src when
+// *off < 0
+static int lz_fill(int src, long *off, void *buf, size_t len) {
+  if (*off < 0)
+    return recv_all(src, buf, len);
+  char *p = (char *)buf;
+  while (len > 0) {
+    ssize_t r = pread(src, p, len, *off);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    len -= r;
+    *off += r;
+  }
+  return 0;
+}
+
+// compress z->in[0..len) for the wire: hdr gets the block header, *data
+// points at what follows it. Returns the length of *data
+static size_t lz_block(struct lz *z, size_t len, unsigned char *hdr,
+                       const unsigned char **data) {
+  size_t w = lz_compress(z, z->in, len, z->out, len - 1);
+  *data = w ? z->out : z->in;
+  if (!w)
+    w = len;
+  put_be32(hdr, len);
+  put_be32(hdr + 4, w);
+  return w;
+}
+
+int conn_send_data(struct conn *c, long range, int src, long off, long n) {
+  struct lz *z = NULL;
+  size_t first = 0;
+  size_t wire = 0;
+  unsigned char hdr[8];
+  const unsigned char *data = NULL;
+  if (c->v2 && c->lz && n > 0 && (z = (struct lz *)malloc(sizeof(*z)))) {
+    // trial run on the first block: less than 1/8 saved is not worth it
+    first = n < LZ_BLOCK ? n : LZ_BLOCK;
+    if (lz_fill(src, &off, z->in, first) < 0) {
+      free(z);
+      return -1;
+    }
+    wire = lz_block(z, first, hdr, &data);
+    if (wire > first - first / 8)
+      data = NULL;
+  }
+  int flags = data ? FRAME_LZ : 0;
+  int rc = range >= 0 ? send_range_hdr(c, flags, range, n)
+                      : send_size_hdr(c, flags, n);
+  if (rc == 0 && !data) {
+    // as it is: what the trial read, then the rest without copying
+    if (first > 0)
+      rc = send_all(c->fd, z->in, first);
+    if (rc == 0 && n > (long)first)
+      rc = off < 0 ? relay(src, c->fd, n - first)
+                   : send_file(c->fd, src, off, n - first);
+    free(z);
+    return rc;
+  }
+  for (long left = n - first; rc == 0;) {
+    rc = send_hdr_data(c->fd, hdr, sizeof(hdr), data, wire,
+                       left > 0 ? MSG_MORE : 0);
+    if (rc < 0 || left == 0)
+      break;
+    size_t len = left < LZ_BLOCK ? left : LZ_BLOCK;
+    rc = lz_fill(src, &off, z->in, len);
+    if (rc == 0)
+      wire = lz_block(z, len, hdr, &data);
+    left -= len;
+  }
+  free(z);
+  return rc;
+}
+
+// where conn_recv_data() puts a block. On error dst is given up on (*dst
+// becomes -1) and the rest is only read off the connection
+static void lz_sink(int *dst, long *off, const void *buf, size_t len,
+                    int *rc) {
+  if (*dst < 0)
+    return;
+  const char *p = (const char *)buf;
+  if (*off < 0) {
+    if (send_all(*dst, p, len) < 0) {
+      *dst = -1;
+      *rc = -2;
+    }
+    return;
+  }
+  while (len > 0) {
+    ssize_t w = pwrite(*dst, p, len, *off);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      *dst = -1;
+      *rc = -2;
+      return;
+    }
+    p += w;
+    len -= w;
+    *off += w;
+  }
+}
+
+// conn_recv_data() into ndst sinks at once (sockets, or one file at off)
+static int recv_blocks(struct conn *c, int *dst, int ndst, long off, long n) {
+  struct lz *z = (struct lz *)malloc(sizeof(*z));
+  if (!z)
+    return -1;
+  int rc = 0;
+  while (n > 0) {
+    size_t raw, wire;
+    if (c->packed) {
+      unsigned char hdr[8];
+      if (recv_all(c->fd, hdr, sizeof(hdr)) < 0)
+        goto broken;
+      raw = get_be32(hdr);
+      wire = get_be32(hdr + 4);
+      if (raw == 0 || raw > LZ_BLOCK || (long)raw > n || wire > raw)
+        goto broken;
+    } else {
+      raw = wire = n < LZ_BLOCK ? n : LZ_BLOCK;
+    }
+    if (wire == raw) {
+      if (recv_all(c->fd, z->in, raw) < 0)
+        goto broken;
+    } else if (recv_all(c->fd, z->out, wire) < 0 ||
+               lz_decompress(z->out, wire, z->in, raw) < 0) {
+      goto broken;
+    }
+    for (int i = 0; i < ndst; i++)
+      lz_sink(&dst[i], &off, z->in, raw, &rc);
+    n -= raw;
+  }
+  free(z);
+  return rc;
+broken:
+  free(z);
+  return -1;
+}
+
+int conn_recv_data(struct conn *c, int dst, long off, long n) {
+  if (!c->packed && dst >= 0 && off < 0)
+    return relay(c->fd, dst, n) < 0 ? -1 : 0;
+  return recv_blocks(c, &dst, 1, off, n);
+}
+
+int conn_recv_fanout(struct conn *c, int *dst, int ndst, long n) {
+  if (ndst == 1 && !c->packed) {
+    int rc = conn_recv_data(c, dst[0], -1, n);
+    // relay() cannot tell which side broke, so neither is trusted
+    if (rc < 0)
+      dst[0] = -1;
+    return rc;
+  }
+  return recv_blocks(c, dst, ndst, -1, n);
+}
+
+// ---------------------------------------------------------------------------
+// stream multiplexing
+//
+// One engine thread owns the connection and moves bytes between it and the
+// local ends of the streams' socketpairs. Everything it touches is
+// non-blocking, so neither a slow stream nor a slow peer holds up the rest:
+// - a stream is read only while it has credit and the output buffer has
+//   room for a full frame, and only one frame per round, so a small reply
+//   gets its turn between the frames of a big download
+// - data from the peer is buffered per stream (at most MUX_WINDOW, which is
+//   all the credit the peer gets) and the credit goes back in OP_WINDOW
+//   frames as the local reader drains the buffer
+
+#define MUX_OUT_CAP (4 * (FRAME_HDR_LEN + MUX_FRAME_MAX))
+// room kept free in the output buffer for OP_WINDOW and FRAME_END frames
+#define MUX_CTRL_RESERVE (2 * MUX_MAX_STREAMS * FRAME_HDR_LEN)
+
+struct mux_stream {
+  uint32_t id;
+  int fd;      // our end of the socketpair
+  int user;    // the end mux_open() handed out, -1 once mux_close()d
+  long credit; // bytes we may still send to the peer
+  char *in;    // data from the peer not yet written to fd
+  size_t inoff;
+  size_t inlen;
+  size_t grant;   // drained bytes not yet credited back to the peer
+  int local_done; // fd hit EOF and FRAME_END is queued
+  int peer_done;  // peer sent FRAME_END
+  int shut;       // fd is shut down for writing
+  struct mux_stream *next;
+};
+
+struct mux {
+  int sock;
+  int wake[2]; // mux_open() pokes the engine through this pipe
+  pthread_mutex_t lock;
+  pthread_cond_t slot; // broadcast when a stream goes away or out drains
+  struct mux_stream *streams;
+  int nstreams;
+  int dead;
+  uint32_t next_id;
+  void (*handler)(int fd); // accepting side only
+  // frame being read from the peer
+  unsigned char hdr[FRAME_HDR_LEN];
+  size_t hdrgot;
+  struct frame f;
+  uint64_t left;             // payload bytes of f still to come
+  struct mux_stream *target; // where they go, NULL to drop them
+  // frames waiting to go out to the peer
+  size_t outoff;
+  size_t outlen;
+  char out[MUX_OUT_CAP];
+};
+
+static struct mux *mux_new(int sock) {
+  struct mux *m = (struct mux *)calloc(1, sizeof(*m));
+  if (!m)
+    return NULL;
+  m->sock = sock;
+  m->wake[0] = m->wake[1] = -1;
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_cond_init(&m->slot, NULL);
+  set_nonblocking(sock, 1);
+  return m;
+}
+
+static struct mux_stream *mux_find(struct mux *m, uint32_t id) {
+  struct mux_stream *s = m->streams;
+  while (s && s->id != id)
+    s = s->next;
+  return s;
+}
+
+// set up a stream backed by a socketpair, *other gets the end for the code
+// that uses the stream
+static struct mux_stream *mux_add(struct mux *m, uint32_t id, int *other) {
+  int sp[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0)
+    return NULL;
+  struct mux_stream *s = (struct mux_stream *)calloc(1, sizeof(*s));
+  if (s)
+    s->in = (char *)malloc(MUX_WINDOW);
+  if (!s || !s->in) {
+    free(s);
+    close(sp[0]);
+    close(sp[1]);
+    return NULL;
+  }
+  set_nonblocking(sp[0], 1);
+  s->id = id;
+  s->fd = sp[0];
+  s->user = sp[1];
+  s->credit = MUX_WINDOW;
+  s->next = m->streams;
+  m->streams = s;
+  m->nstreams++;
+  *other = sp[1];
+  return s;
+}
+
+// pointer to n free bytes at the end of the output buffer
+static char *mux_reserve(struct mux *m, size_t n) {
+  if (m->outoff + m->outlen + n > MUX_OUT_CAP) {
+    memmove(m->out, m->out + m->outoff, m->outlen);
+    m->outoff = 0;
+  }
+  return m->out + m->outoff + m->outlen;
+}
+
+static void mux_queue(struct mux *m, int opcode, int flags, uint32_t id,
+                      uint64_t len) {
+  struct frame f = {PROTO_VERSION, (uint8_t)opcode, (uint16_t)flags, id, len};
+  frame_encode((unsigned char *)mux_reserve(m, FRAME_HDR_LEN), &f);
+  m->outlen += FRAME_HDR_LEN;
+}
+
+static int mux_flush(struct mux *m) {
+  while (m->outlen > 0) {
+    ssize_t n = send(m->sock, m->out + m->outoff, m->outlen, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    m->outoff += n;
+    m->outlen -= n;
+  }
+  m->outoff = 0;
+  return 0;
+}
+
+static int mux_can_pull(struct mux *m, struct mux_stream *s) {
+  return !s->local_done && s->credit > 0 &&
+         MUX_OUT_CAP - m->outlen >=
+             FRAME_HDR_LEN + MUX_FRAME_MAX + MUX_CTRL_RESERVE;
+}
+
+// move one frame worth of data from a stream to the output buffer
+static void mux_pull(struct mux *m, struct mux_stream *s) {
+  size_t n = MUX_FRAME_MAX;
+  if ((long)n > s->credit)
+    n = s->credit;
+  char *p = mux_reserve(m, FRAME_HDR_LEN + n);
+  ssize_t r = recv(s->fd, p + FRAME_HDR_LEN, n, 0);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  struct frame f = {PROTO_VERSION, OP_STREAM, 0, s->id, 0};
+  if (r > 0) {
+    f.len = r;
+    s->credit -= r;
+  } else {
+    // the local side is done writing (or gone)
+    f.flags = FRAME_END;
+    s->local_done = 1;
+  }
+  frame_encode((unsigned char *)p, &f);
+  m->outlen += FRAME_HDR_LEN + f.len;
+}
+
+// write buffered peer data to a stream and hand the credit back
+static void mux_push(struct mux *m, struct mux_stream *s) {
+  while (s->inlen > 0) {
+    ssize_t n = send(s->fd, s->in + s->inoff, s->inlen, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      // the local reader is gone, drop what it will never read
+      n = s->inlen;
+    }
+    s->inoff += n;
+    s->inlen -= n;
+    s->grant += n;
+  }
+  if (s->inlen == 0)
+    s->inoff = 0;
+  if (s->peer_done) {
+    if (s->inlen == 0 && !s->shut) {
+      shutdown(s->fd, SHUT_WR);
+      s->shut = 1;
+    }
+  } else if (s->grant > 0 && (s->grant >= MUX_WINDOW / 4 || s->inlen == 0) &&
+             MUX_OUT_CAP - m->outlen >= FRAME_HDR_LEN) {
+    mux_queue(m, OP_WINDOW, 0, s->id, s->grant);
+    s->grant = 0;
+  }
+}
+
+struct mux_job {
+  void (*handler)(int fd);
+  int fd;
+};
+
+static void *mux_job_thread(void *arg) {
+  struct mux_job job = *(struct mux_job *)arg;
+  free(arg);
+  job.handler(job.fd);
+  return NULL;
+}
+
+// the peer opened a new stream: hand our other end to the handler
+static struct mux_stream *mux_accept(struct mux *m, uint32_t id) {
+  if (m->nstreams >= MUX_MAX_STREAMS)
+    return NULL;
+  struct mux_job *job = (struct mux_job *)malloc(sizeof(*job));
+  if (!job)
+    return NULL;
+  struct mux_stream *s = mux_add(m, id, &job->fd);
+  if (!s) {
+    free(job);
+    return NULL;
   }
+  job->handler = m->handler;
+  pthread_t t;
+  if (pthread_create(&t, NULL, mux_job_thread, job) != 0) {
+    // the stream just sees EOF
+    close(job->fd);
+    free(job);
+    return s;
+  }
+  pthread_detach(t);
+  return s;
+}
+
+// a frame header from the peer is complete
+static int mux_frame_start(struct mux *m) {
+  struct frame *f = &m->f;
+  m->left = 0;
+  m->target = NULL;
+  struct mux_stream *s = mux_find(m, f->reqid);
+  if (f->opcode == OP_WINDOW) {
+    if (s)
+      s->credit += f->len;
+    return 0;
+  }
+  if (f->opcode != OP_STREAM || f->len > MUX_FRAME_MAX)
+    return -1;
+  if (!s && m->handler) {
+    s = mux_accept(m, f->reqid);
+    if (!s)
+      return -1;
+  }
+  if (s) {
+    // data past FRAME_END or beyond the window the peer was given
+    if (s->peer_done || s->inlen + f->len > MUX_WINDOW)
+      return -1;
+    m->target = s;
+  }
+  m->left = f->len;
+  return 0;
+}
+
+static void mux_frame_end(struct mux *m) {
+  if (m->target && (m->f.flags & FRAME_END))
+    m->target->peer_done = 1;
+  m->target = NULL;
+  m->hdrgot = 0;
+}
+
+// feed bytes read from the peer through the frame parser
+static int mux_input(struct mux *m, const char *p, size_t n) {
+  while (n > 0) {
+    if (m->hdrgot < FRAME_HDR_LEN) {
+      size_t k = FRAME_HDR_LEN - m->hdrgot;
+      if (k > n)
+        k = n;
+      memcpy(m->hdr + m->hdrgot, p, k);
+      m->hdrgot += k;
+      p += k;
+      n -= k;
+      if (m->hdrgot < FRAME_HDR_LEN)
+        break;
+      if (frame_decode(m->hdr, &m->f) < 0 || mux_frame_start(m) < 0)
+        return -1;
+      if (m->left == 0)
+        mux_frame_end(m);
+      continue;
+    }
+    size_t k = n < m->left ? n : m->left;
+    struct mux_stream *s = m->target;
+    if (s) {
+      if (s->inoff + s->inlen + k > MUX_WINDOW) {
+        memmove(s->in, s->in + s->inoff, s->inlen);
+        s->inoff = 0;
+      }
+      memcpy(s->in + s->inoff + s->inlen, p, k);
+      s->inlen += k;
+    }
+    p += k;
+    n -= k;
+    m->left -= k;
+    if (m->left == 0)
+      mux_frame_end(m);
+  }
+  return 0;
+}
+
+static void mux_loop(struct mux *m) {
+  char *rbuf = (char *)malloc(FRAME_HDR_LEN + MUX_FRAME_MAX);
+  struct pollfd pfds[MUX_MAX_STREAMS + 2];
+  struct mux_stream *map[MUX_MAX_STREAMS + 2];
+  pthread_mutex_lock(&m->lock);
+  while (rbuf) {
+    // drop streams that are finished in both directions
+    for (struct mux_stream **pp = &m->streams; *pp;) {
+      struct mux_stream *s = *pp;
+      if (s->local_done && s->peer_done && s->inlen == 0) {
+        *pp = s->next;
+        close(s->fd);
+        free(s->in);
+        free(s);
+        m->nstreams--;
+        pthread_cond_broadcast(&m->slot);
+        continue;
+      }
+      pp = &s->next;
+    }
+
+    int n = 0;
+    pfds[n].fd = m->sock;
+    pfds[n].events = POLLIN | (m->outlen ? POLLOUT : 0);
+    map[n++] = NULL;
+    pfds[n].fd = m->wake[0];
+    pfds[n].events = POLLIN;
+    map[n++] = NULL;
+    for (struct mux_stream *s = m->streams; s; s = s->next) {
+      short ev = 0;
+      if (mux_can_pull(m, s))
+        ev |= POLLIN;
+      if (s->inlen > 0)
+        ev |= POLLOUT;
+      // a closed stream reports POLLHUP all the time, only watch it when
+      // there is something to do
+      pfds[n].fd = ev ? s->fd : -1;
+      pfds[n].events = ev;
+      map[n++] = s;
+    }
+    pthread_mutex_unlock(&m->lock);
+    // a served connection without streams goes after idle_timeout, one
+    // whose peer takes nothing for io_timeout is given up
+    int wait = -1;
+    if (m->handler && m->nstreams == 0 && idle_timeout > 0)
+      wait = idle_timeout * 1000;
+    else if (m->outlen && io_timeout > 0)
+      wait = io_timeout * 1000;
+    int rc = poll(pfds, n, wait);
+    pthread_mutex_lock(&m->lock);
+    if (rc == 0)
+      break;
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (pfds[1].revents) {
+      char tmp[64];
+      while (read(m->wake[0], tmp, sizeof(tmp)) > 0)
+        ;
+    }
+    if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t r = recv(m->sock, rbuf, FRAME_HDR_LEN + MUX_FRAME_MAX, 0);
+      if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                     errno != EINTR))
+        break;
+      if (r > 0 && mux_input(m, rbuf, r) < 0)
+        break;
+    }
+    // streams with fresh data from the peer are written right away, the
+    // rest get one frame each if they have data for the peer
+    for (int i = 2; i < n; i++) {
+      struct mux_stream *s = map[i];
+      if (s->inlen > 0 || (s->peer_done && !s->shut))
+        mux_push(m, s);
+      if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+          mux_can_pull(m, s))
+        mux_pull(m, s);
+    }
+    if (mux_flush(m) < 0)
+      break;
+    if (m->nstreams == 0 && m->outlen == 0)
+      pthread_cond_broadcast(&m->slot);
+  }
+
+  // connection gone: every stream sees EOF, handlers finish on their own
+  m->dead = 1;
+  while (m->streams) {
+    struct mux_stream *s = m->streams;
+    m->streams = s->next;
+    close(s->fd);
+    free(s->in);
+    free(s);
+  }
+  m->nstreams = 0;
+  pthread_cond_broadcast(&m->slot);
+  pthread_mutex_unlock(&m->lock);
+  free(rbuf);
+}
+
+int mux_serve(int sock, void (*handler)(int fd)) {
+  // handlers write to streams the engine may already have closed
+  signal(SIGPIPE, SIG_IGN);
+  struct mux *m = mux_new(sock);
+  if (!m)
+    return -1;
+  m->handler = handler;
+  mux_loop(m);
+  free(m);
+  return 0;
+}
+
+static void *mux_client_thread(void *arg) {
+  mux_loop((struct mux *)arg);
+  return NULL;
+}
+
+struct mux *mux_client(int sock) {
+  signal(SIGPIPE, SIG_IGN);
+  struct mux *m = mux_new(sock);
+  if (!m)
+    return NULL;
+  pthread_t t;
+  if (pipe(m->wake) < 0) {
+    free(m);
+    return NULL;
+  }
+  set_nonblocking(m->wake[0], 1);
+  if (pthread_create(&t, NULL, mux_client_thread, m) != 0) {
+    close(m->wake[0]);
+    close(m->wake[1]);
+    free(m);
+    return NULL;
+  }
+  pthread_detach(t);
+  return m;
+}
+
+int mux_open(struct mux *m) {
+  int fd = -1;
+  pthread_mutex_lock(&m->lock);
+  while (!m->dead && m->nstreams >= MUX_MAX_STREAMS)
+    pthread_cond_wait(&m->slot, &m->lock);
+  if (!m->dead && !mux_add(m, ++m->next_id, &fd))
+    fd = -1;
+  pthread_mutex_unlock(&m->lock);
+  if (fd >= 0) {
+    char c = 0;
+    if (write(m->wake[1], &c, 1) < 0)
+      perror("mux wake");
+  }
+  return fd;
+}
+
+void mux_close(struct mux *m, int fd) {
+  uint32_t id = 0;
+  pthread_mutex_lock(&m->lock);
+  // look the stream up before closing, another mux_open() may get the
+  // same descriptor number right after
+  for (struct mux_stream *s = m->streams; s; s = s->next) {
+    if (s->user == fd) {
+      id = s->id;
+      s->user = -1;
+      break;
+    }
+  }
+  close(fd);
+  while (id && !m->dead && mux_find(m, id))
+    pthread_cond_wait(&m->slot, &m->lock);
+  pthread_mutex_unlock(&m->lock);
+}
+
+void mux_drain(struct mux *m) {
+  pthread_mutex_lock(&m->lock);
+  while (!m->dead && (m->nstreams > 0 || m->outlen > 0))
+    pthread_cond_wait(&m->slot, &m->lock);
+  pthread_mutex_unlock(&m->lock);
+}
+
+// ---------------------------------------------------------------------------
+// work-stealing worker pool used by the storage servers (--pool)
+//
+// Every worker owns a deque of connections that have a command waiting. The
+// owner pops from the tail (the connection it just served is still hot in
+// its cache), idle workers steal from the head of somebody else's deque.
+// The calling thread becomes the "parker": it accepts new connections and
+// watches connections between commands with epoll, and hands every one that
+// turns readable to the next worker round robin. A worker serves exactly one
+// command per turn, so a long-lived connection from S1 does not tie a
+// worker up while it sits idle. One that stays parked for idle_timeout is
+// shut down, which wakes it up and has the worker close it.
+
+struct ws_deque {
+  pthread_mutex_t lock;
+  int *items;
+  long cap;
+  long head; // next item a thief takes
+  long tail; // one past the item the owner takes
+};
+
+struct ws_worker {
+  struct ws_deque dq;
+  int id;
+};
+
+static struct {
+  struct ws_worker *workers;
+  int nworkers;
+  int pin;
+  int epfd;
+  conn_handler handler;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  long pending; // connections sitting in any deque
+  time_t *parked; // by fd: when it was parked, 0 while it is not
+  long maxfd;
+  long top; // one past the highest fd accepted so far
+} pool;
+
+// a connection went into (n = 1) or left (n = -1) a deque. Called with the
+// deque locked, so pending always matches what the deques hold
+static void pool_pending(int n) {
+  pthread_mutex_lock(&pool.idle_lock);
+  pool.pending += n;
+  if (n > 0)
+    pthread_cond_signal(&pool.idle_cond);
+  pthread_mutex_unlock(&pool.idle_lock);
+}
+
+static void dq_push(struct ws_deque *dq, int fd) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail - dq->head == dq->cap) {
+    long ncap = dq->cap ? dq->cap * 2 : 64;
+    int *n = (int *)malloc(ncap * sizeof(int));
+    for (long i = dq->head; i < dq->tail; i++)
+      n[i - dq->head] = dq->items[i % dq->cap];
+    free(dq->items);
+    dq->items = n;
+    dq->tail -= dq->head;
+    dq->head = 0;
+    dq->cap = ncap;
+  }
+  dq->items[dq->tail % dq->cap] = fd;
+  dq->tail++;
+  pool_pending(1);
+  pthread_mutex_unlock(&dq->lock);
+}
+
+// owner side, LIFO
+static int dq_pop(struct ws_deque *dq) {
+  int fd = -1;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail > dq->head) {
+    dq->tail--;
+    fd = dq->items[dq->tail % dq->cap];
+    pool_pending(-1);
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return fd;
+}
+
+// thief side, FIFO. Only waits for the deque's lock if told to
+static int dq_steal(struct ws_deque *dq, int wait) {
+  int fd = -1;
+  if (wait)
+    pthread_mutex_lock(&dq->lock);
+  else if (pthread_mutex_trylock(&dq->lock) != 0)
+    return -1;
+  if (dq->tail > dq->head) {
+    fd = dq->items[dq->head % dq->cap];
+    dq->head++;
+    pool_pending(-1);
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return fd;
+}
+
+static void pool_enqueue(int worker, int fd) {
+  dq_push(&pool.workers[worker].dq, fd);
+}
+
+// own deque first, then steal. The first round skips deques that are
+// busy; the second one (wait) waits for their locks, so a worker that
+// still sees pending connections after it got nothing either finds one
+// or some other worker just took it
+static int pool_take(struct ws_worker *w, int wait) {
+  int fd = dq_pop(&w->dq);
+  for (int i = 1; fd < 0 && i < pool.nworkers; i++)
+    fd = dq_steal(&pool.workers[(w->id + i) % pool.nworkers].dq, wait);
+  return fd;
+}
+
+// hand a connection back to the parker until its next command shows up
+static void pool_park(int fd) {
+  if (fd < pool.maxfd)
+    __atomic_store_n(&pool.parked[fd], time(NULL), __ATOMIC_RELAXED);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.fd = fd;
+  if (epoll_ctl(pool.epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT)
+    epoll_ctl(pool.epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void *pool_worker(void *arg) {
+  struct ws_worker *w = (struct ws_worker *)arg;
+
+  if (pool.pin) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->id % (ncpu > 0 ? ncpu : 1), &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      fprintf(stderr, "worker %d: could not pin to a core\n", w->id);
+  }
+
+  while (1) {
+    int fd = pool_take(w, 0);
+    if (fd < 0)
+      fd = pool_take(w, 1);
+    if (fd < 0) {
+      pthread_mutex_lock(&pool.idle_lock);
+      while (pool.pending == 0)
+        pthread_cond_wait(&pool.idle_cond, &pool.idle_lock);
+      pthread_mutex_unlock(&pool.idle_lock);
+      continue;
+    }
+
+    if (pool.handler(fd) < 0) {
+      close(fd);
+      continue;
+    }
+
+    // if the next command is already here keep it on this worker,
+    // otherwise park the connection
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) > 0)
+      pool_enqueue(w->id, fd);
+    else
+      pool_park(fd);
+  }
+  return NULL;
+}
+
+void run_worker_pool(int listenfd, int nworkers, int pin,
+                     conn_handler handler) {
+  // workers share the process, a peer hanging up must not kill it
+  signal(SIGPIPE, SIG_IGN);
+
+  if (nworkers < 1) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = ncpu > 0 ? (int)ncpu : 1;
+  }
+  pool.nworkers = nworkers;
+  pool.pin = pin;
+  pool.handler = handler;
+  pthread_mutex_init(&pool.idle_lock, NULL);
+  pthread_cond_init(&pool.idle_cond, NULL);
+  pool.workers = (struct ws_worker *)calloc(nworkers, sizeof(struct ws_worker));
+
+  pool.maxfd = sysconf(_SC_OPEN_MAX);
+  pool.parked = (time_t *)calloc(pool.maxfd, sizeof(time_t));
+  pool.epfd = epoll_create1(0);
+  if (pool.epfd < 0 || !pool.parked) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listenfd;
+  epoll_ctl(pool.epfd, EPOLL_CTL_ADD, listenfd, &ev);
+
+  for (int i = 0; i < nworkers; i++) {
+    pool.workers[i].id = i;
+    pthread_mutex_init(&pool.workers[i].dq.lock, NULL);
+    pthread_t t;
+    if (pthread_create(&t, NULL, pool_worker, &pool.workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+    pthread_detach(t);
+  }
+
+  int next = 0;
+  struct epoll_event evs[64];
+  time_t swept = time(NULL);
+  while (1) {
+    int n = epoll_wait(pool.epfd, evs, 64, 1000);
+    if (n < 0) {
+      if (errno != EINTR)
+        perror("epoll_wait");
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      int fd = evs[i].data.fd;
+      if (fd == listenfd) {
+        fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+          perror("accept");
+          continue;
+        }
+        sock_deadlines(fd);
+        if (fd >= pool.top)
+          pool.top = fd + 1;
+      }
+      if (fd < pool.maxfd)
+        __atomic_store_n(&pool.parked[fd], 0, __ATOMIC_RELAXED);
+      pool_enqueue(next, fd);
+      next = (next + 1) % nworkers;
+    }
+    // only the parker hands out parked connections, so none of them can
+    // be closed under the sweep
+    time_t now = time(NULL);
+    if (idle_timeout <= 0 || now == swept)
+      continue;
+    swept = now;
+    for (long fd = 0; fd < pool.top && fd < pool.maxfd; fd++) {
+      time_t t = __atomic_load_n(&pool.parked[fd], __ATOMIC_RELAXED);
+      if (t && now - t > idle_timeout) {
+        pool.parked[fd] = 0;
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// io_uring transfer backend for the storage servers
+//
+// The stdio loops in cmd_STORE/cmd_GET cost one recv + one write (or one
+// read + one send) syscall per 4 KB CHUNK. Here every thread gets its own
+// ring with URING_NBUF buffers of URING_BUFSZ bytes. A batch is
+// one linked chain recv0 -> write0 -> recv1 -> write1 ... (or read -> send
+// for GET) submitted with a single io_uring_enter, i.e. one syscall per
+// URING_NBUF * URING_BUFSZ bytes. No liburing, just the raw syscalls.
+// Every socket op has a link timeout behind it (see uring_deadline()),
+// io_uring does not go by SO_RCVTIMEO/SO_SNDTIMEO.
+
+#define URING_NBUF 8
+#define URING_BUFSZ (64 * 1024)
+
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  char *bufs;
+};
+
+int uring_enabled = 0;
+static __thread struct uring *tls_ring;
+
+static struct uring *uring_setup(void) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = (int)syscall(__NR_io_uring_setup, URING_NBUF * 3, &p);
+  if (fd < 0)
+    return NULL;
+
+  struct uring *r = (struct uring *)calloc(1, sizeof(*r));
+  r->fd = fd;
+  size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_sz > sq_sz)
+      sq_sz = cq_sz;
+    cq_sz = sq_sz;
+  }
+  char *sq = (char *)mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  char *cq = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = (char *)mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+      goto fail;
+  }
+  r->sqes = (struct io_uring_sqe *)mmap(
+      NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail;
+
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->sq_entries = p.sq_entries;
+
+  // the buffers are not registered: registered buffers are pinned and
+  // count against RLIMIT_MEMLOCK, which a few dozen forked connections
+  // used up
+  if (posix_memalign((void **)&r->bufs, 4096, URING_NBUF * URING_BUFSZ) != 0)
+    goto fail;
+  return r;
+
+fail:
+  // only reached once per thread at most, not worth unmapping the rings
+  close(fd);
+  free(r->bufs);
+  free(r);
+  return NULL;
+}
+
+// probe once at startup. Creates and tears down a ring, so forked children
+// and pool threads all build their own lazily afterwards
+int uring_probe(void) {
+  struct uring *r = uring_setup();
+  if (!r)
+    return 0;
+  close(r->fd);
+  free(r->bufs);
+  free(r);
+  return 1;
+}
+
+static __thread int tls_ring_failed;
+
+static struct uring *uring_get(void) {
+  if (!tls_ring && !tls_ring_failed) {
+    tls_ring = uring_setup();
+    tls_ring_failed = !tls_ring;
+  }
+  return tls_ring;
+}
+
+int uring_ready(void) {
+  return uring_enabled && uring_get() != NULL;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+  unsigned tail = *r->sq_tail;
+  unsigned idx = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+// fail the socket op queued last unless it completes within io_timeout
+// seconds, plus the time chunk bytes take at io_min_rate: a link timeout
+// chained right behind it, its completion goes to res[2 * URING_NBUF + i].
+// Returns how many entries it queued
+static int uring_deadline(struct uring *r, struct __kernel_timespec *ts,
+                          unsigned chunk, int i) {
+  if (io_timeout <= 0)
+    return 0;
+  ts->tv_sec = io_timeout + (io_min_rate > 0 ? chunk / io_min_rate : 0);
+  ts->tv_nsec = 0;
+  struct io_uring_sqe *sqe = uring_sqe(r);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (unsigned long)ts;
+  sqe->len = 1;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = 2 * URING_NBUF + i;
+  return 1;
+}
+
+// bytes the socket ops of a batch of n pieces moved, the recv (sock = 0)
+// or send (sock = 1) of piece i completes as res[2 * i + sock]
+static long uring_moved(const int *res, int n, int sock) {
+  long moved = 0;
+  for (int i = 0; i < n; i++)
+    if (res[2 * i + sock] > 0)
+      moved += res[2 * i + sock];
+  return moved;
+}
+
+// submit everything queued and collect exactly n completions, res[] is
+// indexed by user_data
+static int uring_run(struct uring *r, int n, int *res) {
+  int submitted = 0, done = 0;
+  while (done < n) {
+    int ret = (int)syscall(__NR_io_uring_enter, r->fd, n - submitted,
+                           n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    submitted += ret;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      res[cqe->user_data] = cqe->res;
+      head++;
+      done++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+// receive len bytes from sock and write them to fd starting at offset 0
+int uring_recv_to_file(int sock, int fd, long start, long len, uint32_t *crc) {
+  struct uring *r = uring_get();
+  if (!r)
+    return -1;
+  len += start;
+  long off = start;
+  int res[URING_NBUF * 3];
+  struct __kernel_timespec ts[URING_NBUF];
+  while (off < len) {
+    int n = 0, queued = 0;
+    for (; n < URING_NBUF && off + (long)n * URING_BUFSZ < len; n++) {
+      long pos = off + (long)n * URING_BUFSZ;
+      unsigned chunk = (len - pos > URING_BUFSZ) ? URING_BUFSZ : len - pos;
+      struct io_uring_sqe *sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = sock;
+      sqe->addr = (unsigned long)(r->bufs + n * URING_BUFSZ);
+      sqe->len = chunk;
+      sqe->msg_flags = MSG_WAITALL;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = 2 * n;
+      queued += 2 + uring_deadline(r, &ts[n], chunk, n);
+
+      sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->fd = fd;
+      sqe->addr = (unsigned long)(r->bufs + n * URING_BUFSZ);
+      sqe->len = chunk;
+      sqe->off = pos;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = 2 * n + 1;
+    }
+    // the last entry must not link into the next batch
+    r->sqes[(*r->sq_tail - 1) & *r->sq_mask].flags = 0;
+    double t0 = io_now();
+    if (uring_run(r, queued, res) < 0 ||
+        io_account(t0, uring_moved(res, n, 0)) < 0)
+      return -1;
+
+    for (int i = 0; i < n; i++) {
+      char *buf = r->bufs + i * URING_BUFSZ;
+      unsigned chunk = (len - off > URING_BUFSZ) ? URING_BUFSZ : len - off;
+      if (res[2 * i] == (int)chunk && res[2 * i + 1] == (int)chunk) {
+        if (crc)
+          *crc = crc32c(*crc, buf, chunk);
+        off += chunk;
+        continue;
+      }
+      // a short recv or write breaks the chain and cancels everything
+      // behind it. Finish this piece synchronously and resubmit the rest
+      if (res[2 * i] <= 0)
+        return -1;
+      if (recv_all(sock, buf + res[2 * i], chunk - res[2 * i]) < 0)
+        return -1;
+      if (pwrite(fd, buf, chunk, off) != (ssize_t)chunk)
+        return -1;
+      if (crc)
+        *crc = crc32c(*crc, buf, chunk);
+      off += chunk;
+      break;
+    }
+  }
+  return 0;
+}
+
+// send len bytes of fd starting at offset start to sock
+int uring_file_to_sock(int fd, int sock, long start, long len) {
+  struct uring *r = uring_get();
+  if (!r)
+    return -1;
+  len += start;
+  long off = start;
+  int res[URING_NBUF * 3];
+  struct __kernel_timespec ts[URING_NBUF];
+  while (off < len) {
+    int n = 0, queued = 0;
+    for (; n < URING_NBUF && off + (long)n * URING_BUFSZ < len; n++) {
+      long pos = off + (long)n * URING_BUFSZ;
+      unsigned chunk = (len - pos > URING_BUFSZ) ? URING_BUFSZ : len - pos;
+      struct io_uring_sqe *sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fd;
+      sqe->addr = (unsigned long)(r->bufs + n * URING_BUFSZ);
+      sqe->len = chunk;
+      sqe->off = pos;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = 2 * n;
+
+      sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = sock;
+      sqe->addr = (unsigned long)(r->bufs + n * URING_BUFSZ);
+      sqe->len = chunk;
+      sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = 2 * n + 1;
+      queued += 2 + uring_deadline(r, &ts[n], chunk, n);
+    }
+    r->sqes[(*r->sq_tail - 1) & *r->sq_mask].flags = 0;
+    double t0 = io_now();
+    if (uring_run(r, queued, res) < 0 ||
+        io_account(t0, uring_moved(res, n, 1)) < 0)
+      return -1;
+
+    for (int i = 0; i < n; i++) {
+      char *buf = r->bufs + i * URING_BUFSZ;
+      unsigned chunk = (len - off > URING_BUFSZ) ? URING_BUFSZ : len - off;
+      if (res[2 * i] == (int)chunk && res[2 * i + 1] == (int)chunk) {
+        off += chunk;
+        continue;
+      }
+      // a short read means the file shrank under us, nothing sensible to
+      // send. A short send gets finished by hand
+      if (res[2 * i] != (int)chunk || res[2 * i + 1] < 0)
+        return -1;
+      if (send_all(sock, buf + res[2 * i + 1], chunk - res[2 * i + 1]) < 0)
+        return -1;
+      off += chunk;
+      break;
+    }
+  }
+  return 0;
+}
+
+// send len bytes of fd starting at offset to sock without copying them
+// through user space. sendfile(2) may send less than asked, so it loops.
+// If the file/socket combination does not support sendfile at all we fall
+// back to io_uring (when enabled) or a plain pread/send loop.
+// Returns 0 on success, -1 on error
+int send_file(int sock, int fd, long offset, long len) {
+  off_t off = offset;
+  long remain = len;
+  while (remain > 0) {
+    // sendfile moves at most ~2 GB per call
+    size_t want = (remain > (1L << 30)) ? (1L << 30) : (size_t)remain;
+    double t0 = io_now();
+    ssize_t n = sendfile(sock, fd, &off, want);
+    if (io_account(t0, n) < 0)
+      return -1;
+    if (n > 0) {
+      remain -= n;
+      continue;
+    }
+    if (n == 0) {
+      // file is shorter than promised
+      return -1;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // a peer that takes nothing for io_timeout is given up on
+      struct pollfd pfd = {sock, POLLOUT, 0};
+      if (poll(&pfd, 1, io_timeout > 0 ? io_timeout * 1000 : -1) == 0) {
+        errno = ETIMEDOUT;
+        perror("sendfile");
+        return -1;
+      }
+      continue;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+      perror("sendfile");
+      return -1;
+    }
+    break;
+  }
+  if (remain == 0)
+    return 0;
+
+  // sendfile not supported here, copy the rest by hand
+  if (uring_ready())
+    return uring_file_to_sock(fd, sock, off, remain);
+  char buf[CHUNK_SIZE];
+  while (remain > 0) {
+    size_t want = (remain > CHUNK_SIZE) ? CHUNK_SIZE : (size_t)remain;
+    ssize_t n = pread(fd, buf, want, off);
+    if (n <= 0)
+      return -1;
+    if (send_all(sock, buf, n) < 0)
+      return -1;
+    off += n;
+    remain -= n;
+  }
+  return 0;
+}
+
+int recv_file(int sock, int fd, long offset, long len) {
+  if (uring_ready())
+    return uring_recv_to_file(sock, fd, offset, len, NULL);
+  char buf[RECV_FILE_BUF];
+  while (len > 0) {
+    size_t want = (len > RECV_FILE_BUF) ? RECV_FILE_BUF : (size_t)len;
+    if (recv_all(sock, buf, want) < 0 ||
+        pwrite(fd, buf, want, offset) != (ssize_t)want)
+      return -1;
+    offset += want;
+    len -= want;
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// socket -> socket relay for S1's proxy paths
+//
+// splice(2) moves the bytes socket -> pipe -> socket inside the kernel. Each
+// thread keeps one pipe around for that. Where splice is not supported we
+// fall back to recv + send(MSG_ZEROCOPY), and to a plain copy if the
+// socket does not do zerocopy either.
+
+#define RELAY_BUF_SIZE (256 * 1024)
+
+static __thread int relay_pipe[2] = {-1, -1};
+
+static void relay_pipe_reset(void) {
+  if (relay_pipe[0] >= 0) {
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+  }
+  relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+// returns bytes moved, or -1 with errno set. A pipe that may hold leftover
+// data after an error is thrown away
+static long relay_splice(int from, int to, long len) {
+  if (relay_pipe[0] < 0) {
+    if (pipe2(relay_pipe, O_CLOEXEC) < 0)
+      return -1;
+    fcntl(relay_pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+  }
+  long moved = 0;
+  while (moved < len) {
+    size_t want = (len - moved > RELAY_PIPE_SIZE) ? RELAY_PIPE_SIZE
+                                                  : (size_t)(len - moved);
+    double t0 = io_now();
+    ssize_t in = splice(from, NULL, relay_pipe[1], NULL, want,
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (io_account(t0, in) < 0)
+      in = -1;
+    else if (in < 0 && errno == EINTR)
+      continue;
+    if (in <= 0) {
+      if (in == 0)
+        errno = ECONNRESET;
+      return moved > 0 ? -2 : -1;
+    }
+    // no SPLICE_F_MORE on the last piece, or its tail waits for the timer
+    long left = in;
+    unsigned int more = moved + in < len ? SPLICE_F_MORE : 0;
+    while (left > 0) {
+      t0 = io_now();
+      ssize_t out = splice(relay_pipe[0], NULL, to, NULL, left,
+                           SPLICE_F_MOVE | more);
+      if (io_account(t0, out) < 0)
+        out = -1;
+      else if (out < 0 && errno == EINTR)
+        continue;
+      if (out <= 0) {
+        relay_pipe_reset();
+        return -2;
+      }
+      left -= out;
+    }
+    moved += in;
+  }
+  return moved;
+}
+
+// wait until the kernel no longer needs the buffer of our last zerocopy
+// send. Only one send is outstanding, so any notification is ours
+static int zerocopy_wait(int sock) {
+  while (1) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE) < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
+      // POLLERR is always reported, no need to ask for it. The kernel
+      // lets go of the buffer once the peer acked the data, which a peer
+      // that stalled never does
+      struct pollfd pfd = {sock, 0, 0};
+      if (poll(&pfd, 1, io_timeout > 0 ? io_timeout * 1000 : -1) == 0)
+        return -1;
+      continue;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+        return 0;
+    }
+  }
+}
+
+static int relay_copy(int from, int to, long len) {
+  int one = 1;
+  int zerocopy =
+      setsockopt(to, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+  char *buf = (char *)malloc(RELAY_BUF_SIZE);
+  if (!buf)
+    return -1;
+  int rc = 0;
+  while (len > 0) {
+    long chunk = (len > RELAY_BUF_SIZE) ? RELAY_BUF_SIZE : len;
+    double t0 = io_now();
+    ssize_t got = recv(from, buf, chunk, 0);
+    if (io_account(t0, got) < 0)
+      got = -1;
+    else if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      rc = -1;
+      break;
+    }
+    if (zerocopy) {
+      ssize_t sent = 0;
+      while (sent < got) {
+        t0 = io_now();
+        ssize_t n = send(to, buf + sent, got - sent, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (io_account(t0, n) < 0)
+          n = -1;
+        else if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0 && errno == ENOBUFS) {
+          // out of optmem for pinned pages, this chunk goes the slow way
+          if (send_all(to, buf + sent, got - sent) < 0)
+            rc = -1;
+          break;
+        }
+        if (n <= 0 || zerocopy_wait(to) < 0) {
+          rc = -1;
+          break;
+        }
+        sent += n;
+      }
+      if (rc < 0)
+        break;
+    } else if (send_all(to, buf, got) < 0) {
+      rc = -1;
+      break;
+    }
+    len -= got;
+  }
+  free(buf);
+  return rc;
+}
+
+// forward exactly len bytes from socket from to socket to.
+// Returns 0 on success, -1 on error
+int relay(int from, int to, long len) {
+  if (len <= 0)
+    return 0;
+  long moved = relay_splice(from, to, len);
+  if (moved == len)
+    return 0;
+  if (moved == -1 && (errno == EINVAL || errno == ENOSYS))
+    return relay_copy(from, to, len);
+  return -1;
+}
+
+// ---------------------------------------------------------------------------
+// streaming tar writer
+//
+// Walks a directory and writes a ustar archive of it straight to a socket,
+// no temp file and no "tar" child process. Because the total size is not
+// known up front the archive goes out in chunks: a 4 byte length in
+// network order followed by that many bytes, and a zero length chunk at
+// the end. Headers are collected in a small buffer and sent as one chunk,
+// file bodies go out as their own chunk with sendfile. Names longer than
+// ustar allows and files over 8 GB get a pax extended header.
+// The same writer also produces plain (unchunked) archives in a regular
+// file for the tar cache.
+
+#define TAR_BLOCK 512
+#define USTAR_MAX_SIZE 077777777777L
+
+struct tar_stream {
+  int sock;    // socket, or a regular file when !chunked
+  int chunked; // frame everything as length-prefixed chunks
+  size_t used;
+  char buf[CHUNK_SIZE];
+};
+
+// raw output, send() only works on sockets
+static int tar_out(struct tar_stream *t, const void *buf, size_t len) {
+  if (t->chunked)
+    return send_all(t->sock, buf, len);
+  const char *p = (const char *)buf;
+  while (len > 0) {
+    double t0 = io_now();
+    ssize_t n = write(t->sock, p, len);
+    if (io_account(t0, n) < 0)
+      return -1;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int tar_chunk_start(struct tar_stream *t, size_t len) {
+  if (!t->chunked)
+    return 0;
+  uint32_t n = htonl((uint32_t)len);
+  return send_all(t->sock, &n, 4);
+}
+
+static int tar_flush(struct tar_stream *t) {
+  if (t->used == 0)
+    return 0;
+  if (tar_chunk_start(t, t->used) < 0 || tar_out(t, t->buf, t->used) < 0)
+    return -1;
+  t->used = 0;
+  return 0;
+}
+
+static int tar_put(struct tar_stream *t, const void *data, size_t len) {
+  const char *p = (const char *)data;
+  while (len > 0) {
+    if (t->used == sizeof(t->buf) && tar_flush(t) < 0)
+      return -1;
+    size_t n = sizeof(t->buf) - t->used;
+    if (n > len)
+      n = len;
+    memcpy(t->buf + t->used, p, n);
+    t->used += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int tar_pad(struct tar_stream *t, long len) {
+  static const char zeros[TAR_BLOCK];
+  long rem = len % TAR_BLOCK;
+  return rem ? tar_put(t, zeros, TAR_BLOCK - rem) : 0;
+}
+
+static void tar_octal(char *field, size_t width, unsigned long val) {
+  snprintf(field, width, "%0*lo", (int)width - 1, val);
+}
+
+static int tar_header(struct tar_stream *t, const char *name, char type,
+                      long size, const struct stat *st) {
+  char h[TAR_BLOCK];
+  memset(h, 0, sizeof(h));
+  size_t nlen = strlen(name);
+
+  // ustar splits long names into prefix + '/' + name (155 + 100 bytes)
+  const char *base = name;
+  size_t plen = 0;
+  if (nlen > 100) {
+    const char *slash = name + nlen - 101;
+    while ((slash = strchr(slash + 1, '/')) != NULL) {
+      if ((size_t)(slash - name) <= 155 && strlen(slash + 1) <= 100 &&
+          slash[1] != '\0')
+        break;
+    }
+    if (slash) {
+      plen = slash - name;
+      base = slash + 1;
+    }
+  }
+  int need_pax = (nlen > 100 && plen == 0) || size > USTAR_MAX_SIZE;
+  if (need_pax && type != 'x') {
+    // "<len> key=value\n" records, where len counts the whole record
+    char pax[8192];
+    size_t used = 0;
+    if (nlen > 100 && plen == 0) {
+      size_t body = strlen(" path=\n") + nlen;
+      size_t len = body + 1;
+      while (len != body + (size_t)snprintf(NULL, 0, "%zu", len))
+        len = body + snprintf(NULL, 0, "%zu", len);
+      used += snprintf(pax + used, sizeof(pax) - used, "%zu path=%s\n", len,
+                       name);
+    }
+    if (size > USTAR_MAX_SIZE) {
+      char num[32];
+      snprintf(num, sizeof(num), "%ld", size);
+      size_t body = strlen(" size=\n") + strlen(num);
+      size_t len = body + 1;
+      while (len != body + (size_t)snprintf(NULL, 0, "%zu", len))
+        len = body + snprintf(NULL, 0, "%zu", len);
+      used += snprintf(pax + used, sizeof(pax) - used, "%zu size=%s\n", len,
+                       num);
+    }
+    if (used >= sizeof(pax))
+      return -1;
+    if (tar_header(t, "././@PaxHeader", 'x', used, st) < 0 ||
+        tar_put(t, pax, used) < 0 || tar_pad(t, used) < 0)
+      return -1;
+  }
+
+  if (plen == 0 && nlen > 100) {
+    // real name is in the pax header, keep the tail for old readers
+    base = name + nlen - 100;
+  }
+  memcpy(h, base, strlen(base) > 100 ? 100 : strlen(base));
+  tar_octal(h + 100, 8, (type == '5' ? 0755 : 0644));
+  tar_octal(h + 108, 8, 0);
+  tar_octal(h + 116, 8, 0);
+  tar_octal(h + 124, 12, size > USTAR_MAX_SIZE ? 0 : (unsigned long)size);
+  tar_octal(h + 136, 12, st ? (unsigned long)st->st_mtime : 0);
+  h[156] = type;
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+  if (plen)
+    memcpy(h + 345, name, plen);
+
+  // checksum is computed with the checksum field itself set to spaces
+  memset(h + 148, ' ', 8);
+  unsigned long sum = 0;
+  for (int i = 0; i < TAR_BLOCK; i++)
+    sum += (unsigned char)h[i];
+  snprintf(h + 148, 8, "%06lo", sum);
+  h[155] = ' ';
+  return tar_put(t, h, sizeof(h));
+}
+
+// file body (size bytes of fd from off) as chunks of exactly size bytes in
+// total. If the file shrank while we were at it, or fd is -1 because the
+// data is gone, the rest is zero filled so the archive stays well formed
+static int tar_file_data(struct tar_stream *t, int fd, off_t off, long size) {
+  if (tar_flush(t) < 0)
+    return -1;
+  while (size > 0) {
+    long part = size > 0x40000000L ? 0x40000000L : size;
+    if (tar_chunk_start(t, part) < 0)
+      return -1;
+    long left = part;
+    while (left > 0) {
+      double t0 = io_now();
+      ssize_t r = fd >= 0 ? sendfile(t->sock, fd, &off, left) : 0;
+      if (io_account(t0, r) < 0)
+        return -1;
+      if (r > 0) {
+        left -= r;
+        continue;
+      }
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r < 0 && errno != EINVAL && errno != ENOSYS)
+        return -1;
+      // EOF or no sendfile: copy by hand, zeros past the end
+      char buf[CHUNK_SIZE];
+      size_t want = left > CHUNK_SIZE ? CHUNK_SIZE : (size_t)left;
+      ssize_t got = r == 0 ? 0 : pread(fd, buf, want, off);
+      if (got <= 0) {
+        memset(buf, 0, want);
+        got = want;
+      }
+      if (tar_out(t, buf, got) < 0)
+        return -1;
+      off += got;
+      left -= got;
+    }
+    size -= part;
+  }
+  return 0;
+}
+
+static int manifest_tar(struct tar_stream *t, const struct manifest *m);
+
+static int tar_walk(struct tar_stream *t, const char *path) {
+  struct stat st;
+  if (lstat(path, &st) < 0)
+    return 0; // vanished under us
+
+  if (S_ISDIR(st.st_mode)) {
+    char name[4096];
+    snprintf(name, sizeof(name), "%s/", path);
+    if (tar_header(t, name, '5', 0, &st) < 0)
+      return -1;
+    DIR *d = opendir(path);
+    if (!d)
+      return 0;
+    struct dirent *dd;
+    int rc = 0;
+    while (rc == 0 && (dd = readdir(d))) {
+      // skip the temp files of STOREs in flight, they are not files yet
+      if (strcmp(dd->d_name, ".") == 0 || strcmp(dd->d_name, "..") == 0 ||
+          is_temp_name(dd->d_name))
+        continue;
+      char child[4096];
+      snprintf(child, sizeof(child), "%s/%s", path, dd->d_name);
+      rc = tar_walk(t, child);
+    }
+    closedir(d);
+    return rc;
+  }
+
+  if (!S_ISREG(st.st_mode))
+    return 0;
+  int fd = open_stored(path);
+  if (fd < 0)
+    return 0;
+  // take the size from the open file, it is what we are going to send. A
+  // dedup manifest goes in as the file it stands for
+  fstat(fd, &st);
+  struct manifest *m = manifest_load(fd);
+  long size = m ? manifest_size(m) : st.st_size;
+  int rc = tar_header(t, path, '0', size, &st);
+  if (rc == 0)
+    rc = m ? manifest_tar(t, m) : tar_file_data(t, fd, 0, size);
+  if (rc == 0)
+    rc = tar_pad(t, size);
+  manifest_free(m);
+  close(fd);
+  return rc;
+}
+
+static int tar_write_dir(int fd, const char *dir, int chunked) {
+  struct tar_stream *t = (struct tar_stream *)malloc(sizeof(*t));
+  if (!t)
+    return -1;
+  t->sock = fd;
+  t->chunked = chunked;
+  t->used = 0;
+  int rc = tar_walk(t, dir);
+  if (rc == 0) {
+    // end of archive: two zero blocks, then the end of the chunk stream
+    static const char zeros[2 * TAR_BLOCK];
+    if (tar_put(t, zeros, sizeof(zeros)) < 0 || tar_flush(t) < 0 ||
+        (chunked && tar_chunk_start(t, 0) < 0))
+      rc = -1;
+  }
+  free(t);
+  return rc;
+}
+
+// stream a chunked tar archive of dir to sock, including the final zero
+// length chunk. Returns 0 on success, -1 on error
+int tar_stream_dir(int sock, const char *dir) {
+  return tar_write_dir(sock, dir, 1);
+}
+
+// forward a chunked stream (see tar_stream_dir) from one socket to another,
+// up to and including its terminating zero length chunk
+int relay_chunked(int from, int to) {
+  while (1) {
+    uint32_t n;
+    if (recv_all(from, &n, 4) < 0 || send_all(to, &n, 4) < 0)
+      return -1;
+    long len = ntohl(n);
+    if (len == 0)
+      return 0;
+    if (relay(from, to, len) < 0)
+      return -1;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// tar merge
+//
+// A type spread over several storage servers is archived by each of them;
+// S1 reads the archives one after the other and writes a single one,
+// keeping only the first entry of every name (folders all servers have,
+// files stored on several). Only the headers are looked at, bodies are
+// passed on as they come.
+
+// names seen so far, open addressing on their CRC-32C
+struct name_set {
+  char **slot;
+  size_t cap;
+  size_t used;
+};
+
+// 1 if name went in, 0 if it was there already, -1 if out of memory
+static int name_set_add(struct name_set *s, const char *name) {
+  if (s->used * 2 >= s->cap) {
+    size_t cap = s->cap ? s->cap * 2 : 1024;
+    char **slot = (char **)calloc(cap, sizeof(*slot));
+    if (!slot)
+      return -1;
+    for (size_t i = 0; i < s->cap; i++) {
+      if (!s->slot[i])
+        continue;
+      size_t h = crc32c(0, s->slot[i], strlen(s->slot[i])) & (cap - 1);
+      while (slot[h])
+        h = (h + 1) & (cap - 1);
+      slot[h] = s->slot[i];
+    }
+    free(s->slot);
+    s->slot = slot;
+    s->cap = cap;
+  }
+  size_t h = crc32c(0, name, strlen(name)) & (s->cap - 1);
+  for (; s->slot[h]; h = (h + 1) & (s->cap - 1))
+    if (strcmp(s->slot[h], name) == 0)
+      return 0;
+  if (!(s->slot[h] = strdup(name)))
+    return -1;
+  s->used++;
+  return 1;
+}
+
+static void name_set_free(struct name_set *s) {
+  for (size_t i = 0; i < s->cap; i++)
+    free(s->slot[i]);
+  free(s->slot);
+}
+
+// len bytes of the archive in p, across chunk boundaries. -1 if it ended
+// (p->done is set then) or broke first
+static int part_read(struct tar_part *p, void *buf, size_t len) {
+  char *b = (char *)buf;
+  while (len > 0) {
+    if (p->left == 0) {
+      uint32_t n;
+      if (!p->chunked) {
+        p->done = 1;
+        return -1;
+      }
+      if (recv_all(p->fd, &n, 4) < 0)
+        return -1;
+      if ((p->left = ntohl(n)) == 0) {
+        p->done = 1;
+        return -1;
+      }
+    }
+    size_t n = (size_t)p->left < len ? (size_t)p->left : len;
+    if (recv_all(p->fd, b, n) < 0)
+      return -1;
+    p->left -= n;
+    b += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// a numeric header field: octal, or base-256 when the top bit is set
+static long tar_num(const char *f, size_t width) {
+  long v = 0;
+  if ((unsigned char)f[0] & 0x80) {
+    for (size_t i = 1; i < width; i++)
+      v = (v << 8) | (unsigned char)f[i];
+    return v;
+  }
+  for (size_t i = 0; i < width && f[i] >= '0' && f[i] <= '7'; i++)
+    v = v * 8 + (f[i] - '0');
+  return v;
+}
+
+// the value of key in pax records, 0 if it is there
+static int pax_value(const char *pax, long len, const char *key, char *out,
+                     size_t n) {
+  size_t klen = strlen(key);
+  long off = 0;
+  while (off < len) {
+    char *end;
+    long rlen = strtol(pax + off, &end, 10);
+    if (rlen <= 0 || off + rlen > len || *end != ' ')
+      return -1;
+    const char *kv = end + 1;
+    const char *stop = pax + off + rlen - 1; // the '\n'
+    if ((size_t)(stop - kv) > klen && memcmp(kv, key, klen) == 0 &&
+        kv[klen] == '=') {
+      size_t vlen = stop - kv - klen - 1;
+      if (vlen >= n)
+        return -1;
+      memcpy(out, kv + klen + 1, vlen);
+      out[vlen] = '\0';
+      return 0;
+    }
+    off += rlen;
+  }
+  return -1;
+}
+
+int tar_merge(struct tar_part *parts, int n, int sock) {
+  struct tar_stream *t = (struct tar_stream *)malloc(sizeof(*t));
+  // a pax header (its header block and records) waiting for its entry
+  char *pax = (char *)malloc(TAR_BLOCK + 8192);
+  char *buf = (char *)malloc(RELAY_PIPE_SIZE / 16);
+  const size_t bufsz = RELAY_PIPE_SIZE / 16;
+  struct name_set seen = {NULL, 0, 0};
+  int rc = t && pax && buf ? 0 : -1;
+  if (t) {
+    t->sock = sock;
+    t->chunked = 1;
+    t->used = 0;
+  }
+
+  for (int i = 0; rc == 0 && i < n; i++) {
+    struct tar_part *p = &parts[i];
+    char hdr[TAR_BLOCK];
+    long paxlen = 0;
+    while (rc == 0 && part_read(p, hdr, TAR_BLOCK) == 0) {
+      int zero = 1;
+      for (int k = 0; k < TAR_BLOCK && zero; k++)
+        zero = hdr[k] == 0;
+      if (zero) {
+        // end of this archive, read the rest off the connection
+        while (part_read(p, buf, bufsz) == 0)
+          ;
+        break;
+      }
+      long size = tar_num(hdr + 124, 12);
+      long body = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+      if (hdr[156] == 'x') {
+        if (size < 0 || body > 8192 || part_read(p, pax + TAR_BLOCK, body) < 0)
+          break;
+        memcpy(pax, hdr, TAR_BLOCK);
+        paxlen = TAR_BLOCK + size;
+        continue;
+      }
+
+      // ustar names are prefix + '/' + name, a pax path overrides them
+      char name[4096], num[32];
+      int named = paxlen && pax_value(pax + TAR_BLOCK, paxlen - TAR_BLOCK,
+                                      "path", name, sizeof(name)) == 0;
+      if (!named && hdr[345])
+        snprintf(name, sizeof(name), "%.155s/%.100s", hdr + 345, hdr);
+      else if (!named)
+        snprintf(name, sizeof(name), "%.100s", hdr);
+      if (paxlen && pax_value(pax + TAR_BLOCK, paxlen - TAR_BLOCK, "size",
+                              num, sizeof(num)) == 0) {
+        size = atol(num);
+        body = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+      }
+      // out of memory only costs the deduplication
+      int fresh = name_set_add(&seen, name) != 0;
+      if (fresh && paxlen) {
+        long padded = (paxlen + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        memset(pax + paxlen, 0, padded - paxlen);
+        rc = tar_put(t, pax, padded);
+      }
+      paxlen = 0;
+      if (rc == 0 && fresh)
+        rc = tar_put(t, hdr, TAR_BLOCK);
+      // the body as one chunk of its own. If the part breaks in the middle
+      // the rest is zero filled, so the archive stays well formed
+      if (rc == 0 && fresh && body > 0)
+        rc = tar_flush(t) < 0 || tar_chunk_start(t, body) < 0 ? -1 : 0;
+      int broken = 0;
+      while (rc == 0 && body > 0) {
+        size_t k = (size_t)body < bufsz ? (size_t)body : bufsz;
+        if (!broken && part_read(p, buf, k) < 0)
+          broken = 1;
+        if (broken)
+          memset(buf, 0, k);
+        if (fresh && send_all(sock, buf, k) < 0)
+          rc = -1;
+        body -= k;
+      }
+      if (broken)
+        break;
+    }
+  }
+
+  if (rc == 0) {
+    static const char zeros[2 * TAR_BLOCK];
+    if (tar_put(t, zeros, sizeof(zeros)) < 0 || tar_flush(t) < 0 ||
+        tar_chunk_start(t, 0) < 0)
+      rc = -1;
+  }
+  name_set_free(&seen);
+  free(buf);
+  free(pax);
+  free(t);
+  return rc;
+}
+
+// ---------------------------------------------------------------------------
+// tar cache
+//
+// Archives are rebuilt only when the tree changed. The servers bump a
+// generation counter on every STORE/REMOVE; the last archive is kept in a
+// file next to the served folder together with the generation it was built
+// at. The state lives in shared memory so forked children and pool threads
+// all see the same counter, and a process-shared (robust) mutex makes
+// concurrent requests for a stale archive wait for one build instead of
+// each building their own.
+
+struct tar_cache {
+  pthread_mutex_t lock;
+  unsigned long generation; // bumped on every change to the tree
+  unsigned long built_gen;  // generation of the cached archive, 0 = none
+  char dir[256];
+  char path[256];
+};
+
+struct tar_cache *tar_cache_create(const char *dir) {
+  struct tar_cache *c =
+      (struct tar_cache *)mmap(NULL, sizeof(*c), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (c == MAP_FAILED)
+    return NULL;
+  memset(c, 0, sizeof(*c));
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&c->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  c->generation = 1;
+  snprintf(c->dir, sizeof(c->dir), "%s", dir);
+  // outside the folder itself, otherwise it would end up in the archive
+  snprintf(c->path, sizeof(c->path), "%s.cache.tar", dir);
+  return c;
+}
+
+void tar_cache_bump(struct tar_cache *c) {
+  if (c)
+    __atomic_add_fetch(&c->generation, 1, __ATOMIC_SEQ_CST);
+}
+
+// send the cached archive with a plain size header. Returns 1 if sent, 0 if
+// the cache file is unusable and -1 on a send error
+static int tar_cache_send(struct tar_cache *c, struct conn *conn) {
+  int fd = open(c->path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  fstat(fd, &st);
+  int rc = conn_send_data(conn, -1, fd, 0, st.st_size) < 0 ? -1 : 1;
+  close(fd);
+  return rc;
+}
+
+static void tar_cache_lock(struct tar_cache *c) {
+  // a process that died while building leaves the lock "owner dead", the
+  // half built temp file is simply rebuilt
+  if (pthread_mutex_lock(&c->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&c->lock);
+}
+
+// answer a TAR request: size + archive from the cache while the tree is
+// unchanged, otherwise rebuild the cache first. Returns 0 on success
+int tar_cache_serve(struct tar_cache *c, struct conn *conn) {
+  unsigned long gen = __atomic_load_n(&c->generation, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&c->built_gen, __ATOMIC_SEQ_CST) == gen) {
+    int rc = tar_cache_send(c, conn);
+    if (rc != 0)
+      return rc < 0 ? -1 : 0;
+  }
+
+  tar_cache_lock(c);
+  // somebody else may have built it while we waited
+  gen = __atomic_load_n(&c->generation, __ATOMIC_SEQ_CST);
+  if (c->built_gen != gen) {
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", c->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && tar_write_dir(fd, c->dir, 0) == 0;
+    if (fd >= 0)
+      close(fd);
+    // changes that land during the build bump the generation past gen, so
+    // the next request rebuilds
+    if (ok && rename(tmp, c->path) == 0) {
+      __atomic_store_n(&c->built_gen, gen, __ATOMIC_SEQ_CST);
+    } else {
+      unlink(tmp);
+      c->built_gen = 0;
+    }
+  }
+  int built = c->built_gen != 0;
+  pthread_mutex_unlock(&c->lock);
+
+  if (built) {
+    int rc = tar_cache_send(c, conn);
+    if (rc != 0)
+      return rc < 0 ? -1 : 0;
+  }
+  // could not cache it (disk full?), stream it like before
+  if (conn_send_chunked(conn) < 0)
+    return -1;
+  return tar_stream_dir(conn->fd, c->dir);
+}
+
+// ---------------------------------------------------------------------------
+// CRC-32C (Castagnoli), the checksum S1's catalog keeps of every file.
+// SSE4.2 has an instruction for it, which does 8 bytes at a time; other
+// CPUs use the table
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t n) {
+  while (n--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t n) {
+  uint64_t c = crc;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = __builtin_ia32_crc32di(c, v);
+  }
+  crc = (uint32_t)c;
+  while (n--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#endif
+
+static uint32_t (*crc32c_update)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+    crc32c_table[i] = c;
+  }
+  crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32c_update = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_update(~crc, (const unsigned char *)buf, len);
+}
+
+static int manifest_crc(const struct manifest *m, uint32_t *crc);
+
+int file_crc(int fd, uint32_t *crc) {
+  struct manifest *m = manifest_load(fd);
+  if (m) {
+    int rc = manifest_crc(m, crc);
+    manifest_free(m);
+    return rc;
+  }
+  char buf[64 * 1024];
+  uint32_t c = 0;
+  off_t off = 0;
+  ssize_t n;
+  while ((n = pread(fd, buf, sizeof(buf), off)) > 0) {
+    c = crc32c(c, buf, n);
+    off += n;
+  }
+  if (n < 0)
+    return -1;
+  *crc = c;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// directory index
+//
+// Every file and folder below the served folder as one sorted array of
+// entries (path below the folder and its file_meta). It is built once at
+// startup and kept up to date by the STORE/REMOVE/COMMIT handlers, so LIST
+// is a binary search plus a walk over the names it returns and never reads
+// the folder. S1's catalog is the same structure over all nodes. Like
+// the tar cache it lives in shared memory, so forked children and pool
+// threads all see one index; a process-shared rwlock lets LISTs run side by
+// side and holds them off only while an update moves entries around.
+//
+// The names live in a heap behind the entries, which is compacted when it
+// runs full. Paths compare bytewise except that '/' sorts before any other
+// byte: that keeps everything below a folder together, at the place where
+// the folder's own name sorts among its siblings. The mapping is
+// MAP_NORESERVE, only the pages in use cost memory
+
+#define INDEX_MAX_FILES (1 << 20)
+#define INDEX_HEAP (64L * 1024 * 1024)
+#define INDEX_KEY_MAX 4096
+
+struct index_entry {
+  uint32_t off; // name in the heap
+  uint32_t len;
+  struct file_meta m;
+};
+
+struct dir_index {
+  pthread_rwlock_t lock;
+  int broken;     // ran out of room, LIST has to read the folder again
+  long count;
+  long heap_used; // bytes of the heap handed out
+  long heap_dead; // of which belong to removed entries
+  size_t dirlen;
+  char dir[256];
+  struct index_entry ents[INDEX_MAX_FILES];
+  char heap[INDEX_HEAP];
+};
+
+static inline unsigned key_rank(unsigned char c) {
+  return c == '/' ? 0 : c < '/' ? c + 1u : c;
+}
+
+static int key_cmp(const char *a, size_t al, const char *b, size_t bl) {
+  size_t n = al < bl ? al : bl;
+  for (size_t i = 0; i < n; i++)
+    if (a[i] != b[i])
+      return (int)key_rank(a[i]) - (int)key_rank(b[i]);
+  return (al > bl) - (al < bl);
+}
+
+static int index_sort_cmp(const void *a, const void *b, void *arg) {
+  const struct dir_index *x = (const struct dir_index *)arg;
+  const struct index_entry *ea = (const struct index_entry *)a;
+  const struct index_entry *eb = (const struct index_entry *)b;
+  return key_cmp(x->heap + ea->off, ea->len, x->heap + eb->off, eb->len);
+}
+
+// first entry not below key, or with upper set the first one above every
+// path that starts with key
+static long index_bound(const struct dir_index *x, const char *key, size_t len,
+                        int upper) {
+  long lo = 0, hi = x->count;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    const struct index_entry *e = &x->ents[mid];
+    int c = upper ? key_cmp(x->heap + e->off, e->len < len ? e->len : len,
+                            key, len)
+                  : key_cmp(x->heap + e->off, e->len, key, len);
+    if (c < 0 || (upper && c == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int index_is(const struct dir_index *x, long i, const char *key,
+                    size_t len) {
+  return i < x->count && x->ents[i].len == len &&
+         memcmp(x->heap + x->ents[i].off, key, len) == 0;
+}
+
+// the path of a file below the index's folder as it is kept in the index:
+// no leading, doubled or trailing slashes and no "." parts. Length of the
+// key, -1 if path is not below the folder
+static long index_key(const struct dir_index *x, const char *path, char *key,
+                      size_t n) {
+  if (x->dirlen > 0 &&
+      (strncmp(path, x->dir, x->dirlen) != 0 ||
+       (path[x->dirlen] != '/' && path[x->dirlen] != '\0')))
+    return -1;
+  const char *p = path + x->dirlen;
+  size_t k = 0;
+  while (*p) {
+    while (*p == '/')
+      p++;
+    const char *end = strchrnul(p, '/');
+    size_t l = end - p;
+    p = end;
+    if (l == 0 || (l == 1 && end[-1] == '.'))
+      continue;
+    if (l == 2 && end[-1] == '.' && end[-2] == '.')
+      return -1;
+    if (k + l + 2 > n)
+      return -1;
+    if (k)
+      key[k++] = '/';
+    memcpy(key + k, end - l, l);
+    k += l;
+  }
+  key[k] = '\0';
+  return k;
+}
+
+// rewrite the heap without the names of removed entries
+static void index_compact(struct dir_index *x) {
+  char *tmp = (char *)malloc(x->heap_used - x->heap_dead);
+  if (!tmp)
+    return;
+  long used = 0;
+  for (long i = 0; i < x->count; i++) {
+    struct index_entry *e = &x->ents[i];
+    memcpy(tmp + used, x->heap + e->off, e->len);
+    e->off = used;
+    used += e->len;
+  }
+  memcpy(x->heap, tmp, used);
+  free(tmp);
+  x->heap_used = used;
+  x->heap_dead = 0;
+}
+
+static long index_name(struct dir_index *x, const char *key, size_t len) {
+  if (x->heap_used + (long)len > INDEX_HEAP && x->heap_dead > 0)
+    index_compact(x);
+  if (x->heap_used + (long)len > INDEX_HEAP)
+    return -1;
+  long off = x->heap_used;
+  memcpy(x->heap + off, key, len);
+  x->heap_used += len;
+  return off;
+}
+
+// append without keeping the order, for the startup scan
+static int index_append(struct dir_index *x, const char *key, size_t len,
+                        const struct file_meta *m) {
+  if (x->count == INDEX_MAX_FILES)
+    return -1;
+  long off = index_name(x, key, len);
+  if (off < 0)
+    return -1;
+  struct index_entry *e = &x->ents[x->count++];
+  e->off = off;
+  e->len = len;
+  e->m = *m;
+  return 0;
+}
+
+static void index_scan(struct dir_index *x, const char *path) {
+  DIR *d = opendir(path);
+  if (!d)
+    return;
+  struct dirent *dd;
+  while ((dd = readdir(d))) {
+    // a temp file left by a crash mid-STORE never became a file
+    if (strcmp(dd->d_name, ".") == 0 || strcmp(dd->d_name, "..") == 0 ||
+        is_temp_name(dd->d_name))
+      continue;
+    char child[INDEX_KEY_MAX];
+    if (snprintf(child, sizeof(child), "%s/%s", path, dd->d_name) >=
+        (int)sizeof(child))
+      continue;
+    struct stat st;
+    if (lstat(child, &st) < 0)
+      continue;
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+      continue;
+    // a dedup manifest counts as the file it stands for. Checksums are
+    // left for whoever needs them, see dir_index_dump()
+    struct file_meta fm = {S_ISDIR(st.st_mode) ? -1 : st.st_size,
+                           st.st_mtime, 0, 0};
+    int fd = S_ISREG(st.st_mode) ? open(child, O_RDONLY) : -1;
+    if (fd >= 0) {
+      struct manifest *m = manifest_load(fd);
+      if (m)
+        fm.size = manifest_size(m);
+      manifest_free(m);
+      close(fd);
+    }
+    char key[INDEX_KEY_MAX];
+    long len = index_key(x, child, key, sizeof(key));
+    if (len > 0 && index_append(x, key, len, &fm) < 0)
+      x->broken = 1;
+    if (S_ISDIR(st.st_mode))
+      index_scan(x, child);
+  }
+  closedir(d);
+}
+
+// an empty index of dir
+static struct dir_index *index_new(const char *dir) {
+  struct dir_index *x = (struct dir_index *)mmap(
+      NULL, sizeof(*x), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (x == MAP_FAILED)
+    return NULL;
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_rwlock_init(&x->lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  snprintf(x->dir, sizeof(x->dir), "%s", dir);
+  x->dirlen = strlen(x->dir);
+  return x;
+}
+
+struct dir_index *dir_index_create(const char *dir) {
+  struct dir_index *x = index_new(dir);
+  if (!x)
+    return NULL;
+  index_scan(x, x->dir);
+  qsort_r(x->ents, x->count, sizeof(x->ents[0]), index_sort_cmp, x);
+  return x;
+}
+
+long dir_index_count(struct dir_index *x) {
+  return x ? x->count : 0;
+}
+
+// add or update the entry of key, 0 on success and -1 if there is no room
+static int index_set(struct dir_index *x, const char *key, size_t len,
+                     const struct file_meta *m) {
+  long i = index_bound(x, key, len, 0);
+  if (!index_is(x, i, key, len)) {
+    long off = -1;
+    if (x->count < INDEX_MAX_FILES)
+      off = index_name(x, key, len);
+    if (off < 0)
+      return -1;
+    memmove(&x->ents[i + 1], &x->ents[i],
+            (x->count - i) * sizeof(x->ents[0]));
+    x->ents[i].off = off;
+    x->ents[i].len = len;
+    x->count++;
+  }
+  x->ents[i].m = *m;
+  return 0;
+}
+
+// the same, plus entries for the folders on the way that are missing.
+// Marks the index broken if it ran out of room
+static int index_set_path(struct dir_index *x, const char *key, size_t len,
+                          const struct file_meta *m) {
+  if (x->broken)
+    return -1;
+  struct file_meta dir = {-1, m->mtime, 0, m->node};
+  int rc = index_set(x, key, len, m);
+  for (size_t k = 0; rc == 0 && k < len; k++)
+    if (key[k] == '/' && !index_is(x, index_bound(x, key, k, 0), key, k))
+      rc = index_set(x, key, k, &dir);
+  if (rc < 0) {
+    x->broken = 1;
+    if (x->dirlen)
+      printf("[%s] directory index is full, LIST reads the folder from now "
+             "on\n",
+             x->dir);
+    else
+      printf("[S1] catalog is full, asking the nodes from now on\n");
+  }
+  return rc;
+}
+
+// catalog records: what S1 keeps in its log and snapshot, and what the
+// storage servers send it (DUMP pages, the answer to a store). All
+// numbers in network order, the record checksum covers everything after it
+enum { REC_PUT = 'P', REC_DEL = 'D', REC_SYNC = 'S' };
+#define REC_HDR 28
+
+struct rec {
+  int type;
+  int node;
+  const char *key;
+  size_t klen;
+  struct file_meta m;
+};
+
+static void rec_seal(unsigned char *b, size_t klen) {
+  put_be32(b, crc32c(0, b + 4, REC_HDR - 4 + klen));
+}
+
+// encode into b, which has room for REC_HDR + klen bytes. Returns the length
+static size_t rec_encode(unsigned char *b, int type, const char *key,
+                         size_t klen, const struct file_meta *m) {
+  b[4] = type;
+  b[5] = m->node;
+  put_be16(b + 6, klen);
+  put_be64(b + 8, (uint64_t)m->size);
+  put_be64(b + 16, (uint64_t)m->mtime);
+  put_be32(b + 24, m->crc);
+  memcpy(b + REC_HDR, key, klen);
+  rec_seal(b, klen);
+  return REC_HDR + klen;
+}
+
+// length of the record at b, 0 if it is cut off and -1 if it is damaged
+static long rec_decode(const unsigned char *b, size_t avail, struct rec *r) {
+  if (avail < REC_HDR)
+    return 0;
+  size_t klen = get_be16(b + 6);
+  if (avail < REC_HDR + klen)
+    return 0;
+  if (get_be32(b) != crc32c(0, b + 4, REC_HDR - 4 + klen) || klen == 0 ||
+      klen >= INDEX_KEY_MAX)
+    return -1;
+  r->type = b[4];
+  r->node = b[5];
+  r->key = (const char *)b + REC_HDR;
+  r->klen = klen;
+  r->m.size = (long)get_be64(b + 8);
+  r->m.mtime = (long)get_be64(b + 16);
+  r->m.crc = get_be32(b + 24);
+  r->m.node = r->node;
+  return REC_HDR + klen;
+}
+
+int dir_index_stored(struct dir_index *x, struct conn *c, const char *path,
+                     long size, uint32_t crc) {
+  char key[INDEX_KEY_MAX];
+  struct stat st;
+  long len = -1;
+  if (x && path)
+    len = index_key(x, path, key, sizeof(key));
+  if (len <= 0 || stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+    return c && c->v2 ? conn_send_blob(c, "", 0) : 0;
+  struct file_meta m = {size < 0 ? st.st_size : size, st.st_mtime, crc, 0};
+
+  pthread_rwlock_wrlock(&x->lock);
+  index_set_path(x, key, len, &m);
+  pthread_rwlock_unlock(&x->lock);
+  if (!c || !c->v2)
+    return 0;
+  unsigned char rec[REC_HDR + INDEX_KEY_MAX];
+  return conn_send_blob(c, (const char *)rec,
+                        rec_encode(rec, REC_PUT, key, len, &m));
+}
+
+// remove the entry of key (files only unless dirs is set), 1 if there was one
+static int index_del(struct dir_index *x, const char *key, size_t len,
+                     int dirs) {
+  long i = index_bound(x, key, len, 0);
+  if (!index_is(x, i, key, len) || (!dirs && x->ents[i].m.size < 0))
+    return 0;
+  x->heap_dead += len;
+  memmove(&x->ents[i], &x->ents[i + 1],
+          (x->count - i - 1) * sizeof(x->ents[0]));
+  x->count--;
+  return 1;
+}
+
+void dir_index_del(struct dir_index *x, const char *path) {
+  char key[INDEX_KEY_MAX];
+  long len;
+  if (!x || (len = index_key(x, path, key, sizeof(key))) <= 0)
+    return;
+  pthread_rwlock_wrlock(&x->lock);
+  index_del(x, key, len, 1);
+  pthread_rwlock_unlock(&x->lock);
+}
+
+// add name + '\n' to a growing buffer
+static int list_add(char **buf, size_t *used, size_t *cap, const char *name,
+                    size_t len) {
+  if (*used + len + 2 > *cap) {
+    size_t ncap = *cap * 2;
+    while (*used + len + 2 > ncap)
+      ncap *= 2;
+    char *nb = (char *)realloc(*buf, ncap);
+    if (!nb)
+      return -1;
+    *buf = nb;
+    *cap = ncap;
+  }
+  memcpy(*buf + *used, name, len);
+  (*buf)[*used + len] = '\n';
+  *used += len + 1;
+  (*buf)[*used] = '\0';
+  return 0;
+}
+
+char *dir_index_list(struct dir_index *x, const char *path, const char *after,
+                     long limit, size_t *len) {
+  // prefix of everything below the folder: its key and a slash
+  char prefix[2 * INDEX_KEY_MAX];
+  long plen;
+  if (!x || x->broken ||
+      (plen = index_key(x, path, prefix, INDEX_KEY_MAX)) < 0)
+    return NULL;
+  if (plen > 0)
+    prefix[plen++] = '/';
+  size_t alen = after ? strlen(after) : 0;
+  if (plen + alen + 1 > sizeof(prefix))
+    return NULL;
+  if (limit <= 0)
+    limit = LONG_MAX;
+
+  size_t used = 0, cap = 4096;
+  char *buf = (char *)malloc(cap);
+  if (!buf)
+    return NULL;
+  buf[0] = '\0';
+
+  pthread_rwlock_rdlock(&x->lock);
+  long i = index_bound(x, prefix, plen, 0);
+  long end = index_bound(x, prefix, plen, 1);
+  if (alen > 0) {
+    // resume right behind after and whatever is below it
+    memcpy(prefix + plen, after, alen);
+    prefix[plen + alen] = '/';
+    long from = index_bound(x, prefix, plen + alen + 1, 1);
+    if (from > i)
+      i = from;
+  }
+  int rc = 0;
+  long n = 0;
+  while (rc == 0 && i < end && n < limit) {
+    const struct index_entry *e = &x->ents[i];
+    const char *name = x->heap + e->off + plen;
+    size_t nlen = e->len - plen;
+    const char *slash = (const char *)memchr(name, '/', nlen);
+    if (!slash && e->m.size >= 0) {
+      if (name[0] != '.') {
+        rc = list_add(&buf, &used, &cap, name, nlen);
+        n++;
+      }
+      i++;
+      continue;
+    }
+    // a folder: list it once and jump over everything below it
+    if (slash)
+      nlen = slash - name;
+    if (name[0] != '.') {
+      rc = list_add(&buf, &used, &cap, name, nlen);
+      n++;
+    }
+    if (plen + nlen + 1 > sizeof(prefix))
+      break;
+    memcpy(prefix + plen, name, nlen);
+    prefix[plen + nlen] = '/';
+    i = index_bound(x, prefix, plen + nlen + 1, 1);
+  }
+  pthread_rwlock_unlock(&x->lock);
+
+  if (rc < 0) {
+    free(buf);
+    return NULL;
+  }
+  *len = used;
+  return buf;
+}
+
+char *dir_index_dump(struct dir_index *x, const char *after, long limit,
+                     size_t *len) {
+  if (!x || x->broken)
+    return NULL;
+  if (limit <= 0 || limit > LIST_PAGE_MAX)
+    limit = LIST_PAGE_MAX;
+  size_t alen = after ? strlen(after) : 0;
+  size_t used = 0, cap = 64 * 1024;
+  unsigned char *buf = (unsigned char *)malloc(cap);
+  if (!buf)
+    return NULL;
+
+  // copy the page out under the lock, checksums nobody asked for so far
+  // are worked out after letting go of it
+  pthread_rwlock_rdlock(&x->lock);
+  long i = index_bound(x, after ? after : "", alen, 0);
+  if (alen > 0 && index_is(x, i, after, alen))
+    i++;
+  for (long n = 0; buf && i < x->count && n < limit; i++, n++) {
+    const struct index_entry *e = &x->ents[i];
+    if (used + REC_HDR + e->len > cap) {
+      cap *= 2;
+      unsigned char *nb = (unsigned char *)realloc(buf, cap);
+      if (!nb) {
+        free(buf);
+        buf = NULL;
+        break;
+      }
+      buf = nb;
+    }
+    used += rec_encode(buf + used, REC_PUT, x->heap + e->off, e->len, &e->m);
+  }
+  pthread_rwlock_unlock(&x->lock);
+  if (!buf)
+    return NULL;
+
+  struct rec r;
+  long n;
+  for (size_t off = 0; (n = rec_decode(buf + off, used - off, &r)) > 0;
+       off += n) {
+    if (r.m.size < 0 || r.m.crc != 0)
+      continue;
+    char path[INDEX_KEY_MAX + 256];
+    snprintf(path, sizeof(path), "%s/%.*s", x->dir, (int)r.klen, r.key);
+    uint32_t crc;
+    int fd = open_stored(path);
+    if (fd >= 0 && file_crc(fd, &crc) == 0) {
+      put_be32(buf + off + 24, crc);
+      rec_seal(buf + off, r.klen);
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  *len = used;
+  return (char *)buf;
+}
+
+void dir_index_free(struct dir_index *x) {
+  if (!x)
+    return;
+  pthread_rwlock_destroy(&x->lock);
+  munmap(x, sizeof(*x));
+}
+
+// max-heap on strcmp, for keeping the smallest names of a folder
+static void name_sift(char **h, long n, long i) {
+  while (1) {
+    long m = i, l = 2 * i + 1, r = l + 1;
+    if (l < n && strcmp(h[l], h[m]) > 0)
+      m = l;
+    if (r < n && strcmp(h[r], h[m]) > 0)
+      m = r;
+    if (m == i)
+      return;
+    char *t = h[i];
+    h[i] = h[m];
+    h[m] = t;
+    i = m;
+  }
+}
+
+static int name_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+char *list_dir_page(const char *dir, const char *after, long limit,
+                    const char *match, size_t *len) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    *len = 0;
+    return strdup("");
+  }
+  if (limit <= 0)
+    limit = LONG_MAX;
+
+  // the limit smallest names behind after, the largest of them on top so
+  // a smaller one can replace it. Only a page is ever held, however large
+  // the folder is
+  long n = 0, cap = 0;
+  char **h = NULL;
+  int rc = 0;
+  struct dirent *dd;
+  while (rc == 0 && (dd = readdir(d))) {
+    const char *name = dd->d_name;
+    if (name[0] == '.' || is_temp_name(name) ||
+        (match && !strstr(name, match)) || (after && strcmp(name, after) <= 0))
+      continue;
+    if (n == limit) {
+      if (strcmp(name, h[0]) >= 0)
+        continue;
+      char *dup = strdup(name);
+      if (!dup) {
+        rc = -1;
+        break;
+      }
+      free(h[0]);
+      h[0] = dup;
+      name_sift(h, n, 0);
+      continue;
+    }
+    if (n == cap) {
+      long ncap = cap ? 2 * cap : 64;
+      char **nh = (char **)realloc(h, ncap * sizeof(*h));
+      if (!nh) {
+        rc = -1;
+        break;
+      }
+      h = nh;
+      cap = ncap;
+    }
+    if (!(h[n] = strdup(name))) {
+      rc = -1;
+      break;
+    }
+    // sift up
+    for (long i = n++; i > 0 && strcmp(h[i], h[(i - 1) / 2]) > 0;
+         i = (i - 1) / 2) {
+      char *t = h[i];
+      h[i] = h[(i - 1) / 2];
+      h[(i - 1) / 2] = t;
+    }
+  }
+  closedir(d);
+
+  qsort(h, n, sizeof(*h), name_cmp);
+  size_t used = 0, bcap = 4096;
+  char *buf = rc == 0 ? (char *)malloc(bcap) : NULL;
+  if (buf)
+    buf[0] = '\0';
+  for (long i = 0; i < n; i++) {
+    if (buf && list_add(&buf, &used, &bcap, h[i], strlen(h[i])) < 0) {
+      free(buf);
+      buf = NULL;
+    }
+    free(h[i]);
+  }
+  free(h);
+  *len = used;
+  return buf;
+}
+
+// ---------------------------------------------------------------------------
+// S1's catalog
+//
+// A dir_index without a folder: keys are the paths clients use, and
+// file_meta.node says which node a file lives on. Every change is appended
+// to <path>.log as a record (see rec_encode()) before S1 answers the
+// client. When the log holds more records than the catalog has entries,
+// the whole catalog goes to <path> as a snapshot made of the same records,
+// written next to it and renamed over it, and the log starts over. Loading
+// is a replay of the snapshot and then the log; both are appended to the
+// index unsorted and settled with one sort at the end, so a restart costs
+// a read of two files and no directory walks. A record that is cut off or
+// damaged ends the replay and is truncated away.
+//
+// A node counts as synced once the catalog holds all of its files, which
+// is recorded in the log too (REC_SYNC). Until then S1 keeps asking the
+// node itself, see catalog_synced()
+
+#define CATALOG_COMPACT_MIN 4096
+// size of an entry for a removed path while a replay is settled
+#define INDEX_GONE (-2)
+
+struct catalog {
+  struct dir_index *x; // x->lock guards the rest as well
+  int logfd;
+  long log_records;
+  int synced[CATALOG_NODES];
+  int syncing; // catalog_sync() calls under way, the log stays as it is
+  char path[256];
+};
+
+// index_sort_cmp, with entries for the same path in the order they were
+// appended (their names went onto the heap one after the other)
+static int index_seq_cmp(const void *a, const void *b, void *arg) {
+  int c = index_sort_cmp(a, b, arg);
+  if (c)
+    return c;
+  uint32_t oa = ((const struct index_entry *)a)->off;
+  uint32_t ob = ((const struct index_entry *)b)->off;
+  return (oa > ob) - (oa < ob);
+}
+
+// sort an index that was appended to in any order: the last entry for a
+// path wins, INDEX_GONE entries drop out and folders that only show up
+// in the paths of files get entries of their own
+static void index_settle(struct dir_index *x) {
+  qsort_r(x->ents, x->count, sizeof(x->ents[0]), index_seq_cmp, x);
+  long n = 0;
+  for (long i = 0; i < x->count; i++) {
+    struct index_entry *e = &x->ents[i];
+    if ((i + 1 < x->count &&
+         index_is(x, i + 1, x->heap + e->off, e->len)) ||
+        e->m.size == INDEX_GONE) {
+      x->heap_dead += e->len;
+      continue;
+    }
+    x->ents[n++] = *e;
+  }
+  x->count = n;
+
+  long added = 0;
+  for (long i = 0; i < n && !x->broken; i++) {
+    char key[INDEX_KEY_MAX];
+    size_t len = x->ents[i].len;
+    struct file_meta dir = {-1, x->ents[i].m.mtime, 0, x->ents[i].m.node};
+    memcpy(key, x->heap + x->ents[i].off, len);
+    for (size_t k = 0; k < len; k++) {
+      if (key[k] != '/')
+        continue;
+      // look among the sorted entries only
+      long count = x->count;
+      x->count = n;
+      int have = index_is(x, index_bound(x, key, k, 0), key, k);
+      x->count = count;
+      if (!have && index_append(x, key, k, &dir) < 0)
+        x->broken = 1;
+      added += !have;
+    }
+  }
+  if (added > 0)
+    index_settle(x);
+}
+
+// put the entries of y (sorted, private to the caller) into x in place of
+// the files x has from node, in one pass. -1 if x ran out of room
+static int index_merge(struct dir_index *x, struct dir_index *y, int node) {
+  long names = 0;
+  for (long j = 0; j < y->count; j++)
+    names += y->ents[j].len;
+  if (x->heap_used + names > INDEX_HEAP && x->heap_dead > 0)
+    index_compact(x);
+  if (x->heap_used + names > INDEX_HEAP)
+    return -1;
+  struct index_entry *out = (struct index_entry *)malloc(
+      (x->count + y->count) * sizeof(struct index_entry));
+  if (!out)
+    return -1;
+  // y's names move to x's heap first, so both sides compare in one heap
+  for (long j = 0; j < y->count; j++) {
+    struct index_entry *e = &y->ents[j];
+    memcpy(x->heap + x->heap_used, y->heap + e->off, e->len);
+    e->off = x->heap_used;
+    x->heap_used += e->len;
+  }
+
+  long i = 0, j = 0, n = 0;
+  while (i < x->count || j < y->count) {
+    const struct index_entry *a = i < x->count ? &x->ents[i] : NULL;
+    const struct index_entry *b = j < y->count ? &y->ents[j] : NULL;
+    int c = !a   ? 1
+            : !b ? -1
+                 : key_cmp(x->heap + a->off, a->len, x->heap + b->off, b->len);
+    if (c < 0) {
+      if (a->m.size >= 0 && a->m.node == node)
+        x->heap_dead += a->len;
+      else
+        out[n++] = *a;
+      i++;
+    } else if (c > 0) {
+      out[n++] = *b;
+      j++;
+    } else {
+      // a folder that was known already keeps its entry
+      int keep = a->m.size < 0 && b->m.size < 0;
+      out[n++] = keep ? *a : *b;
+      x->heap_dead += keep ? b->len : a->len;
+      i++;
+      j++;
+    }
+  }
+  if (n > INDEX_MAX_FILES) {
+    free(out);
+    return -1;
+  }
+  memcpy(x->ents, out, n * sizeof(out[0]));
+  x->count = n;
+  free(out);
+  return 0;
+}
+
+// append the records in fd to the catalog's index (see index_settle()).
+// Returns the number of records; *bad is the offset of the first record
+// that is cut off or damaged, -1 if there is none
+static long catalog_replay(struct catalog *k, int fd, long *bad) {
+  size_t cap = 1024 * 1024, have = 0;
+  unsigned char *buf = (unsigned char *)malloc(cap);
+  long records = 0, pos = 0;
+  ssize_t r = 0;
+  *bad = -1;
+  if (!buf)
+    return 0;
+  for (;;) {
+    r = pread(fd, buf + have, cap - have, pos + have);
+    if (r <= 0)
+      break;
+    have += r;
+    size_t off = 0;
+    long n;
+    struct rec rec;
+    while ((n = rec_decode(buf + off, have - off, &rec)) > 0) {
+      if (rec.type == REC_SYNC && rec.node < CATALOG_NODES) {
+        k->synced[rec.node] = rec.m.size != 0;
+      } else if (rec.type == REC_PUT || rec.type == REC_DEL) {
+        if (rec.type == REC_DEL)
+          rec.m.size = INDEX_GONE;
+        if (index_append(k->x, rec.key, rec.klen, &rec.m) < 0)
+          k->x->broken = 1;
+      }
+      off += n;
+      records++;
+    }
+    if (n < 0)
+      break;
+    memmove(buf, buf + off, have - off);
+    have -= off;
+    pos += off;
+  }
+  if (r < 0 || have > 0)
+    *bad = pos;
+  free(buf);
+  return records;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// write the catalog to its snapshot file and empty the log. Called with
+// the lock held
+static int catalog_compact(struct catalog *k) {
+  char tmp[300];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", k->path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+  size_t cap = 1024 * 1024, used = 0;
+  unsigned char *buf = (unsigned char *)malloc(cap);
+  int rc = buf ? 0 : -1;
+  for (int node = 0; rc == 0 && node < CATALOG_NODES; node++) {
+    struct file_meta m = {k->synced[node], 0, 0, node};
+    used += rec_encode(buf + used, REC_SYNC, "*", 1, &m);
+  }
+  for (long i = 0; rc == 0 && i < k->x->count; i++) {
+    const struct index_entry *e = &k->x->ents[i];
+    if (used + REC_HDR + e->len > cap) {
+      rc = write_all(fd, (const char *)buf, used);
+      used = 0;
+    }
+    used += rec_encode(buf + used, REC_PUT, k->x->heap + e->off, e->len, &e->m);
+  }
+  if (rc == 0)
+    rc = write_all(fd, (const char *)buf, used);
+  free(buf);
+  if (rc == 0)
+    rc = fsync(fd);
+  close(fd);
+  if (rc == 0)
+    rc = rename(tmp, k->path);
+  if (rc < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  // a crash before this point replays the log on top of a snapshot that
+  // has it already, which changes nothing
+  if (ftruncate(k->logfd, 0) == 0)
+    k->log_records = 0;
+  return 0;
+}
+
+// append a record to the log, with the lock held
+static void catalog_log(struct catalog *k, int type, const char *key,
+                        size_t len, const struct file_meta *m) {
+  unsigned char rec[REC_HDR + INDEX_KEY_MAX];
+  size_t n = rec_encode(rec, type, key, len, m);
+  if (write_all(k->logfd, (const char *)rec, n) < 0) {
+    perror("[S1] catalog log");
+    return;
+  }
+  if (++k->log_records > CATALOG_COMPACT_MIN &&
+      k->log_records > k->x->count && !k->syncing && catalog_compact(k) < 0)
+    perror("[S1] catalog snapshot");
+}
+
+struct catalog *catalog_open(const char *path) {
+  struct catalog *k = (struct catalog *)mmap(NULL, sizeof(*k),
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (k == MAP_FAILED)
+    return NULL;
+  snprintf(k->path, sizeof(k->path), "%s", path);
+  if (!(k->x = index_new(""))) {
+    munmap(k, sizeof(*k));
+    return NULL;
+  }
+
+  long bad;
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    catalog_replay(k, fd, &bad);
+    close(fd);
+    if (bad >= 0) {
+      // snapshots are renamed into place whole, this one was damaged
+      // later on. Every node is dumped again
+      printf("[S1] %s is damaged, rebuilding the catalog\n", path);
+      k->x->count = k->x->heap_used = k->x->heap_dead = 0;
+      memset(k->synced, 0, sizeof(k->synced));
+    }
+  }
+  char log[300];
+  snprintf(log, sizeof(log), "%s.log", path);
+  k->logfd = open(log, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (k->logfd < 0) {
+    perror("[S1] catalog log");
+    dir_index_free(k->x);
+    munmap(k, sizeof(*k));
+    return NULL;
+  }
+  k->log_records = catalog_replay(k, k->logfd, &bad);
+  if (bad >= 0) {
+    printf("[S1] %s is cut off after %ld records, truncating it\n", log,
+           k->log_records);
+    if (ftruncate(k->logfd, bad) < 0)
+      perror("[S1] catalog log");
+  }
+  index_settle(k->x);
+  if (k->x->broken)
+    printf("[S1] catalog is full, asking the nodes from now on\n");
+  return k;
+}
+
+long catalog_count(struct catalog *k) {
+  return k ? dir_index_count(k->x) : 0;
+}
+
+int catalog_synced(struct catalog *k, int node) {
+  return k && node >= 0 && node < CATALOG_NODES && !k->x->broken &&
+         k->synced[node];
+}
+
+// apply the changes logged from since on once more, after a merge put
+// older entries from a DUMP over them. Called with the lock held
+static void catalog_redo(struct catalog *k, off_t since) {
+  off_t end = lseek(k->logfd, 0, SEEK_END);
+  if (end <= since)
+    return;
+  unsigned char *buf = (unsigned char *)malloc(end - since);
+  if (!buf || pread(k->logfd, buf, end - since, since) != end - since) {
+    free(buf);
+    return;
+  }
+  size_t off = 0;
+  long n;
+  struct rec r;
+  while ((n = rec_decode(buf + off, end - since - off, &r)) > 0) {
+    if (r.type == REC_PUT)
+      index_set_path(k->x, r.key, r.klen, &r.m);
+    else if (r.type == REC_DEL)
+      index_del(k->x, r.key, r.klen, 0);
+    off += n;
+  }
+  free(buf);
+}
+
+int catalog_sync(struct catalog *k, int node, dump_page_fn fetch, void *arg) {
+  if (!k || node < 0 || node >= CATALOG_NODES || k->x->broken)
+    return -1;
+  struct dir_index *y = index_new("");
+  if (!y)
+    return -1;
+  // clients go on while the DUMP is paged: what they change from here on
+  // is in the log and goes over the DUMP once it is merged
+  pthread_rwlock_wrlock(&k->x->lock);
+  k->syncing++;
+  off_t since = lseek(k->logfd, 0, SEEK_END);
+  pthread_rwlock_unlock(&k->x->lock);
+  char after[INDEX_KEY_MAX] = "";
+  int rc = 0;
+  for (;;) {
+    size_t len;
+    char *page = fetch(arg, after, &len);
+    if (!page || len == 0) {
+      rc = page ? 0 : -1;
+      free(page);
+      break;
+    }
+    const unsigned char *b = (const unsigned char *)page;
+    size_t off = 0;
+    long n;
+    struct rec r;
+    while ((n = rec_decode(b + off, len - off, &r)) > 0) {
+      r.m.node = node;
+      if (r.type == REC_PUT && index_append(y, r.key, r.klen, &r.m) < 0)
+        y->broken = 1;
+      memcpy(after, r.key, r.klen);
+      after[r.klen] = '\0';
+      off += n;
+    }
+    free(page);
+    if (off != len || y->broken) {
+      rc = -1;
+      break;
+    }
+  }
+
+  if (rc == 0)
+    index_settle(y);
+  pthread_rwlock_wrlock(&k->x->lock);
+  k->syncing--;
+  if (rc == 0) {
+    rc = index_merge(k->x, y, node);
+    if (rc == 0)
+      catalog_redo(k, since);
+    if (rc == 0 && !k->x->broken) {
+      k->synced[node] = 1;
+      // another sync still needs the log it started from
+      if (k->syncing || catalog_compact(k) < 0) {
+        // the log has to carry it then, as it is after the redo
+        struct file_meta m = {1, 0, 0, node};
+        catalog_log(k, REC_SYNC, "*", 1, &m);
+        for (long i = 0; i < y->count; i++) {
+          const char *key = k->x->heap + y->ents[i].off;
+          size_t len = y->ents[i].len;
+          long j = index_bound(k->x, key, len, 0);
+          if (index_is(k->x, j, key, len))
+            catalog_log(k, REC_PUT, key, len, &k->x->ents[j].m);
+          else
+            catalog_log(k, REC_DEL, key, len, &m);
+        }
+      }
+    } else {
+      k->x->broken = 1;
+      rc = -1;
+      printf("[S1] catalog is full, asking the nodes from now on\n");
+    }
+  }
+  pthread_rwlock_unlock(&k->x->lock);
+  dir_index_free(y);
+  return rc;
+}
+
+static int catalog_set(struct catalog *k, const char *key, size_t len,
+                       const struct file_meta *m) {
+  pthread_rwlock_wrlock(&k->x->lock);
+  int rc = index_set_path(k->x, key, len, m);
+  if (rc == 0)
+    catalog_log(k, REC_PUT, key, len, m);
+  pthread_rwlock_unlock(&k->x->lock);
+  fdatasync(k->logfd);
+  return rc;
+}
+
+int catalog_put(struct catalog *k, const char *path,
+                const struct file_meta *m) {
+  char key[INDEX_KEY_MAX];
+  long len;
+  if (!k || (len = index_key(k->x, path, key, sizeof(key))) <= 0)
+    return -1;
+  return catalog_set(k, key, len, m);
+}
+
+int catalog_recv(struct catalog *k, int node, const char *buf, size_t len,
+                 struct file_meta *m, char *path, size_t n) {
+  const unsigned char *b = (const unsigned char *)buf;
+  size_t off = 0;
+  long step, count = 0;
+  struct rec r;
+  while ((step = rec_decode(b + off, len - off, &r)) > 0) {
+    r.m.node = node;
+    if (r.type == REC_PUT && k)
+      catalog_set(k, r.key, r.klen, &r.m);
+    if (m)
+      *m = r.m;
+    if (path && r.klen < n) {
+      memcpy(path, r.key, r.klen);
+      path[r.klen] = '\0';
+    }
+    off += step;
+    count++;
+  }
+  return off == len ? count : -1;
+}
+
+int catalog_next(const char *buf, size_t len, size_t *off, char *path,
+                 size_t n, struct file_meta *m) {
+  struct rec r;
+  long step = *off < len ? rec_decode((const unsigned char *)buf + *off,
+                                      len - *off, &r)
+                         : 0;
+  if (step <= 0 || r.klen >= n)
+    return -1;
+  *off += step;
+  memcpy(path, r.key, r.klen);
+  path[r.klen] = '\0';
+  *m = r.m;
+  return r.type == REC_PUT && r.m.size >= 0;
+}
+
+void catalog_del(struct catalog *k, const char *path) {
+  char key[INDEX_KEY_MAX];
+  long len;
+  if (!k || (len = index_key(k->x, path, key, sizeof(key))) <= 0)
+    return;
+  struct file_meta m = {0, 0, 0, 0};
+  pthread_rwlock_wrlock(&k->x->lock);
+  if (index_del(k->x, key, len, 0))
+    catalog_log(k, REC_DEL, key, len, &m);
+  pthread_rwlock_unlock(&k->x->lock);
+  fdatasync(k->logfd);
+}
+
+int catalog_get(struct catalog *k, const char *path, struct file_meta *m) {
+  char key[INDEX_KEY_MAX];
+  long len;
+  if (!k || (len = index_key(k->x, path, key, sizeof(key))) < 0)
+    return -1;
+  pthread_rwlock_rdlock(&k->x->lock);
+  long i = index_bound(k->x, key, len, 0);
+  int found = len == 0 || index_is(k->x, i, key, len);
+  if (found && len > 0)
+    *m = k->x->ents[i].m;
+  else if (found)
+    *m = (struct file_meta){-1, 0, 0, 0};
+  pthread_rwlock_unlock(&k->x->lock);
+  return found ? 0 : -1;
+}
+
+char *catalog_list(struct catalog *k, const char *path, const char *after,
+                   long limit, size_t *len) {
+  return k ? dir_index_list(k->x, path, after, limit, len) : NULL;
+}
+
+// ---------------------------------------------------------------------------
+// multipart upload sessions
+
+static void stage_path(char *path, size_t n, const char *dir, long id) {
+  snprintf(path, n, "%s/%016lx", dir, (unsigned long)id);
+}
+
+// drop sessions nobody wrote to for STAGE_MAX_AGE, their client is gone
+static void stage_reap(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  time_t now = time(NULL);
+  struct dirent *e;
+  char path[PATH_MAX];
+  while ((e = readdir(d))) {
+    struct stat st;
+    if (e->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    if (stat(path, &st) == 0 && now - st.st_mtime > STAGE_MAX_AGE)
+      unlink(path);
+  }
+  closedir(d);
+}
+
+long stage_open(const char *dir, long size) {
+  if (size < 0)
+    return -1;
+  mkdir(dir, 0777);
+  stage_reap(dir);
+  char path[PATH_MAX];
+  for (int tries = 0; tries < 4; tries++) {
+    uint64_t id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+      return -1;
+    // positive, so it travels as a size and 0 can mean failure
+    id &= 0x3fffffffffffffffULL;
+    if (id == 0)
+      continue;
+    stage_path(path, sizeof(path), dir, (long)id);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      if (errno == EEXIST)
+        continue;
+      return -1;
+    }
+    int err = size > 0 ? posix_fallocate(fd, 0, size) : 0;
+    close(fd);
+    if (err != 0) {
+      unlink(path);
+      return -1;
+    }
+    return (long)id;
+  }
+  return -1;
+}
+
+int stage_part(const char *dir, long id, int sock, long off, long len) {
+  char path[PATH_MAX];
+  stage_path(path, sizeof(path), dir, id);
+  int fd = id > 0 ? open(path, O_WRONLY) : -1;
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || off < 0 || len < 0 ||
+      off > st.st_size - len) {
+    if (fd >= 0)
+      close(fd);
+    // keep the connection in step: the part is on its way regardless
+    char buf[CHUNK_SIZE];
+    while (len > 0) {
+      long chunk = (len > CHUNK_SIZE) ? CHUNK_SIZE : len;
+      if (recv_all(sock, buf, chunk) < 0)
+        return -2;
+      len -= chunk;
+    }
+    return -1;
+  }
+  int rc = recv_file(sock, fd, off, len);
+  close(fd);
+  return rc < 0 ? -2 : 0;
+}
+
+long stage_commit(const char *dir, long id, const char *dest,
+                  const char *store, uint32_t *crc) {
+  char path[PATH_MAX];
+  stage_path(path, sizeof(path), dir, id);
+  struct stat st;
+  if (id <= 0 || stat(path, &st) < 0)
+    return -1;
+  if (store) {
+    struct dedup_stats ds;
+    int rc = dedup_store(store, -1, path, st.st_size, dest, 0, &ds);
+    unlink(path);
+    if (rc < 0)
+      return -1;
+    dedup_report(store, &ds);
+    if (crc)
+      *crc = ds.crc;
+    return st.st_size;
+  }
+  // the parts came in any order, so the checksum is taken at the end
+  int fd = crc ? open(path, O_RDONLY) : -1;
+  if (fd >= 0 && file_crc(fd, crc) < 0)
+    *crc = 0;
+  if (fd >= 0)
+    close(fd);
+  if (replace_file(path, dest) != 0)
+    return -1;
+  return st.st_size;
+}
+
+// ---------------------------------------------------------------------------
+// dedup chunk store
+//
+// <store>/<xx>/<sha256 hex> holds one chunk: an 8 byte reference count
+// (network order) followed by the data, so sendfile can serve it from
+// offset CHUNK_HDR. Reference counts change under an flock on <store>/lock,
+// which makes them safe across forked children and pool threads alike.
+// <store>/stats keeps two counters over everything ever ingested: logical
+// bytes and bytes that were new to the store
+// <store>/dead holds replaced manifests that were still being read until
+// their readers are done, see manifest_replace()
+
+#define CHUNK_HDR 8
+#define CDC_MASK ((uint64_t)CDC_AVG - 1)
+#define CDC_BUF (4 * CDC_MAX)
+#define MANIFEST_MAGIC "W25DEDUP"
+// the extended attribute that makes a file a manifest
+#define MANIFEST_XATTR "user.w25.manifest"
+#define MANIFEST_MAX (64L * 1024 * 1024)
+
+// SHA-256 (FIPS 180-4). Hashing is most of the cost of an ingest, so x86
+// CPUs with the SHA extensions get their own block function
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_c(uint32_t *st, const unsigned char *p, size_t n) {
+  for (; n > 0; n--, p += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+      w[i] = get_be32(p + 4 * i);
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 =
+          ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 =
+          ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = st[0], b = st[1], c = st[2], d = st[3];
+    uint32_t e = st[4], f = st[5], g = st[6], h = st[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+                    ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    st[0] += a;
+    st[1] += b;
+    st[2] += c;
+    st[3] += d;
+    st[4] += e;
+    st[5] += f;
+    st[6] += g;
+    st[7] += h;
+  }
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// four rounds per step; the state lives as ABEF/CDGH pairs the way
+// sha256rnds2 wants it, the message schedule in a ring of four vectors
+__attribute__((target("sha,sse4.1"))) static void
+sha256_blocks_ni(uint32_t *st, const unsigned char *p, size_t n) {
+  const __m128i bswap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)st), 0xb1);
+  __m128i s1 =
+      _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(st + 4)), 0x1b);
+  __m128i s0 = _mm_alignr_epi8(t, s1, 8);
+  s1 = _mm_blend_epi16(s1, t, 0xf0);
+  for (; n > 0; n--, p += 64) {
+    __m128i abef = s0, cdgh = s1;
+    __m128i w[4];
+    for (int i = 0; i < 16; i++) {
+      __m128i m;
+      if (i < 4) {
+        m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)),
+                             bswap);
+      } else {
+        m = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+        m = _mm_add_epi32(m, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+        m = _mm_sha256msg2_epu32(m, w[(i + 3) & 3]);
+      }
+      w[i & 3] = m;
+      __m128i k = _mm_add_epi32(
+          m, _mm_loadu_si128((const __m128i *)(sha256_k + 4 * i)));
+      s1 = _mm_sha256rnds2_epu32(s1, s0, k);
+      s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(k, 0x0e));
+    }
+    s0 = _mm_add_epi32(s0, abef);
+    s1 = _mm_add_epi32(s1, cdgh);
+  }
+  t = _mm_shuffle_epi32(s0, 0x1b);
+  s1 = _mm_shuffle_epi32(s1, 0xb1);
+  _mm_storeu_si128((__m128i *)st, _mm_blend_epi16(t, s1, 0xf0));
+  _mm_storeu_si128((__m128i *)(st + 4), _mm_alignr_epi8(s1, t, 8));
+}
+#endif
+
+static void (*sha256_blocks)(uint32_t *, const unsigned char *, size_t) =
+    sha256_blocks_c;
+
+static void sha256(const void *data, size_t len, unsigned char out[32]) {
+  uint32_t st[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  const unsigned char *p = (const unsigned char *)data;
+  sha256_blocks(st, p, len / 64);
+  p += len & ~(size_t)63;
+  // padding: 0x80, zeros, bit length in the last 8 bytes
+  unsigned char tail[128];
+  size_t rest = len & 63;
+  size_t tlen = rest < 56 ? 64 : 128;
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, p, rest);
+  tail[rest] = 0x80;
+  put_be64(tail + tlen - 8, (uint64_t)len * 8);
+  sha256_blocks(st, tail, tlen / 64);
+  for (int i = 0; i < 8; i++)
+    put_be32(out + 4 * i, st[i]);
+}
+
+// gear table for the rolling hash, the same on every run and every server
+static uint64_t cdc_gear[256];
+static pthread_once_t dedup_once = PTHREAD_ONCE_INIT;
+
+static void dedup_init(void) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sha"))
+    sha256_blocks = sha256_blocks_ni;
+#endif
+  // splitmix64
+  uint64_t x = 0x57323550;
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    cdc_gear[i] = z ^ (z >> 31);
+  }
+}
+
+// length of the next chunk of p[0..n). eof: nothing follows p[n - 1]
+static size_t cdc_cut(const unsigned char *p, size_t n, int eof) {
+  if (n <= CDC_MIN)
+    return eof ? n : 0;
+  size_t end = n < CDC_MAX ? n : CDC_MAX;
+  uint64_t h = 0;
+  for (size_t i = CDC_MIN; i < end; i++) {
+    h = (h << 1) + cdc_gear[p[i]];
+    if ((h & CDC_MASK) == 0)
+      return i + 1;
+  }
+  if (end == CDC_MAX || eof)
+    return end;
+  return 0; // need more data to find the boundary
+}
+
+static void chunk_path(char *path, size_t n, const char *store,
+                       const unsigned char hash[32]) {
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+    sprintf(hex + 2 * i, "%02x", hash[i]);
+  if (snprintf(path, n, "%s/%.2s/%s", store, hex, hex) >= (int)n)
+    path[0] = '\0';
+}
+
+static int store_lock(const char *store) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/lock", store);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd >= 0 && flock(fd, LOCK_EX) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// add a reference to a chunk, writing it if the store does not have it.
+// Called with the store locked. Returns 1 if the chunk was new, 0 if it
+// was there already, -1 on error
+static int chunk_ref(const char *store, const unsigned char hash[32],
+                     const void *data, size_t len) {
+  char path[PATH_MAX];
+  chunk_path(path, sizeof(path), store, hash);
+  unsigned char hdr[CHUNK_HDR];
+  int fd = open(path, O_RDWR);
+  if (fd >= 0) {
+    int rc = -1;
+    if (pread(fd, hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+      put_be64(hdr, get_be64(hdr) + 1);
+      if (pwrite(fd, hdr, sizeof(hdr), 0) == sizeof(hdr))
+        rc = 0;
+    }
+    close(fd);
+    return rc;
+  }
+  // new chunk: write it aside and rename, a crash never leaves half a chunk
+  char tmp[PATH_MAX + 8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 && errno == ENOENT) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0777);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+  if (fd < 0)
+    return -1;
+  put_be64(hdr, 1);
+  struct iovec iov[2] = {{hdr, sizeof(hdr)}, {(void *)data, len}};
+  ssize_t w = writev(fd, iov, 2);
+  close(fd);
+  if (w != (ssize_t)(sizeof(hdr) + len) || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 1;
+}
+
+// drop a reference, the last one removes the chunk. Store locked
+static void chunk_unref(const char *store, const unsigned char hash[32]) {
+  char path[PATH_MAX];
+  chunk_path(path, sizeof(path), store, hash);
+  unsigned char hdr[CHUNK_HDR];
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+    return;
+  if (pread(fd, hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+    uint64_t refs = get_be64(hdr);
+    if (refs <= 1) {
+      unlink(path);
+    } else {
+      put_be64(hdr, refs - 1);
+      if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+        perror("chunk_unref");
+    }
+  }
+  close(fd);
+}
+
+struct manifest_entry {
+  unsigned char hash[32];
+  long off; // offset of the chunk in the file
+  long len;
+};
+
+struct manifest {
+  char store[PATH_MAX];
+  long size;
+  long n;
+  struct manifest_entry *e;
+};
+
+const char *chunk_store;
+
+// on disk: magic(8) store name length(2) store name, size(8) count(8),
+// then count times hash(32) length(4), all numbers in network order. The
+// store name is what dedup_store() was given, reads go to chunk_store
+struct manifest *manifest_load(int fd) {
+  char magic[8];
+  struct stat st;
+  if (!chunk_store || fgetxattr(fd, MANIFEST_XATTR, NULL, 0) < 0 ||
+      pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+      memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) != 0 || fstat(fd, &st) < 0 ||
+      st.st_size > MANIFEST_MAX)
+    return NULL;
+  unsigned char *buf = (unsigned char *)malloc(st.st_size);
+  struct manifest *m = (struct manifest *)calloc(1, sizeof(*m));
+  if (!buf || !m || pread(fd, buf, st.st_size, 0) != st.st_size)
+    goto bad;
+  size_t len = st.st_size;
+  size_t pos = 8;
+  if (len < pos + 2)
+    goto bad;
+  size_t slen = get_be16(buf + pos);
+  pos += 2;
+  if (len < pos + slen + 16 ||
+      (size_t)snprintf(m->store, sizeof(m->store), "%s", chunk_store) >=
+          sizeof(m->store))
+    goto bad;
+  pos += slen;
+  m->size = (long)get_be64(buf + pos);
+  m->n = (long)get_be64(buf + pos + 8);
+  pos += 16;
+  if (m->n < 0 || (len - pos) / 36 != (size_t)m->n || (len - pos) % 36)
+    goto bad;
+  m->e = (struct manifest_entry *)malloc((m->n ? m->n : 1) * sizeof(*m->e));
+  if (!m->e)
+    goto bad;
+  long off = 0;
+  for (long i = 0; i < m->n; i++, pos += 36) {
+    memcpy(m->e[i].hash, buf + pos, 32);
+    m->e[i].off = off;
+    m->e[i].len = get_be32(buf + pos + 32);
+    off += m->e[i].len;
+  }
+  if (off != m->size)
+    goto bad;
+  free(buf);
+  return m;
+bad:
+  free(buf);
+  manifest_free(m);
+  return NULL;
+}
+
+void manifest_free(struct manifest *m) {
+  if (m) {
+    free(m->e);
+    free(m);
+  }
+}
+
+long manifest_size(const struct manifest *m) { return m->size; }
+
+int manifest_send(const struct manifest *m, int sock, long off, long len) {
+  if (len <= 0)
+    return 0;
+  // first chunk of the range
+  long lo = 0, hi = m->n;
+  while (hi - lo > 1) {
+    long mid = (lo + hi) / 2;
+    if (m->e[mid].off <= off)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  // a range across chunks is several sendfile calls. Cork them into full
+  // segments, or a short tail waits behind Nagle for the peer's delayed ack
+  int one = 1, zero = 0;
+  int cork = off + len > m->e[lo].off + m->e[lo].len &&
+             setsockopt(sock, IPPROTO_TCP, TCP_CORK, &one, sizeof(one)) == 0;
+  char path[PATH_MAX];
+  int rc = 0;
+  for (long i = lo; rc == 0 && len > 0 && i < m->n; i++) {
+    const struct manifest_entry *e = &m->e[i];
+    long skip = off > e->off ? off - e->off : 0;
+    long part = e->len - skip < len ? e->len - skip : len;
+    chunk_path(path, sizeof(path), m->store, e->hash);
+    int fd = open(path, O_RDONLY);
+    rc = fd < 0 ? -1 : send_file(sock, fd, CHUNK_HDR + skip, part);
+    if (fd >= 0)
+      close(fd);
+    len -= part;
+  }
+  if (cork)
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+  return rc < 0 || len > 0 ? -1 : 0;
+}
+
+static int manifest_tar(struct tar_stream *t, const struct manifest *m) {
+  char path[PATH_MAX];
+  for (long i = 0; i < m->n; i++) {
+    chunk_path(path, sizeof(path), m->store, m->e[i].hash);
+    int fd = open(path, O_RDONLY);
+    int rc = tar_file_data(t, fd, CHUNK_HDR, m->e[i].len);
+    if (fd >= 0)
+      close(fd);
+    if (rc < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int manifest_crc(const struct manifest *m, uint32_t *crc) {
+  char path[PATH_MAX];
+  char buf[64 * 1024];
+  uint32_t c = 0;
+  for (long i = 0; i < m->n; i++) {
+    chunk_path(path, sizeof(path), m->store, m->e[i].hash);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return -1;
+    long off = CHUNK_HDR, left = m->e[i].len;
+    while (left > 0) {
+      size_t want = left < (long)sizeof(buf) ? (size_t)left : sizeof(buf);
+      ssize_t n = pread(fd, buf, want, off);
+      if (n <= 0) {
+        close(fd);
+        return -1;
+      }
+      c = crc32c(c, buf, n);
+      off += n;
+      left -= n;
+    }
+    close(fd);
+  }
+  *crc = c;
+  return 0;
+}
+
+// drop the chunk references of a manifest. Store locked
+static void manifest_unref(const struct manifest *m) {
+  for (long i = 0; i < m->n; i++)
+    chunk_unref(m->store, m->e[i].hash);
+}
+
+// release the manifests parked in <store>/dead whose last reader is gone.
+// Store locked
+static void store_sweep(const char *store) {
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/dead", store);
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  struct dirent *dd;
+  while ((dd = readdir(d))) {
+    if (dd->d_name[0] == '.')
+      continue;
+    char path[PATH_MAX + 256];
+    snprintf(path, sizeof(path), "%s/%s", dir, dd->d_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      struct manifest *m = manifest_load(fd);
+      if (m)
+        manifest_unref(m);
+      manifest_free(m);
+      unlink(path);
+    }
+    close(fd);
+  }
+  closedir(d);
+}
+
+// rename src over dest, or remove dest when src is NULL, and release the
+// chunks of the manifest dest was. Opening the old manifest, taking it
+// out of the tree and dropping its references all happen under the store
+// lock, so two STOREs to one path never release the same manifest twice.
+// A manifest someone still reads (see open_stored()) keeps its chunks: it
+// is parked in <store>/dead and released by a later store_sweep()
+static int manifest_replace(const char *src, const char *dest) {
+  int lock = chunk_store ? store_lock(chunk_store) : -1;
+  if (lock < 0)
+    return src ? rename(src, dest) : remove(dest);
+  store_sweep(chunk_store);
+  int old = open(dest, O_RDONLY | O_CLOEXEC);
+  struct manifest *m = old >= 0 ? manifest_load(old) : NULL;
+  char dead[PATH_MAX + 32] = "";
+  int busy = m && flock(old, LOCK_EX | LOCK_NB) < 0;
+  if (busy) {
+    struct stat st;
+    snprintf(dead, sizeof(dead), "%s/dead", chunk_store);
+    mkdir(dead, 0777);
+    // the inode number is unique as long as the link keeps the inode
+    if (fstat(old, &st) < 0 ||
+        snprintf(dead, sizeof(dead), "%s/dead/%lu", chunk_store,
+                 (unsigned long)st.st_ino) >= (int)sizeof(dead) ||
+        link(dest, dead) < 0)
+      dead[0] = '\0'; // cannot park it: its chunks leak, which is safe
+  }
+  int rc = src ? rename(src, dest) : remove(dest);
+  if (m && rc != 0 && dead[0])
+    unlink(dead);
+  else if (m && rc == 0 && !busy)
+    manifest_unref(m);
+  manifest_free(m);
+  if (old >= 0)
+    close(old);
+  close(lock);
+  return rc;
+}
+
+int replace_file(const char *src, const char *dest) {
+  return manifest_replace(src, dest);
+}
+
+int open_stored(const char *path) {
+  // open() and flock() under the store lock: manifest_replace() either
+  // sees this reader or has already taken the file out of the tree
+  int lock = chunk_store ? store_lock(chunk_store) : -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0 && lock >= 0)
+    flock(fd, LOCK_SH);
+  if (lock >= 0)
+    close(lock);
+  return fd;
+}
+
+int install_file(const char *src, const char *dest, int keep) {
+  if (!keep)
+    return replace_file(src, dest);
+  // link() fails where rename() would replace dest, and does so atomically
+  if (link(src, dest) == 0) {
+    unlink(src);
+    return 0;
+  }
+  return errno == EEXIST ? 1 : -1;
+}
+
+int open_temp(const char *path, char *tmp, size_t n) {
+  if ((size_t)snprintf(tmp, n, "%s.tmpXXXXXX", path) >= n) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = mkostemp(tmp, O_CLOEXEC);
+  // mkostemp() makes it 0600, stored files are 0644 like the rest
+  if (fd >= 0 && fchmod(fd, 0644) < 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  return fd;
+}
+
+int is_temp_name(const char *name) {
+  // "<name>.tmpXXXXXX", the X being what mkostemp() puts there
+  size_t n = strlen(name);
+  if (n < 10 || memcmp(name + n - 10, ".tmp", 4) != 0)
+    return 0;
+  for (size_t i = n - 6; i < n; i++)
+    if (!isalnum((unsigned char)name[i]))
+      return 0;
+  return 1;
+}
+
+int dedup_remove(const char *path) { return manifest_replace(NULL, path); }
+
+// read exactly n bytes from a socket or a file
+static int ingest_read(int fd, int is_sock, void *buf, size_t n) {
+  if (is_sock)
+    return recv_all(fd, buf, n);
+  char *p = (char *)buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+static void store_stats(const char *store, struct dedup_stats *st) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/stats", store);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return;
+  unsigned char buf[16];
+  memset(buf, 0, sizeof(buf));
+  if (pread(fd, buf, sizeof(buf), 0) < 0)
+    memset(buf, 0, sizeof(buf));
+  st->total_in = (long)get_be64(buf) + st->in;
+  st->total_new = (long)get_be64(buf + 8) + st->new_bytes;
+  put_be64(buf, st->total_in);
+  put_be64(buf + 8, st->total_new);
+  if (pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf))
+    perror("store_stats");
+  close(fd);
+}
+
+int dedup_store(const char *store, int sock, const char *src, long len,
+                const char *dest, int keep, struct dedup_stats *st) {
+  pthread_once(&dedup_once, dedup_init);
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  memset(st, 0, sizeof(*st));
+  mkdir(store, 0777);
+
+  int in = sock;
+  if (sock < 0 && (in = open(src, O_RDONLY)) < 0)
+    return -1;
+  // the manifest is written next to dest and renamed over it at the end
+  char tmp[PATH_MAX + 16];
+  int out = open_temp(dest, tmp, sizeof(tmp));
+  unsigned char *buf = (unsigned char *)malloc(CDC_BUF);
+  // a file that cannot be stored is still read to the end, so the
+  // connection stays in step
+  int rc = (out < 0 || !buf ||
+            fsetxattr(out, MANIFEST_XATTR, "1", 1, 0) < 0) ? -1 : 0;
+
+  size_t slen = strlen(store);
+  unsigned char hdr[8 + 2 + PATH_MAX + 16];
+  memcpy(hdr, MANIFEST_MAGIC, 8);
+  put_be16(hdr + 8, slen);
+  memcpy(hdr + 10, store, slen);
+  put_be64(hdr + 10 + slen, len);
+  // the chunk count is filled in at the end
+  size_t hlen = 10 + slen + 16;
+  if (rc == 0 && pwrite(out, hdr, hlen, 0) != (ssize_t)hlen)
+    rc = -1;
+  off_t mpos = hlen;
+
+  long left = len;
+  size_t fill = 0;
+  char discard[CHUNK_SIZE];
+  while (left > 0 || fill > 0) {
+    if (!buf) {
+      // nowhere to put it, just drain
+      size_t want = left > CHUNK_SIZE ? CHUNK_SIZE : (size_t)left;
+      if (ingest_read(in, sock >= 0, discard, want) < 0)
+        break;
+      left -= want;
+      continue;
+    }
+    // top the buffer up once less than a full chunk is left in it
+    if (fill < CDC_MAX && left > 0) {
+      size_t want = CDC_BUF - fill;
+      if ((long)want > left)
+        want = left;
+      if (ingest_read(in, sock >= 0, buf + fill, want) < 0) {
+        rc = -1;
+        left = 0;
+        break;
+      }
+      fill += want;
+      left -= want;
+    }
+    // the store is locked for the chunks of one buffer at a time, other
+    // STOREs and removals do not wait while the data comes in
+    size_t pos = 0;
+    int lock = -1;
+    while (pos < fill) {
+      size_t n = cdc_cut(buf + pos, fill - pos, left == 0);
+      if (n == 0)
+        break;
+      if (rc == 0 && lock < 0 && (lock = store_lock(store)) < 0)
+        rc = -1;
+      if (rc == 0) {
+        unsigned char ent[36];
+        sha256(buf + pos, n, ent);
+        put_be32(ent + 32, n);
+        int fresh = chunk_ref(store, ent, buf + pos, n);
+        if (fresh < 0 || pwrite(out, ent, sizeof(ent), mpos) != sizeof(ent)) {
+          rc = -1;
+        } else {
+          mpos += sizeof(ent);
+          st->chunks++;
+          if (fresh) {
+            st->new_chunks++;
+            st->new_bytes += n;
+          }
+        }
+      }
+      st->in += n;
+      st->crc = crc32c(st->crc, buf + pos, n);
+      pos += n;
+    }
+    if (lock >= 0)
+      close(lock);
+    memmove(buf, buf + pos, fill - pos);
+    fill -= pos;
+  }
+  if (left > 0)
+    rc = -1;
+
+  if (rc == 0) {
+    put_be64(hdr, st->chunks);
+    if (pwrite(out, hdr, 8, 10 + slen + 8) != 8)
+      rc = -1;
+  }
+  int lock = rc == 0 ? store_lock(store) : -1;
+  if (lock >= 0) {
+    store_stats(store, st);
+    close(lock);
+  }
+  free(buf);
+  if (sock < 0)
+    close(in);
+  int kept = 0;
+  if (rc == 0 && (kept = install_file(tmp, dest, keep)) < 0)
+    rc = -1;
+  if ((rc < 0 || kept) && out >= 0) {
+    // give back the references taken so far, all of them if dest was kept.
+    // The hashes are read back from the entries written, the size in the
+    // header is still the full upload
+    if ((lock = store_lock(store)) >= 0) {
+      unsigned char ent[36];
+      for (off_t pos = hlen; pos < mpos; pos += sizeof(ent))
+        if (pread(out, ent, sizeof(ent), pos) == sizeof(ent))
+          chunk_unref(store, ent);
+      close(lock);
+    }
+    unlink(tmp);
+  }
+  if (out >= 0)
+    close(out);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  st->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  return rc < 0 ? -1 : kept;
+}
+
+void dedup_report(const char *store, const struct dedup_stats *st) {
+  double mb = st->in / 1e6;
+  printf("dedup %s: %ld bytes, %ld new in %ld/%ld chunks, %.1f MB/s; "
+         "store ratio %.2fx (%ld of %ld bytes)\n",
+         store, st->in, st->new_bytes, st->new_chunks, st->chunks,
+         st->secs > 0 ? mb / st->secs : 0.0,
+         st->total_new > 0 ? (double)st->total_in / st->total_new : 1.0,
+         st->total_new, st->total_in);
+  fflush(stdout);
 }
@@ -1,6 +1,11 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+// needed for accept4, splice, sendfile and friends
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +20,10 @@
 #include <errno.h>
 #include <netinet/in.h>
 #include <dirent.h>
+#include <limits.h>
+
+// buffer size for the copy loops in utils.c
+#define CHUNK_SIZE 4096
 
 
 int send_all(int sock, const void *buf, size_t len);
@@ -27,4 +36,477 @@ char* recv_string(int sock);
 
 void create_dirs_if_needed(const char* path);
 
+int set_nonblocking(int fd, int on);
+
+// deadlines, so a stalled or vanished peer cannot hold a process, its
+// descriptors and half a file forever. Each server takes --io-timeout SEC,
+// --min-rate KB and --idle-timeout SEC, 0 turns the check off:
+// - sock_deadlines() makes a send or receive that gets nowhere for
+//   io_timeout seconds fail
+// - a request started with io_begin() fails once it has spent io_timeout
+//   seconds waiting on sockets and moved less than io_min_rate bytes for
+//   every second of it. Time the server works on its own does not count
+// - recv_request() waits idle_timeout seconds at most for the next request,
+//   the worker pool and S1's reactor close connections parked for longer
+#define IO_TIMEOUT_SEC 30
+#define IO_MIN_RATE 4096
+#define IDLE_TIMEOUT_SEC 300
+extern int io_timeout;
+extern long io_min_rate;
+extern int idle_timeout;
+void sock_deadlines(int fd);
+void io_begin(void);
+
+// ---------------------------------------------------------------------------
+// protocol v2
+//
+// Every message starts with a fixed header, all fields in network order:
+//   magic(4) version(1) opcode(1) flags(2) request id(4) payload length(8)
+// A v2 peer opens the connection with OP_HELLO. Request payloads are a list
+// of fields, each a 2 byte length followed by the bytes; strings go out with
+// their terminating NUL so the parser can hand out pointers into its buffer
+// without copying or allocating. Bulk data (file contents, archives,
+// listings) is the payload of an OP_DATA frame carrying the request id of
+// the request it answers.
+//
+// Legacy peers send length-prefixed strings ("uploadf a b", "STORE", ...).
+// The first 4 bytes tell them apart: no legacy string is long enough for
+// its length to read as the magic
+#define PROTO_MAGIC 0x57323550u // "W25P"
+#define PROTO_VERSION 2
+#define FRAME_HDR_LEN 20
+
+enum {
+  OP_HELLO = 1,
+  OP_DATA,
+  OP_STREAM, // multiplexed stream data, see mux_serve()
+  OP_WINDOW, // flow control credit for a stream, in the length field
+  // client -> S1
+  OP_UPLOADF = 16,
+  OP_DOWNLF,
+  OP_REMOVEF,
+  OP_DOWNLTAR,
+  OP_DISPFNAMES,
+  OP_UPLOAD_OPEN, // multipart upload, see stage_open()
+  OP_UPLOAD_PART,
+  OP_UPLOAD_COMMIT,
+  // S1 -> storage servers
+  OP_STORE = 32,
+  OP_GET,
+  OP_REMOVE,
+  OP_TAR,
+  OP_LIST,
+  OP_OPEN,
+  OP_PART,
+  OP_COMMIT,
+  OP_DUMP, // catalog records of a storage server, see dir_index_dump()
+};
+
+// OP_DATA flag: the length is 0 and a chunk stream follows (see TAR_CHUNKED)
+#define FRAME_CHUNKED 0x0001
+// OP_STREAM flag: the sender will not write to this stream any more
+#define FRAME_END 0x0002
+// OP_HELLO flag: multiplex streams over this connection from now on
+#define HELLO_MUX 0x0001
+// OP_DATA flag: answer to a byte range request, see conn_send_range()
+#define FRAME_RANGE 0x0004
+// OP_HELLO flag: the client can take compressed data frames
+#define HELLO_LZ 0x0002
+// request flag: the reply may be compressed. OP_DATA flag: it is, see
+// conn_send_data()
+#define FRAME_LZ 0x0008
+
+struct frame {
+  uint8_t version; // 0 for a legacy request
+  uint8_t opcode;
+  uint16_t flags;
+  uint32_t reqid;
+  uint64_t len;
+};
+
+void frame_encode(unsigned char *hdr, const struct frame *f);
+// -1 if hdr is not a v2 header
+int frame_decode(const unsigned char *hdr, struct frame *f);
+int send_frame(int sock, int opcode, int flags, uint32_t reqid, uint64_t len);
+int recv_frame(int sock, struct frame *f);
+uint32_t proto_next_id(void);
+
+// a request parsed in place: arg[i] points into buf
+#define REQ_MAX_ARGS 8
+#define REQ_MAX_LEN 8192
+
+struct request {
+  struct frame f;
+  int nargs;
+  char *arg[REQ_MAX_ARGS];
+  uint16_t arglen[REQ_MAX_ARGS];
+  char buf[REQ_MAX_LEN + 1];
+};
+
+// string argument i, NULL if missing
+const char *request_str(const struct request *r, int i);
+// 64-bit argument i, -1 if missing
+int request_u64(const struct request *r, int i, uint64_t *v);
+
+// legacy command names the server accepts. The command string is split on
+// spaces; arguments that are not in it follow as strings of their own (the
+// way S1 talks to the storage servers)
+struct legacy_cmd {
+  const char *name;
+  int opcode;
+  int nargs;
+};
+
+// one request's view of its connection: replies go out in the framing the
+// request came in, tagged with its request id. lz: the peer takes
+// compressed data; packed: the data frame just received is compressed
+struct conn {
+  int fd;
+  int v2;
+  uint32_t reqid;
+  int lz;
+  int packed;
+};
+
+// read the next request in whichever framing the peer uses, and start its
+// io_begin() clock. Returns -1 on EOF, error, a malformed/unknown request
+// or if none started within idle_timeout
+int recv_request(int sock, struct conn *c, struct request *r,
+                 const struct legacy_cmd *cmds);
+// second half of recv_request, for callers that read the header (4 bytes
+// legacy, FRAME_HDR_LEN v2) and the payload into r->buf themselves
+int request_finish(struct conn *c, struct request *r,
+                   const struct legacy_cmd *cmds);
+
+// building v2 requests
+struct reqbuf {
+  size_t len;
+  char buf[REQ_MAX_LEN];
+};
+void reqbuf_init(struct reqbuf *b);
+int reqbuf_str(struct reqbuf *b, const char *s);
+int reqbuf_u64(struct reqbuf *b, uint64_t v);
+int send_request(int sock, int opcode, int flags, uint32_t reqid,
+                 const struct reqbuf *b);
+// a request followed by len bytes of data (an OP_DATA frame), which the
+// caller sends next. Request and data header go out together and wait for
+// the data, so a small upload does not stall behind Nagle
+int send_request_data(int sock, int opcode, uint32_t reqid,
+                      const struct reqbuf *b, uint64_t len);
+
+// reply helpers, 0 on success
+int conn_send_size(struct conn *c, long size);
+// a number that is the whole answer (upload ids, byte counts): the same
+// header as conn_send_size() but sent right away, as no data follows
+int conn_send_value(struct conn *c, long v);
+int conn_send_chunked(struct conn *c);
+int conn_send_blob(struct conn *c, const char *data, size_t len);
+// read a size header in either framing. chunked may be NULL when a chunk
+// stream is not a valid answer
+int conn_recv_size(struct conn *c, long *size, int *chunked);
+// read a whole size + data reply (listings), NUL terminated, its length in
+// *len unless len is NULL. Caller frees
+char *conn_recv_blob(struct conn *c, size_t *len);
+
+// byte ranges. OP_DOWNLF and OP_GET take an optional offset and length
+// (u64 fields after the path, length 0 meaning up to the end of the file).
+// The answer is an OP_DATA frame flagged FRAME_RANGE whose payload is the
+// total size of the file (8 bytes) followed by the n bytes of the range;
+// a missing file is the usual 0 size. range_len() clamps a range to a file
+long range_len(long total, long off, long len);
+int conn_send_range(struct conn *c, long total, long n);
+// reads either answer: total is 0 for a missing file, n the data that follows
+int conn_recv_range(struct conn *c, long *total, long *n);
+
+// bulk data in either direction, compressed when the peer agreed to it.
+// conn_send_data() sends the size header and n bytes from the file src at
+// off, or from the socket src when off < 0; with range >= 0 it is a byte
+// range reply for a file of range bytes. The data is compressed when c->lz
+// is set and the first block shrinks by at least an eighth, otherwise it
+// goes out as it is. conn_recv_data() takes the n bytes that follow a size
+// header into the file dst at off, the socket dst when off < 0, or nowhere
+// when dst < 0. 0 on success, -1 if c broke, -2 if dst failed (the data
+// was still read off c)
+#define LZ_BLOCK (64 * 1024)
+int conn_send_data(struct conn *c, long range, int src, long off, long n);
+int conn_recv_data(struct conn *c, int dst, long off, long n);
+// the same data to ndst sockets at once. A socket that fails is set to -1
+// in dst and the others go on; -2 then, -1 if c broke
+int conn_recv_fanout(struct conn *c, int *dst, int ndst, long n);
+
+// stream multiplexing. After a HELLO that both sides flagged HELLO_MUX the
+// connection carries independent byte streams, each one looking like a
+// connection of its own (one end of a socketpair) to the code using it.
+// Streams are interleaved in frames of at most MUX_FRAME_MAX bytes and
+// every stream may have at most MUX_WINDOW unacknowledged bytes in flight
+#define MUX_FRAME_MAX (64 * 1024)
+#define MUX_WINDOW (256 * 1024)
+#define MUX_MAX_STREAMS 64
+
+// serve a multiplexed connection until the peer goes away. Every stream the
+// peer opens is handed to handler on a thread of its own; handler owns fd
+int mux_serve(int sock, void (*handler)(int fd));
+// client side: run the engine on a thread of its own and open streams with
+// mux_open(), which returns our end of the stream or -1
+struct mux;
+struct mux *mux_client(int sock);
+int mux_open(struct mux *m);
+// close a stream from mux_open() and wait until the peer has finished it, so
+// everything written to it got through. mux_drain() waits the same way for
+// all streams and for the engine to hand its last frames to the socket;
+// call it before the connection goes away
+void mux_close(struct mux *m, int fd);
+void mux_drain(struct mux *m);
+
+// serves one command on connfd, returns -1 when the connection should be
+// closed
+typedef int (*conn_handler)(int connfd);
+
+// run the work-stealing pool on an already listening socket, never returns.
+// nworkers < 1 means one per online core, pin binds worker i to core i
+void run_worker_pool(int listenfd, int nworkers, int pin,
+                     conn_handler handler);
+
+// io_uring backend for bulk storage transfers. uring_probe() checks once at
+// startup whether the kernel lets us use it; the servers keep their stdio
+// loops when it does not. uring_ready() tells whether this thread can use
+// it right now: it sets up the thread's ring on first use, which can still
+// fail (eg. a child over its RLIMIT_MEMLOCK), and the stdio loops take over
+// then. Both transfer functions return 0 on success and -1 on error.
+// uring_recv_to_file() carries the CRC-32C of the data on in *crc unless
+// crc is NULL
+extern int uring_enabled;
+int uring_probe(void);
+int uring_ready(void);
+int uring_recv_to_file(int sock, int fd, long start, long len, uint32_t *crc);
+int uring_file_to_sock(int fd, int sock, long start, long len);
+
+// zero-copy file -> socket transfer (sendfile with fallbacks), 0 on success
+int send_file(int sock, int fd, long offset, long len);
+// the other way: len bytes off sock written at offset (io_uring when it is
+// enabled, recv + pwrite otherwise), 0 on success
+#define RECV_FILE_BUF (64 * 1024)
+int recv_file(int sock, int fd, long offset, long len);
+
+// forward exactly len bytes between two sockets without pulling them into
+// user space (splice, falling back to MSG_ZEROCOPY), 0 on success. Never
+// holds more than RELAY_PIPE_SIZE bytes in flight
+#define RELAY_PIPE_SIZE (1024 * 1024)
+int relay(int from, int to, long len);
+
+// tar archives are streamed as they are built, so their size is not known
+// when the reply starts. The size string is then TAR_CHUNKED (in v2 an
+// OP_DATA frame flagged FRAME_CHUNKED) and the data follows as chunks:
+// 4 byte length (network order) + bytes, ended by a zero length chunk
+#define TAR_CHUNKED "-1"
+int tar_stream_dir(int sock, const char *dir);
+int relay_chunked(int from, int to);
+
+// one of the archives tar_merge() reads: size bytes from fd (left), or a
+// chunk stream when chunked (left 0). done is set once it was read to its end
+struct tar_part {
+  int fd;
+  int chunked;
+  long left;
+  int done;
+};
+// the archives in parts as one chunked archive to sock (the chunk stream
+// only, the size header is up to the caller). Of the entries with the same
+// name only the first goes in. A part that breaks is cut short. 0 on
+// success, -1 if sock failed
+int tar_merge(struct tar_part *parts, int n, int sock);
+
+// cached archive of one folder, shared across forked children and threads.
+// Create it before forking, bump it on every change to the folder
+struct tar_cache;
+struct tar_cache *tar_cache_create(const char *dir);
+void tar_cache_bump(struct tar_cache *c);
+// reply to a TAR request (size header + data), 0 on success
+int tar_cache_serve(struct tar_cache *c, struct conn *conn);
+
+// CRC-32C of len bytes, continuing from crc (0 to start)
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+// CRC-32C of the file open on fd (the file a manifest stands for), 0 on
+// success
+int file_crc(int fd, uint32_t *crc);
+
+// what is known about a file. size is -1 for a folder, crc is the CRC-32C
+// of the content (0: not worked out yet) and node where S1 finds it
+struct file_meta {
+  long size;
+  long mtime;
+  uint32_t crc;
+  int node;
+};
+
+// sorted index of the files and folders below a storage server's folder
+// (path and file_meta), shared across forked children and threads like the
+// tar cache. Create it before forking; it scans the folder once. The
+// handlers tell it about every file they store and every path they
+// removed, as they are on disk. dir_index_list() answers a LIST of the
+// folder path from memory: a malloc'd string of up to limit sorted names
+// behind after (NULL: from the start), one per line, or NULL if the index
+// cannot answer it (ran full) and list_dir_page() has to read the folder
+// instead
+struct dir_index;
+struct dir_index *dir_index_create(const char *dir);
+long dir_index_count(struct dir_index *x);
+// a file was stored at path: size (< 0: take it from the file) and crc
+// of its content go into the index along with the folders on its way.
+// When c is a v2 connection the catalog record of the file is the answer
+// to the request (an empty one if the file is not there)
+int dir_index_stored(struct dir_index *x, struct conn *c, const char *path,
+                     long size, uint32_t crc);
+void dir_index_del(struct dir_index *x, const char *path);
+char *dir_index_list(struct dir_index *x, const char *path, const char *after,
+                     long limit, size_t *len);
+// OP_DUMP (after, limit): the answer is a page of catalog records for up to
+// limit entries, files and folders, behind the path after in index order
+// (empty: from the start). An empty page is the end. Checksums missing
+// from the index are worked out on the way. NULL if the index is broken
+char *dir_index_dump(struct dir_index *x, const char *after, long limit,
+                     size_t *len);
+void dir_index_free(struct dir_index *x);
+
+// S1's catalog: the file_meta of every file on every node (node 0 is S1
+// itself, the storage servers come after it), kept in memory like a
+// dir_index and on disk as a log plus snapshot at path, path.log. Open it
+// before forking. A node is synced once the catalog has all of its files;
+// catalog_sync() gets them from fetch, which returns the DUMP page behind
+// after (malloc'd, NULL on error); changes made while it pages go over
+// the DUMP at the end. After that S1 answers lookups and listings for the
+// node from the catalog, and tells it about every change:
+// catalog_recv() takes the record a storage server answered a store with,
+// catalog_put() and catalog_del() are for S1's own files.
+// catalog_synced() is 0 until the sync and again if the catalog ran full
+#define CATALOG_NODES 64
+struct catalog;
+typedef char *(*dump_page_fn)(void *arg, const char *after, size_t *len);
+struct catalog *catalog_open(const char *path);
+long catalog_count(struct catalog *k);
+int catalog_synced(struct catalog *k, int node);
+int catalog_sync(struct catalog *k, int node, dump_page_fn fetch, void *arg);
+int catalog_put(struct catalog *k, const char *path,
+                const struct file_meta *m);
+// the number of records in buf, -1 if it is damaged. m and path (n bytes,
+// either may be NULL) get the last one
+int catalog_recv(struct catalog *k, int node, const char *buf, size_t len,
+                 struct file_meta *m, char *path, size_t n);
+// walk the records of a DUMP page: the one at *off, which is moved past
+// it. 1 if it is a file (path, n bytes, and *m get it), 0 for anything
+// else and -1 at the end of buf, or if it is damaged (*off short of len)
+int catalog_next(const char *buf, size_t len, size_t *off, char *path,
+                 size_t n, struct file_meta *m);
+void catalog_del(struct catalog *k, const char *path);
+// 0 and *m if path is known (a file or folder), -1 if not
+int catalog_get(struct catalog *k, const char *path, struct file_meta *m);
+char *catalog_list(struct catalog *k, const char *path, const char *after,
+                   long limit, size_t *len);
+
+// listings come in pages. OP_LIST (path, limit, after) answers with up to
+// limit names of the folder that sort after after, one per line.
+// OP_DISPFNAMES (path, page, cursor) answers with the cursor for the next
+// page on the first line (empty after the last page), then up to page
+// names; clients hand the cursor back as they got it. Without the numbers both answer with a single page
+// of LIST_PAGE_MAX names, like the old protocol. Names sort by strcmp
+#define LIST_PAGE 1000
+#define LIST_PAGE_MAX 65536
+// the same page read from the folder itself: up to limit (<= 0: all) names
+// behind after that contain match (NULL: any), skipping hidden ones.
+// Holds no more than limit names at a time. NULL on error
+char *list_dir_page(const char *dir, const char *after, long limit,
+                    const char *match, size_t *len);
+
+// multipart uploads. OP_UPLOAD_OPEN (name, dest, size) answers with an
+// upload id as its size, then any number of connections send
+// OP_UPLOAD_PART (name, dest, id, offset) + an OP_DATA frame, each answered
+// with the number of bytes stored (0: rejected), and OP_UPLOAD_COMMIT
+// (name, dest, id) answers with the final size. name is the local file
+// name, which picks the server as for uploadf. S1 passes them on to the
+// storage servers as OP_OPEN (dest, size), OP_PART (dest, id, offset) and
+// OP_COMMIT (dest, id).
+//
+// A session is a staging file <dir>/<id>, preallocated to the final size.
+// Parts are written into it at their offsets from any connection or
+// process, and commit renames it over the destination (same file system),
+// so nobody sees a half uploaded file. Sessions untouched for
+// STAGE_MAX_AGE seconds are removed by the next stage_open()
+#define STAGE_MAX_AGE (24 * 3600)
+// id > 0, -1 on error
+long stage_open(const char *dir, long size);
+// receive len bytes from sock into the session at off. -1 if the session
+// or range is bad (the data is read and dropped), -2 if sock broke
+int stage_part(const char *dir, long id, int sock, long off, long len);
+// final size, -1 on error. With a dedup store the file is chunked into it
+// and dest becomes its manifest, see dedup_store(). crc (unless NULL) gets
+// the CRC-32C of the file
+long stage_commit(const char *dir, long id, const char *dest,
+                  const char *store, uint32_t *crc);
+
+// content addressed chunk store (storage servers started with --dedup).
+// Files are cut into chunks at content defined boundaries (gear hash, CDC_MIN
+// to CDC_MAX bytes, CDC_AVG on average), every chunk is kept once in the
+// store under its SHA-256 and the file itself becomes a small manifest
+// listing its chunks. Reads never need to know whether dedup is on:
+// everything that serves a file (GET, ranges, TAR) checks for a manifest
+// with manifest_load() and streams the chunks. A manifest is told apart by
+// an extended attribute only dedup_store() sets, never by its content, so
+// an uploaded file cannot pass for one, and its chunks always come from
+// chunk_store. Chunks are reference counted, the last manifest to let go
+// removes them
+#define CDC_MIN (16 * 1024)
+#define CDC_AVG (64 * 1024)
+#define CDC_MAX (256 * 1024)
+
+struct dedup_stats {
+  long in;        // bytes ingested
+  long new_bytes; // of which were not in the store yet
+  long chunks;
+  long new_chunks;
+  long total_in; // the same over the life of the store
+  long total_new;
+  double secs;
+  uint32_t crc; // CRC-32C of the bytes ingested
+};
+
+// read len bytes (from sock, or from the file src when sock < 0) into the
+// store and make dest their manifest, replacing whatever dest was. 0 on
+// success; on error the data is still read to the end and dest is untouched.
+// With keep set a dest that exists stays as it is, which returns 1
+int dedup_store(const char *store, int sock, const char *src, long len,
+                const char *dest, int keep, struct dedup_stats *st);
+// one line about an ingest on stdout
+void dedup_report(const char *store, const struct dedup_stats *st);
+// rename() that releases the chunks of the manifest it replaces
+int replace_file(const char *src, const char *dest);
+// replace_file(), or with keep set one that leaves a dest that exists as
+// it is: 1 then, and src is still there
+int install_file(const char *src, const char *dest, int keep);
+// create a file of its own next to path for a new version of it, to go
+// over path with replace_file() once complete. Its name goes to tmp (n
+// bytes). The descriptor, -1 on error
+int open_temp(const char *path, char *tmp, size_t n);
+// 1 if name looks like one open_temp() made. Folder walks (TAR, LIST,
+// the index) skip those: a STORE in flight or one cut off by a crash
+int is_temp_name(const char *name);
+// remove() that releases the chunks of a manifest
+int dedup_remove(const char *path);
+// open a stored file for reading. A manifest opened this way keeps its
+// chunks until the descriptor is closed, even if it is replaced or
+// removed meanwhile
+int open_stored(const char *path);
+
+// the server's own store (its DEDUP_FOLDER), set at startup even without
+// --dedup so files stored by an earlier run stay readable. NULL: no file
+// is a manifest
+extern const char *chunk_store;
+
+struct manifest;
+// the manifest open on fd, NULL if fd is an ordinary file
+struct manifest *manifest_load(int fd);
+long manifest_size(const struct manifest *m);
+// send len bytes of the file from off, 0 on success
+int manifest_send(const struct manifest *m, int sock, long off, long len);
+void manifest_free(struct manifest *m);
+
 #endif
@@ -1,253 +1,860 @@
 #include "utils.h"
+#include <pthread.h>
+#include <time.h>
 
 #define S1_HOST "127.0.0.1"
 #define S1_PORT 5001
+// downlf/uploadf -n N: at most this many connections, each range at least
+// RANGE_MIN bytes
+#define MAX_STREAMS 16
+#define RANGE_MIN (1024 * 1024)
+#define RANGE_BUF (64 * 1024)
 
-int main() {
-  int socketfd = socket(AF_INET, SOCK_STREAM, 0);
-  struct sockaddr_in servAdd;
-  socklen_t len;
+// next word of the command line, NULL at the end. A word in double quotes
+// may contain spaces: uploadf "my notes.txt" /notes/
+static char *next_arg(char **pos) {
+  char *p = *pos;
+  while (*p && isspace((unsigned char)*p))
+    p++;
+  if (!*p) {
+    *pos = p;
+    return NULL;
+  }
+  char *start;
+  if (*p == '"') {
+    start = ++p;
+    while (*p && *p != '"')
+      p++;
+  } else {
+    start = p;
+    while (*p && !isspace((unsigned char)*p))
+      p++;
+  }
+  if (*p)
+    *p++ = '\0';
+  *pos = p;
+  return start;
+}
 
-  if (socketfd < 0) {
-    perror("Socket error");
-    exit(1);
+// send a command with its arguments: a v2 request, or for a legacy S1 the
+// "name arg arg" string it splits on spaces
+static int send_cmd(struct conn *c, int opcode, const char *name, int nargs,
+                    const char **args) {
+  c->reqid = proto_next_id();
+  if (!c->v2) {
+    char combined[1024];
+    snprintf(combined, sizeof(combined), "%s", name);
+    for (int i = 0; i < nargs; i++) {
+      if (strchr(args[i], ' ')) {
+        printf("Paths with spaces need protocol v2 (drop --legacy)\n");
+        return -1;
+      }
+      strncat(combined, " ", sizeof(combined) - strlen(combined) - 1);
+      strncat(combined, args[i], sizeof(combined) - strlen(combined) - 1);
+    }
+    return send_string(c->fd, combined);
+  }
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  for (int i = 0; i < nargs; i++) {
+    if (reqbuf_str(&rb, args[i]) < 0)
+      return -1;
   }
+  return send_request(c->fd, opcode, c->lz ? FRAME_LZ : 0, c->reqid, &rb);
+}
 
+// ask for len bytes of remotePath from byte off on (len 0: up to the end).
+// Ranges need protocol v2, a legacy S1 only gets the path and sends the
+// whole file
+static int send_downlf(struct conn *c, const char *path, long off, long len) {
+  if (!c->v2) {
+    const char *args[] = {path};
+    return send_cmd(c, OP_DOWNLF, "downlf", 1, args);
+  }
+  c->reqid = proto_next_id();
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  if (reqbuf_str(&rb, path) < 0 || reqbuf_u64(&rb, off) < 0 ||
+      reqbuf_u64(&rb, len) < 0)
+    return -1;
+  return send_request(c->fd, OP_DOWNLF, c->lz ? FRAME_LZ : 0, c->reqid,
+                      &rb);
+}
+
+// ask for the page of path's listing that follows cursor ("" for the first)
+static int send_list(struct conn *c, const char *path, long page,
+                     const char *cursor) {
+  c->reqid = proto_next_id();
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  if (reqbuf_str(&rb, path) < 0 || reqbuf_u64(&rb, page) < 0 ||
+      reqbuf_str(&rb, cursor) < 0)
+    return -1;
+  return send_request(c->fd, OP_DISPFNAMES, 0, c->reqid, &rb);
+}
+
+static int connect_s1(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  struct sockaddr_in servAdd;
+  memset(&servAdd, 0, sizeof(servAdd));
   servAdd.sin_family = AF_INET;
   servAdd.sin_port = htons((uint16_t)S1_PORT);
+  if (inet_pton(AF_INET, S1_HOST, &servAdd.sin_addr) <= 0 ||
+      connect(fd, (struct sockaddr *)&servAdd, sizeof(servAdd)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-  if (inet_pton(AF_INET, S1_HOST, &servAdd.sin_addr) < 0) {
-    fprintf(stderr, " inet_pton() has failed\n");
-    exit(2);
+// protocol v2 is agreed on once, right after connecting. f gets S1's answer
+static int hello(struct conn *c, int flags, struct frame *f) {
+  c->reqid = proto_next_id();
+  if (send_frame(c->fd, OP_HELLO, flags, c->reqid, 0) < 0 ||
+      recv_frame(c->fd, f) < 0 || f->opcode != OP_HELLO)
+    return -1;
+  return 0;
+}
+
+// one range of a parallel download, fetched over a connection of its own
+// and written in place with pwrite
+struct range_job {
+  pthread_t thread;
+  const char *path;
+  int fd;
+  long off;
+  long len;
+  long done; // bytes of the range that are on disk, from off on
+};
+
+static void *range_thread(void *arg) {
+  struct range_job *j = (struct range_job *)arg;
+  struct conn c = {connect_s1(), 1, 0, 0, 0};
+  struct frame f;
+  long total, n;
+  if (c.fd < 0 || hello(&c, 0, &f) < 0 ||
+      send_downlf(&c, j->path, j->off, j->len) < 0 ||
+      conn_recv_range(&c, &total, &n) < 0 || n != j->len) {
+    if (c.fd >= 0)
+      close(c.fd);
+    return NULL;
+  }
+  char *buf = (char *)malloc(RANGE_BUF);
+  while (buf && j->done < j->len) {
+    long chunk = j->len - j->done > RANGE_BUF ? RANGE_BUF : j->len - j->done;
+    if (recv_all(c.fd, buf, chunk) < 0 ||
+        pwrite(j->fd, buf, chunk, j->off + j->done) != chunk)
+      break;
+    j->done += chunk;
   }
+  free(buf);
+  close(c.fd);
+  return NULL;
+}
 
-  if (connect(socketfd, (struct sockaddr *)&servAdd, sizeof(servAdd)) < 0) {
-    fprintf(stderr, "connect() failed, exiting\n");
-    exit(3);
+// downlf -n N: split what is missing of the file into up to N ranges and
+// fetch them in parallel into a preallocated <name>.ranges. Completed, it
+// becomes the file; otherwise it is cut back to the part that arrived
+// without gaps and kept as <name>.part, so a plain downlf can resume it
+static void downlf_parallel(struct conn *c, const char *path,
+                            const char *fname, const char *part, long have,
+                            int nstreams) {
+  // a range past the end has no data but still tells the file size
+  long total, n;
+  if (send_downlf(c, path, LONG_MAX, 0) < 0 ||
+      conn_recv_range(c, &total, &n) < 0) {
+    printf("downlf: no size\n");
+    return;
+  }
+  if (total <= 0) {
+    printf("File not found or zero length.\n");
+    return;
   }
 
-  printf("Connected to S1 at %s:%d\n", S1_HOST, S1_PORT);
+  char tmp[1024];
+  snprintf(tmp, sizeof(tmp), "%s.ranges", fname);
+  if (have > total || (have > 0 && rename(part, tmp) != 0))
+    have = 0;
+  int fd = open(tmp, O_RDWR | O_CREAT | (have > 0 ? 0 : O_TRUNC), 0644);
+  if (fd < 0) {
+    printf("Cannot create local file %s\n", tmp);
+    return;
+  }
+  // preallocate, so the ranges land in place without growing the file
+  int err = posix_fallocate(fd, have, total - have);
+  if (err != 0) {
+    printf("Cannot preallocate %s: %s\n", tmp, strerror(err));
+    close(fd);
+    remove(tmp);
+    return;
+  }
 
-  while (1) {
-    printf("\nw25clients> ");
-    fflush(stdout);
+  long left = total - have;
+  long per = (left + nstreams - 1) / nstreams;
+  if (per < RANGE_MIN)
+    per = RANGE_MIN;
+  struct range_job jobs[MAX_STREAMS];
+  int njobs = 0;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (long off = have; off < total && njobs < nstreams; off += per) {
+    struct range_job *j = &jobs[njobs];
+    j->path = path;
+    j->fd = fd;
+    j->off = off;
+    j->len = total - off < per ? total - off : per;
+    j->done = 0;
+    if (pthread_create(&j->thread, NULL, range_thread, j) != 0)
+      break;
+    njobs++;
+  }
+  // the part without gaps: every range up to the first one that is short
+  long got = have;
+  int complete = njobs > 0;
+  for (int i = 0; i < njobs; i++) {
+    pthread_join(jobs[i].thread, NULL);
+    if (complete)
+      got += jobs[i].done;
+    if (jobs[i].done < jobs[i].len)
+      complete = 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
 
-    char line[1024];
+  if (got < total) {
+    if (ftruncate(fd, got) < 0 || close(fd) < 0 || rename(tmp, part) != 0) {
+      printf("Download of %s failed\n", fname);
+      remove(tmp);
+      return;
+    }
+    printf("Download of %s stopped at %ld of %ld bytes, downlf again to "
+           "resume\n",
+           fname, got, total);
+    return;
+  }
+  if (close(fd) < 0 || rename(tmp, fname) != 0) {
+    printf("Cannot rename %s to %s\n", tmp, fname);
+    return;
+  }
+  printf("Downloaded %s (%ld bytes, %d streams, %.1f MB/s)\n", fname, total,
+         njobs, secs > 0 ? (total - have) / secs / 1e6 : 0.0);
+}
 
-    if (!fgets(line, sizeof(line), stdin))
+// "-n N" in front of the arguments of uploadf and downlf: the number of
+// connections to use. *arg is moved past it. 0 without it, -1 if it is bad
+static int stream_count(struct conn *c, char **pos, char **arg) {
+  if (!*arg || strcmp(*arg, "-n") != 0)
+    return 0;
+  char *num = next_arg(pos);
+  int n = num ? atoi(num) : 0;
+  if (n < 1 || n > MAX_STREAMS) {
+    printf("-n needs a number of streams from 1 to %d\n", MAX_STREAMS);
+    return -1;
+  }
+  if (!c->v2) {
+    printf("Parallel transfers need protocol v2 (drop --legacy)\n");
+    return -1;
+  }
+  *arg = next_arg(pos);
+  return n;
+}
+
+// a multipart upload request: file name, destination and nnums numbers.
+// With data >= 0 it is a part and that many bytes of data follow
+static int send_upload(struct conn *c, int opcode, const char *name,
+                       const char *dest, int nnums, const long *nums,
+                       long data) {
+  c->reqid = proto_next_id();
+  struct reqbuf rb;
+  reqbuf_init(&rb);
+  if (reqbuf_str(&rb, name) < 0 || reqbuf_str(&rb, dest) < 0)
+    return -1;
+  for (int i = 0; i < nnums; i++) {
+    if (reqbuf_u64(&rb, nums[i]) < 0)
+      return -1;
+  }
+  if (data >= 0)
+    return send_request_data(c->fd, opcode, c->reqid, &rb, data);
+  return send_request(c->fd, opcode, 0, c->reqid, &rb);
+}
+
+// one part of a parallel upload, sent over a connection of its own straight
+// from the page cache
+struct part_job {
+  pthread_t thread;
+  const char *name;
+  const char *dest;
+  int fd;
+  long id;
+  long off;
+  long len;
+  int ok;
+};
+
+static void *part_thread(void *arg) {
+  struct part_job *j = (struct part_job *)arg;
+  struct conn c = {connect_s1(), 1, 0, 0, 0};
+  struct frame f;
+  long nums[] = {j->id, j->off};
+  long stored;
+  int rc = c.fd < 0 ? -1 : hello(&c, 0, &f);
+  if (rc == 0)
+    rc = send_upload(&c, OP_UPLOAD_PART, j->name, j->dest, 2, nums, j->len);
+  if (rc < 0 || send_file(c.fd, j->fd, j->off, j->len) < 0 ||
+      conn_recv_size(&c, &stored, NULL) < 0) {
+    if (c.fd >= 0)
+      close(c.fd);
+    return NULL;
+  }
+  j->ok = stored == j->len;
+  close(c.fd);
+  return NULL;
+}
+
+// uploadf -n N: open an upload session, send the file as up to N parts in
+// parallel, each over its own connection, and commit the session. The
+// server writes the parts into a preallocated staging file and renames it
+// into place on commit, so the file only appears once it is complete
+static void uploadf_parallel(struct conn *c, const char *filename,
+                             const char *dest, int nstreams) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size <= 0) {
+    printf("Cannot open local file.\n");
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  long size = st.st_size;
+  long id;
+  if (send_upload(c, OP_UPLOAD_OPEN, filename, dest, 1, &size, -1) < 0 ||
+      conn_recv_size(c, &id, NULL) < 0 || id <= 0) {
+    printf("Upload of %s failed: no upload session\n", filename);
+    close(fd);
+    return;
+  }
+
+  long per = (size + nstreams - 1) / nstreams;
+  if (per < RANGE_MIN)
+    per = RANGE_MIN;
+  struct part_job jobs[MAX_STREAMS];
+  int njobs = 0;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (long off = 0; off < size && njobs < nstreams; off += per) {
+    struct part_job *j = &jobs[njobs];
+    j->name = filename;
+    j->dest = dest;
+    j->fd = fd;
+    j->id = id;
+    j->off = off;
+    j->len = size - off < per ? size - off : per;
+    j->ok = 0;
+    if (pthread_create(&j->thread, NULL, part_thread, j) != 0)
       break;
+    njobs++;
+  }
+  long sent = 0;
+  for (int i = 0; i < njobs; i++) {
+    pthread_join(jobs[i].thread, NULL);
+    if (jobs[i].ok)
+      sent += jobs[i].len;
+  }
+  close(fd);
 
-    char *command = strtok(line, " \t\r\n");
-    if (!command)
-      continue;
+  // commit only when every part is in, the session expires on its own
+  // otherwise
+  long final = 0;
+  if (sent == size &&
+      (send_upload(c, OP_UPLOAD_COMMIT, filename, dest, 1, &id, -1) < 0 ||
+       conn_recv_size(c, &final, NULL) < 0))
+    final = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  if (final != size) {
+    printf("Upload of %s failed (%ld of %ld bytes stored)\n", filename, sent,
+           size);
+    return;
+  }
+  printf("Uploaded %s to %s (%ld bytes, %d streams, %.1f MB/s)\n", filename,
+         dest, size, njobs, secs > 0 ? size / secs / 1e6 : 0.0);
+}
 
-    if (strcmp(command, "uploadf") == 0) {
-      // parse filename, dest
-      char *filename = strtok(NULL, " \t\r\n");
-      char *dest = strtok(NULL, " \t\r\n");
-      if (!filename || !dest) {
-        printf("uploadf needs a filename and a destination path\n");
-        continue;
-      }
-      // send "uploadf filename dest"
-      // since we need to send the command along with the file to s1,
-      // we do send_string: "uploadf filename dest"
-      // and S1 will parse it, then expect file data
-      char combined[1024];
-      snprintf(combined, sizeof(combined), "uploadf %s %s", filename, dest);
-      send_string(socketfd, combined);
-
-      // read local file
-      // using fopen because we don't have to specify a file size
-      FILE *fp = fopen(filename, "rb");
-      if (!fp) {
-        // we still need to send 0 bytes to s1 since s1 needs to know something
-        // went wrong and doesn't expect the file
-        send_string(socketfd, "0");
-        printf("Cannot open local file.\n");
-        continue;
-      }
-      // using fseek and ftell to get file size instead of lseek because of the
-      // use of fopen instead of open
-      fseek(fp, 0, SEEK_END);
-      long sz = ftell(fp);
-      fseek(fp, 0, SEEK_SET);
-
-      char szbuf[64];
-      sprintf(szbuf, "%ld", sz);
-      send_string(socketfd, szbuf);
-
-      char buf[4096];
-      while (!feof(fp)) {
-        size_t file_size = fread(buf, 1, 4096, fp);
-        if (file_size > 0) {
-          if (send_all(socketfd, buf, file_size) < 0) {
-            printf("Send error\n");
-            break;
-          }
-        }
-      }
-      fclose(fp);
-      printf("Uploaded %s to %s\n", filename, dest);
-    } else if (strcmp(command, "downlf") == 0) {
-      // parse file path
-      char *remotePath = strtok(NULL, " \t\r\n");
-      if (!remotePath) {
-        printf("downlf needs a file path\n");
-        continue;
-      }
-      // send command
-      char combined[1024];
-      snprintf(combined, sizeof(combined), "downlf %s", remotePath);
-      send_string(socketfd, combined);
-
-      // S1 will respond with size, then data
-      char *sizestr = recv_string(socketfd);
-      if (!sizestr) {
+// --mux: every command gets a stream of its own on the connection
+static struct mux *mux;
+// --compress, once S1 agreed: data may travel compressed both ways
+static int compress;
+
+// commands still running in the background
+static pthread_mutex_t bg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bg_done = PTHREAD_COND_INITIALIZER;
+static int bg_running;
+
+// run one command line on connection c
+static void run_command(struct conn *c, char *command, char *pos) {
+  if (strcmp(command, "uploadf") == 0) {
+    // parse filename, dest, optionally after -n N for a parallel upload
+    char *filename = next_arg(&pos);
+    int nstreams = stream_count(c, &pos, &filename);
+    if (nstreams < 0)
+      return;
+    char *dest = next_arg(&pos);
+    if (!filename || !dest) {
+      printf("uploadf needs a filename and a destination path\n");
+      return;
+    }
+    if (nstreams > 0) {
+      uploadf_parallel(c, filename, dest, nstreams);
+      return;
+    }
+    // send "uploadf filename dest"
+    // since we need to send the command along with the file to s1,
+    // the command goes first and S1 will parse it, then expect file data
+    const char *args[] = {filename, dest};
+    if (send_cmd(c, OP_UPLOADF, "uploadf", 2, args) < 0)
+      return;
+
+    // read local file
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      // we still need to send 0 bytes to s1 since s1 needs to know something
+      // went wrong and doesn't expect the file
+      if (fd >= 0)
+        close(fd);
+      conn_send_size(c, 0);
+      printf("Cannot open local file.\n");
+      return;
+    }
+
+    // size, then the file straight from the page cache, or compressed when
+    // S1 takes that and it pays off. Zip archives are compressed already
+    struct conn up = *c;
+    const char *ext = strrchr(filename, '.');
+    if (ext && strcmp(ext, ".zip") == 0)
+      up.lz = 0;
+    if (conn_send_data(&up, -1, fd, 0, st.st_size) < 0)
+      printf("Send error\n");
+    close(fd);
+    printf("Uploaded %s to %s\n", filename, dest);
+  } else if (strcmp(command, "downlf") == 0) {
+    // parse file path, optionally after -n N for a parallel download
+    char *remotePath = next_arg(&pos);
+    int nstreams = stream_count(c, &pos, &remotePath);
+    if (nstreams < 0)
+      return;
+    if (!remotePath) {
+      printf("downlf needs a file path\n");
+      return;
+    }
+    // extract the filename from remotePath
+    char *slash = strrchr(remotePath, '/');
+    const char *fname = slash ? slash + 1 : remotePath;
+
+    // the data goes to <name>.part and is renamed once it is complete, so a
+    // download that was cut off can go on from where it stopped
+    char part[1024];
+    snprintf(part, sizeof(part), "%s.part", fname);
+    struct stat st;
+    long have = 0;
+    if (c->v2 && stat(part, &st) == 0)
+      have = st.st_size;
+    if (nstreams > 0) {
+      downlf_parallel(c, remotePath, fname, part, have, nstreams);
+      return;
+    }
+
+    // S1 will respond with the file size and the size of the data that
+    // follows (what we do not have yet)
+    long total, sz;
+    for (;;) {
+      if (send_downlf(c, remotePath, have, 0) < 0)
+        return;
+      if (conn_recv_range(c, &total, &sz) < 0) {
         printf("downlf: no size\n");
-        continue;
-      }
-      long sz = atol(sizestr);
-      free(sizestr);
-      if (sz <= 0) {
-        printf("File not found or zero length.\n");
-        continue;
-      }
-      // extract the filename from remotePath
-      char *slash = strrchr(remotePath, '/');
-      const char *fname = slash ? slash + 1 : remotePath;
-
-      FILE *fp = fopen(fname, "wb");
-      if (!fp) {
-        printf("Cannot create local file %s\n", fname);
-        // even if file cannot be created, data from S1 must be read and
-        // discarded so that the communication channel is clear for future
-        // operations
-        long left = sz;
-        char tmp[4096];
-        while (left > 0) {
-          // reading in chunks reduces the number of i/o operations
-          long chunk = (left > 4096) ? 4096 : left;
-          if (recv_all(socketfd, tmp, chunk) < 0)
-            break;
-          left -= chunk;
-        }
-        continue;
-      }
-      // get actual file if file can be created
-      long left = sz;
-      char buf[4096];
-      while (left > 0) {
-        long chunk = (left > 4096) ? 4096 : left;
-        if (recv_all(socketfd, buf, chunk) < 0) {
-          break;
-        }
-        // writing to file in chunks
-        fwrite(buf, 1, chunk, fp);
-        left -= chunk;
+        return;
       }
-      fclose(fp);
-      printf("Downloaded %s (%ld bytes)\n", fname, sz);
-    } else if (strcmp(command, "removef") == 0) {
-      char *remotePath = strtok(NULL, " \t\r\n");
-      if (!remotePath) {
-        printf("removef needs file path\n");
-        continue;
-      }
-      char combined[1024];
-      snprintf(combined, sizeof(combined), "removef %s", remotePath);
-      send_string(socketfd, combined);
-      printf("Removing file %s\n", remotePath);
-
-    } else if (strcmp(command, "downltar") == 0) {
-      // extract file type
-      char *ft = strtok(NULL, " \t\r\n");
-      if (!ft) {
-        printf("downltar needs file type .c|.txt|.pdf (no zips) \n");
-        continue;
-      }
-      char combined[1024];
-      snprintf(combined, sizeof(combined), "downltar %s", ft);
-      send_string(socketfd, combined);
-
-      // will return 0 if no files of type ft are available
-      char *sizestr = recv_string(socketfd);
-      if (!sizestr) {
-        printf("No size returned.\n");
-        continue;
-      }
-      long sz = atol(sizestr);
-      free(sizestr);
-      if (sz <= 0) {
-        printf("No available files of type %s to archive.\n", ft);
+      // a .part longer than the file belongs to some other file, start over
+      if (have > total && total > 0) {
+        have = 0;
         continue;
       }
+      break;
+    }
+    if (total <= 0) {
+      printf("File not found or zero length.\n");
+      return;
+    }
+    // a server that ignores the range sends the whole file
+    if (sz == total)
+      have = 0;
 
-      // decide local name
-      char localfn[50];
-      if (strcmp(ft, ".c") == 0)
-        strcpy(localfn, "cfiles.tar");
-      else if (strcmp(ft, ".pdf") == 0)
-        strcpy(localfn, "pdf.tar");
-      else if (strcmp(ft, ".txt") == 0)
-        strcpy(localfn, "text.tar");
-      else {
-        printf("File type %s not supported for archiving\n", ft);
-        continue;
-      }
+    int fd = open(part, O_WRONLY | O_CREAT | (have > 0 ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+      printf("Cannot create local file %s\n", part);
+      // even if file cannot be created, data from S1 must be read and
+      // discarded so that the communication channel is clear for future
+      // operations
+      conn_recv_data(c, -1, 0, sz);
+      return;
+    }
+    // get actual file if file can be created, unpacking it on the way if
+    // S1 compressed it. What arrived is kept in order, so a download that
+    // broke off resumes from the end of the .part file
+    int rc = conn_recv_data(c, fd, have, sz);
+    if (fstat(fd, &st) < 0)
+      st.st_size = have;
+    if (close(fd) != 0 || rc < 0) {
+      printf("Download of %s stopped at %ld of %ld bytes, downlf again to "
+             "resume\n",
+             fname, (long)st.st_size, total);
+      return;
+    }
+    if (rename(part, fname) != 0) {
+      printf("Cannot rename %s to %s\n", part, fname);
+      return;
+    }
+    if (have > 0)
+      printf("Downloaded %s (%ld bytes, resumed at %ld)\n", fname, total,
+             have);
+    else
+      printf("Downloaded %s (%ld bytes)\n", fname, total);
+  } else if (strcmp(command, "removef") == 0) {
+    char *remotePath = next_arg(&pos);
+    if (!remotePath) {
+      printf("removef needs file path\n");
+      return;
+    }
+    const char *args[] = {remotePath};
+    if (send_cmd(c, OP_REMOVEF, "removef", 1, args) < 0)
+      return;
+    printf("Removing file %s\n", remotePath);
 
-      FILE *fp = fopen(localfn, "wb");
-      if (!fp) {
-        printf("Cannot create %s\n", localfn);
-        // discard data
-        while (sz > 0) {
-          long chunk = (sz > 4096) ? 4096 : sz;
-          char tmp[4096];
-          if (recv_all(socketfd, tmp, chunk) < 0)
-            break;
-          sz -= chunk;
-        }
-        continue;
-      }
+  } else if (strcmp(command, "downltar") == 0) {
+    // extract file type
+    char *ft = next_arg(&pos);
+    if (!ft) {
+      printf("downltar needs file type .c|.txt|.pdf (no zips) \n");
+      return;
+    }
+    const char *args[] = {ft};
+    if (send_cmd(c, OP_DOWNLTAR, "downltar", 1, args) < 0)
+      return;
+
+    // will return 0 if no files of type ft are available. S1 streams
+    // archives it builds on the fly in chunks (see TAR_CHUNKED),
+    // otherwise sz is the archive size
+    long sz;
+    int chunked;
+    if (conn_recv_size(c, &sz, &chunked) < 0) {
+      printf("No size returned.\n");
+      return;
+    }
+    if (sz <= 0 && !chunked) {
+      printf("No available files of type %s to archive.\n", ft);
+      return;
+    }
+
+    // decide local name
+    char localfn[50];
+    if (strcmp(ft, ".c") == 0)
+      strcpy(localfn, "cfiles.tar");
+    else if (strcmp(ft, ".pdf") == 0)
+      strcpy(localfn, "pdf.tar");
+    else if (strcmp(ft, ".txt") == 0)
+      strcpy(localfn, "text.tar");
+    else {
+      printf("File type %s not supported for archiving\n", ft);
+      return;
+    }
+
+    // if the file cannot be created the data is still read and discarded
+    FILE *fp = fopen(localfn, "wb");
+    if (!fp)
+      printf("Cannot create %s\n", localfn);
+
+    // an archive of known size may come compressed
+    if (!chunked) {
+      int rc = conn_recv_data(c, fp ? fileno(fp) : -1, 0, sz);
+      if (!fp)
+        return;
+      if (fclose(fp) != 0 || rc < 0)
+        printf("Transfer of %s failed\n", localfn);
+      else
+        printf("Received %s (%ld bytes)\n", localfn, sz);
+      return;
+    }
 
-      // getting archive from S1
+    // otherwise every chunk starts with its length and an empty chunk ends
+    // the archive
+    long total = 0;
+    int failed = 0;
+    while (1) {
+      uint32_t n;
+      if (recv_all(c->fd, &n, 4) < 0) {
+        failed = 1;
+        break;
+      }
+      sz = ntohl(n);
+      if (sz == 0)
+        break;
       while (sz > 0) {
         long chunk = (sz > 4096) ? 4096 : sz;
         char tmp[4096];
-        if (recv_all(socketfd, tmp, chunk) < 0)
+        if (recv_all(c->fd, tmp, chunk) < 0) {
+          failed = 1;
           break;
-        fwrite(tmp, 1, chunk, fp);
+        }
+        if (fp)
+          fwrite(tmp, 1, chunk, fp);
         sz -= chunk;
+        total += chunk;
       }
-      fclose(fp);
-      printf("Received %s\n", localfn);
+      if (failed)
+        break;
+    }
+    if (!fp)
+      return;
+    fclose(fp);
+    if (failed)
+      printf("Transfer of %s failed\n", localfn);
+    else
+      printf("Received %s (%ld bytes)\n", localfn, total);
 
-    } else if (strcmp(command, "dispfnames") == 0) {
-      char *p = strtok(NULL, " \t\r\n");
-      if (!p) {
-        printf("dispfnames needs pathname\n");
-        continue;
+  } else if (strcmp(command, "dispfnames") == 0) {
+    // "-p N" in front of the path: names per page
+    char *p = next_arg(&pos);
+    long page = LIST_PAGE;
+    if (p && strcmp(p, "-p") == 0) {
+      char *num = next_arg(&pos);
+      page = num ? atol(num) : 0;
+      if (page < 1 || page > LIST_PAGE_MAX) {
+        printf("-p needs a page size from 1 to %d\n", LIST_PAGE_MAX);
+        return;
       }
-      char combined[1024];
-      snprintf(combined, sizeof(combined), "dispfnames %s", p);
-      send_string(socketfd, combined);
+      p = next_arg(&pos);
+    }
+    if (!p) {
+      printf("dispfnames needs pathname\n");
+      return;
+    }
 
-      // read list
-      char *listing = recv_string(socketfd);
+    // a legacy S1 sends everything it has in one reply
+    if (!c->v2) {
+      const char *args[] = {p};
+      if (send_cmd(c, OP_DISPFNAMES, "dispfnames", 1, args) < 0)
+        return;
+      char *listing = conn_recv_blob(c, NULL);
       if (!listing) {
         printf("No listing.\n");
-        continue;
+        return;
       }
       printf("Files:\n%s", listing);
       free(listing);
-    } else if (strcmp(command, "exit") == 0) {
+      return;
+    }
+
+    // otherwise page by page, each printed as it arrives, until the cursor
+    // comes back empty
+    char *cursor = strdup("");
+    printf("Files:\n");
+    while (cursor) {
+      char *listing = NULL;
+      char *nl;
+      if (send_list(c, p, page, cursor) < 0 ||
+          !(listing = conn_recv_blob(c, NULL)) ||
+          !(nl = strchr(listing, '\n'))) {
+        printf("No listing.\n");
+        free(listing);
+        break;
+      }
+      fputs(nl + 1, stdout);
+      *nl = '\0';
+      free(cursor);
+      cursor = listing[0] ? strdup(listing) : NULL;
+      free(listing);
+    }
+    free(cursor);
+  } else {
+    printf("Unrecognized command %s\n", command);
+  }
+}
+
+// S1 closes a session that has been idle for a while. Before the next
+// command, find out whether it did and if so connect again, so a prompt
+// left alone does not end in an error
+static int s1_reconnect(struct conn *c) {
+  char b;
+  if (recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) != 0)
+    return 0;
+  close(c->fd);
+  c->fd = connect_s1();
+  struct frame f;
+  if (c->fd < 0 || (c->v2 && hello(c, c->lz ? HELLO_LZ : 0, &f) < 0)) {
+    printf("Connection to S1 lost\n");
+    return -1;
+  }
+  if (c->v2)
+    c->lz = compress = c->lz && (f.flags & HELLO_LZ);
+  return 0;
+}
+
+// run a command line, on a fresh stream when multiplexing
+static void exec_line(struct conn *c, char *line) {
+  char *pos = line;
+  char *command = next_arg(&pos);
+  if (!command)
+    return;
+  if (!mux) {
+    run_command(c, command, pos);
+    return;
+  }
+  struct conn sc = {mux_open(mux), 1, 0, compress, 0};
+  if (sc.fd < 0) {
+    printf("Connection to S1 lost\n");
+    return;
+  }
+  run_command(&sc, command, pos);
+  mux_close(mux, sc.fd);
+}
+
+static void *background_thread(void *arg) {
+  char *line = (char *)arg;
+  exec_line(NULL, line);
+  free(line);
+  pthread_mutex_lock(&bg_lock);
+  bg_running--;
+  pthread_cond_broadcast(&bg_done);
+  pthread_mutex_unlock(&bg_lock);
+  return NULL;
+}
+
+static void start_background(const char *line) {
+  char *copy = strdup(line);
+  pthread_t t;
+  pthread_mutex_lock(&bg_lock);
+  bg_running++;
+  pthread_mutex_unlock(&bg_lock);
+  if (!copy || pthread_create(&t, NULL, background_thread, copy) != 0) {
+    printf("Cannot start background command\n");
+    free(copy);
+    pthread_mutex_lock(&bg_lock);
+    bg_running--;
+    pthread_mutex_unlock(&bg_lock);
+    return;
+  }
+  pthread_detach(t);
+}
+
+static void wait_background(void) {
+  pthread_mutex_lock(&bg_lock);
+  while (bg_running > 0)
+    pthread_cond_wait(&bg_done, &bg_lock);
+  pthread_mutex_unlock(&bg_lock);
+}
+
+int main(int argc, char **argv) {
+  // --legacy talks the old string protocol, for S1 builds without v2.
+  // --mux multiplexes commands over the connection, which lets commands
+  // ending in & run in the background. --compress lets file data travel
+  // compressed, for slow links to S1
+  int legacy = 0;
+  int want_mux = 0;
+  int want_lz = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--legacy") == 0) {
+      legacy = 1;
+    } else if (strcmp(argv[i], "--mux") == 0) {
+      want_mux = 1;
+    } else if (strcmp(argv[i], "--compress") == 0) {
+      want_lz = 1;
+    } else {
+      fprintf(stderr, "usage: %s [--legacy | [--mux] [--compress]]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (legacy && (want_mux || want_lz)) {
+    fprintf(stderr, "%s needs protocol v2\n",
+            want_mux ? "--mux" : "--compress");
+    exit(1);
+  }
+
+  int socketfd = connect_s1();
+  if (socketfd < 0) {
+    fprintf(stderr, "connect() failed, exiting\n");
+    exit(3);
+  }
+
+  struct conn c = {socketfd, !legacy, 0, 0, 0};
+  if (c.v2) {
+    struct frame f;
+    int flags = (want_mux ? HELLO_MUX : 0) | (want_lz ? HELLO_LZ : 0);
+    if (hello(&c, flags, &f) < 0) {
+      fprintf(stderr, "S1 does not speak protocol v2, try --legacy\n");
+      exit(3);
+    }
+    if (want_lz && !(f.flags & HELLO_LZ))
+      printf("S1 does not take compressed data, sending it as it is\n");
+    c.lz = compress = want_lz && (f.flags & HELLO_LZ);
+    if (want_mux && !(f.flags & HELLO_MUX))
+      printf("S1 does not multiplex, commands run one at a time\n");
+    else if (want_mux && !(mux = mux_client(socketfd))) {
+      fprintf(stderr, "cannot start multiplexing\n");
+      exit(3);
+    }
+  }
+
+  printf("Connected to S1 at %s:%d\n", S1_HOST, S1_PORT);
+
+  while (1) {
+    printf("\nw25clients> ");
+    fflush(stdout);
+
+    char line[1024];
+
+    if (!fgets(line, sizeof(line), stdin))
+      break;
+
+    // a trailing & runs the command in the background
+    size_t n = strcspn(line, "\r\n");
+    while (n > 0 && isspace((unsigned char)line[n - 1]))
+      n--;
+    int background = n > 0 && line[n - 1] == '&';
+    line[background ? n - 1 : n] = '\0';
+
+    // look at the command word on a copy, the line is run as a whole
+    char word[1024];
+    strcpy(word, line);
+    char *pos = word;
+    char *command = next_arg(&pos);
+    if (!command)
+      continue;
+    if (strcmp(command, "exit") == 0) {
       // exit out of program
       break;
-    } else {
-      printf("Unrecognized command %s\n", command);
+    }
+    if (strcmp(command, "wait") == 0) {
+      wait_background();
       continue;
     }
+    if (background && mux) {
+      start_background(line);
+    } else {
+      if (background)
+        printf("Background commands need --mux, running it now\n");
+      if (!mux && s1_reconnect(&c) < 0)
+        break;
+      exec_line(&c, line);
+    }
   }
-  close(socketfd);
+  // let background commands finish before the connection goes away
+  wait_background();
+  if (mux)
+    mux_drain(mux);
+  close(c.fd);
   return 0;
 }
+